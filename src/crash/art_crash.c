@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "art_crash.h"
+
+#define LINE		64
+#define MAX_INFLIGHT	4096
+
+/**
+ * A line flushed since the last fence, with its contents
+ * at the time of the flush.
+ */
+typedef struct {
+	unsigned long off;
+	unsigned char data[LINE];
+} inflight_line;
+
+static struct {
+	int armed;
+	char *base;
+	unsigned long size;
+	unsigned long points;
+	unsigned long target;
+	jmp_buf *env;
+	unsigned char *durable;
+	unsigned char *cache;
+	inflight_line inflight[MAX_INFLIGHT];
+	int ninflight;
+} pm;
+
+static void crash_point(void) {
+	if (!pm.armed)
+		return;
+	pm.points++;
+	if (pm.points != pm.target)
+		return;
+
+	// Whatever is not durable yet is still in the CPU cache
+	memcpy(pm.cache, pm.base, pm.size);
+	pm.armed = 0;
+	longjmp(*pm.env, 1);
+}
+
+/**
+ * Reports a clflush of the line holding addr
+ */
+void art_crash_flush(void *addr) {
+	unsigned long off = ((char *)addr - pm.base) & ~(unsigned long)(LINE - 1);
+	int i;
+
+	if (!pm.armed || (char *)addr < pm.base || off >= pm.size)
+		return;
+	crash_point();
+
+	for (i = 0; i < pm.ninflight; i++)
+		if (pm.inflight[i].off == off)
+			break;
+	if (i == pm.ninflight) {
+		// Too many unfenced flushes, let the oldest one complete
+		if (pm.ninflight == MAX_INFLIGHT) {
+			memcpy(pm.durable + pm.inflight[0].off, pm.inflight[0].data, LINE);
+			memmove(pm.inflight, pm.inflight + 1, sizeof(inflight_line) * --pm.ninflight);
+			i--;
+		}
+		pm.ninflight++;
+	}
+	pm.inflight[i].off = off;
+	memcpy(pm.inflight[i].data, pm.base + off, LINE);
+}
+
+/**
+ * Reports an mfence
+ */
+void art_crash_fence(void) {
+	int i;
+
+	if (!pm.armed)
+		return;
+	crash_point();
+
+	for (i = 0; i < pm.ninflight; i++)
+		memcpy(pm.durable + pm.inflight[i].off, pm.inflight[i].data, LINE);
+	pm.ninflight = 0;
+}
+
+/**
+ * Starts emulating PM for [base, base + size). Its current contents
+ * are taken as durable.
+ * @arg target The crash point to stop at, counting from 1. The run
+ * longjmps to env there. 0 never stops.
+ */
+void art_crash_arm(void *base, unsigned long size, unsigned long target, jmp_buf *env) {
+	if (pm.size != size) {
+		free(pm.durable);
+		free(pm.cache);
+		pm.durable = malloc(size);
+		pm.cache = malloc(size);
+	}
+	pm.base = base;
+	pm.size = size;
+	pm.points = 0;
+	pm.target = target;
+	pm.env = env;
+	pm.ninflight = 0;
+	memcpy(pm.durable, base, size);
+	pm.armed = 1;
+}
+
+/**
+ * Stops emulating PM and counting crash points.
+ */
+void art_crash_disarm(void) {
+	pm.armed = 0;
+}
+
+/**
+ * Returns the number of crash points passed since arming
+ */
+unsigned long art_crash_points(void) {
+	return pm.points;
+}
+
+/**
+ * Builds one PM image that may have survived the crash: the durable
+ * contents, plus for every line whose persistence is uncertain
+ * (flushed without a fence, or written but not flushed) one of its
+ * possible contents.
+ * @arg out Receives the image, size bytes
+ * @arg variant 0 takes no uncertain line, 1 takes the newest content
+ * of every line, other values pick at random.
+ */
+void art_crash_image(void *out, unsigned long variant) {
+	unsigned char *img = out;
+	unsigned long off;
+	int i;
+
+	memcpy(img, pm.durable, pm.size);
+	if (variant == 0)
+		return;
+	if (variant == 1) {
+		memcpy(img, pm.cache, pm.size);
+		return;
+	}
+
+	srand(variant);
+	for (i = 0; i < pm.ninflight; i++)
+		if (rand() & 1)
+			memcpy(img + pm.inflight[i].off, pm.inflight[i].data, LINE);
+	for (off = 0; off < pm.size; off += LINE)
+		if (memcmp(pm.durable + off, pm.cache + off, LINE) && (rand() & 1))
+			memcpy(img + off, pm.cache + off, LINE);
+}
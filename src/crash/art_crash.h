@@ -0,0 +1,59 @@
+#include <stdint.h>
+#include <setjmp.h>
+#ifndef ART_CRASH_H
+#define ART_CRASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Crash point injection. Trees and the pool built with
+ * -DART_CRASH_TEST report every cache line they flush and every
+ * fence. Each report is a crash point: the harness emulates what
+ * has reached PM so far and can stop the run at any of them.
+ */
+
+/**
+ * Reports a clflush of the line holding addr
+ */
+void art_crash_flush(void *addr);
+
+/**
+ * Reports an mfence
+ */
+void art_crash_fence(void);
+
+/**
+ * Starts emulating PM for [base, base + size). Its current contents
+ * are taken as durable.
+ * @arg target The crash point to stop at, counting from 1. The run
+ * longjmps to env there. 0 never stops.
+ */
+void art_crash_arm(void *base, unsigned long size, unsigned long target, jmp_buf *env);
+
+/**
+ * Stops emulating PM and counting crash points.
+ */
+void art_crash_disarm(void);
+
+/**
+ * Returns the number of crash points passed since arming
+ */
+unsigned long art_crash_points(void);
+
+/**
+ * Builds one PM image that may have survived the crash: the durable
+ * contents, plus for every line whose persistence is uncertain
+ * (flushed without a fence, or written but not flushed) one of its
+ * possible contents.
+ * @arg out Receives the image, size bytes
+ * @arg variant 0 takes no uncertain line, 1 takes the newest content
+ * of every line, other values pick at random.
+ */
+void art_crash_image(void *out, unsigned long variant);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,429 @@
+/*
+ * Crash consistency harness.
+ *
+ * Runs a fixed insert workload on a tree in a file-backed pool,
+ * stops it at every flush and fence in turn, replays the PM images
+ * that may have survived through art_tree_open() and checks every
+ * key against a reference. Build with -DART_CRASH_TEST together
+ * with art_crash.c, art_pool.c and one tree (-DUSE_WOART for WOART).
+ *
+ * usage: crash_test [-n ops] [-v variants] [-k point] [-a] [-x] [-c every]
+ *		[-d every] [-p pool]
+ *
+ * -x commits the inserts in transactions of SYNC_EVERY, which must
+ * survive whole or not at all. -c compacts one subtree with
+ * art_compact() after every given number of inserts. -d makes every
+ * given op an art_drop_prefix(), every other one followed by an
+ * art_attach_prefix() that puts the dropped keys back. Each attach
+ * rebuilds its source from the earlier keys, so the crash points
+ * grow with the square of the ops; -d runs DROP_OPS ops instead of
+ * DEFAULT_OPS unless -n is given, to finish in about the same time.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <setjmp.h>
+#include "art_crash.h"
+#include "../pool/art_pool.h"
+#ifdef USE_WOART
+#include "../woart/woart.h"
+#else
+#include "../wort/wort.h"
+#endif
+
+#define POOL_SIZE	(4UL << 20)
+#define SYNC_EVERY	4
+#define DEFAULT_OPS	400
+#define DROP_OPS	100
+
+#define OP_INSERT	0
+#define OP_DROP		1
+#define OP_ATTACH	2
+
+typedef struct {
+	unsigned long key;
+	void *value;
+	int kind;
+	int bits;
+} op;
+
+static op *ops;
+static int nops;
+static int async_mode;
+static int compact_every;
+static int drop_every;
+static int txn_mode;
+
+static art_pool *pool;
+static art_tree *tree;
+static unsigned char *pristine;
+static unsigned char *image;
+
+static volatile int cur_op;
+static volatile int synced_op;
+static jmp_buf crash_env;
+
+static unsigned long xorshift(unsigned long *s) {
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+/*
+ * Keys that exercise every insert path: random keys, keys sharing
+ * prefixes longer than MAX_PREFIX_LEN, dense keys that grow nodes
+ * to full size, and updates of existing keys. Drops take the prefix
+ * of an earlier key, rounded to whole digits, from a whole tree down
+ * to a single key.
+ */
+static void make_ops(int n) {
+	static const int drop_bits[] = { 8, 4, 36, 64, 12, 0 };
+	unsigned long s = 88172645463325252UL;
+	int i, d;
+
+	ops = malloc(sizeof(op) * n);
+	for (i = 0; i < n; i++) {
+		ops[i].kind = OP_INSERT;
+		ops[i].value = (void *)(unsigned long)((i + 1) << 4);
+		if (drop_every && i && (i + 1) % drop_every == 0) {
+			d = (i + 1) / drop_every;
+			ops[i].kind = OP_DROP;
+			ops[i].key = ops[xorshift(&s) % i].key;
+			ops[i].bits = drop_bits[d % 6] / NODE_BITS * NODE_BITS;
+			continue;
+		}
+		if (i && ops[i - 1].kind == OP_DROP && (i / drop_every) % 2) {
+			ops[i].kind = OP_ATTACH;
+			ops[i].key = ops[i - 1].key;
+			ops[i].bits = ops[i - 1].bits;
+			continue;
+		}
+		switch (i % 5) {
+			case 0:
+				ops[i].key = xorshift(&s);
+				break;
+			case 1:
+				ops[i].key = 0x1234567800000000UL | (xorshift(&s) & 0xfff0f);
+				break;
+			case 2:
+			case 3:
+				ops[i].key = i;
+				break;
+			default:
+				ops[i].key = ops[xorshift(&s) % i].key;
+		}
+	}
+	nops = n;
+}
+
+static int has_prefix(unsigned long key, const op *o) {
+	return !o->bits || key >> (64 - o->bits) == o->key >> (64 - o->bits);
+}
+
+/*
+ * Value of the key after op j, given its value before. An attach
+ * puts back every key inserted before it under the prefix that the
+ * drop before it removed.
+ */
+static void* apply_op(int j, unsigned long key, void *value) {
+	int k;
+
+	switch (ops[j].kind) {
+		case OP_INSERT:
+			return ops[j].key == key ? ops[j].value : value;
+		case OP_DROP:
+			return has_prefix(key, &ops[j]) ? NULL : value;
+		default:
+			if (!has_prefix(key, &ops[j]))
+				return value;
+			for (k = 0; k < j; k++)
+				if (ops[k].kind == OP_INSERT && ops[k].key == key)
+					return ops[j].value;
+			return value;
+	}
+}
+
+static void run_attach(int i) {
+	art_tree *src = art_pool_alloc(sizeof(art_tree));
+	int k;
+
+	art_tree_init(src);
+	for (k = 0; k < i; k++)
+		if (ops[k].kind == OP_INSERT && has_prefix(ops[k].key, &ops[i]))
+			art_insert(src, ops[k].key, 8, ops[i].value);
+	art_attach_prefix(tree, ops[i].key, ops[i].bits, src);
+	art_pool_free(src);
+}
+
+static void run_txns(int from, int to) {
+	art_txn tx;
+	int i, end;
+
+	for (i = from; i < to; i = end) {
+		end = i + SYNC_EVERY < to ? i + SYNC_EVERY : to;
+		art_txn_begin(tree, &tx);
+		for (cur_op = i; cur_op < end; cur_op++)
+			art_txn_put(&tx, ops[cur_op].key, 8, ops[cur_op].value);
+		cur_op = end - 1;
+		art_txn_commit(&tx);
+		synced_op = end;
+		if (compact_every && end / compact_every != i / compact_every)
+			art_compact(tree, 1);
+	}
+}
+
+static void run_ops(int from, int to, int async) {
+	int i;
+
+	for (i = from; i < to; i++) {
+		cur_op = i;
+		if (ops[i].kind != OP_INSERT) {
+			// Both sync pending inserts first
+			if (ops[i].kind == OP_DROP)
+				art_drop_prefix(tree, ops[i].key, ops[i].bits);
+			else
+				run_attach(i);
+			synced_op = i + 1;
+		} else if (async) {
+			art_insert_async(tree, ops[i].key, 8, ops[i].value, NULL);
+			if ((i + 1) % SYNC_EVERY == 0) {
+				art_sync(tree);
+				synced_op = i + 1;
+			}
+		} else {
+			art_insert(tree, ops[i].key, 8, ops[i].value);
+			synced_op = i + 1;
+		}
+		if (compact_every && (i + 1) % compact_every == 0)
+			art_compact(tree, 1);
+	}
+	if (async) {
+		art_sync(tree);
+		synced_op = to;
+	}
+}
+
+static void run_workload(void) {
+	if (txn_mode)
+		run_txns(0, nops);
+	else
+		run_ops(0, nops, async_mode);
+}
+
+static void reset_pool(void) {
+	memcpy(pool->hdr, pristine, POOL_SIZE);
+	art_pool_reload(pool);
+}
+
+static int known_key(unsigned long key, int upto) {
+	int i;
+	for (i = 0; i < upto; i++)
+		if (ops[i].kind == OP_INSERT && ops[i].key == key)
+			return 1;
+	return 0;
+}
+
+static unsigned long iter_count;
+static int iter_bad;
+
+static int count_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	(void)key_len;
+	(void)value;
+	if (!known_key(*(unsigned long *)key, *(int *)data))
+		iter_bad = 1;
+	iter_count++;
+	return 0;
+}
+
+/*
+ * Checks the tree after a crash during op crashed. Ops before
+ * durable must be there; each key touched from durable through
+ * crashed may hold any value it had since durable, or none once
+ * a drop removed it.
+ */
+static int verify(int durable, int crashed) {
+	unsigned long present = 0;
+	int i, j, upto = crashed + 1;
+
+	for (i = 0; i < upto; i++) {
+		void *found, *expect = NULL, *later;
+		int ok = 0;
+
+		// Check each distinct key once, at its first occurrence
+		if (ops[i].kind != OP_INSERT)
+			continue;
+		for (j = 0; j < i; j++)
+			if (ops[j].kind == OP_INSERT && ops[j].key == ops[i].key)
+				break;
+		if (j < i)
+			continue;
+
+		for (j = i; j < durable; j++)
+			expect = apply_op(j, ops[i].key, expect);
+		found = art_search(tree, ops[i].key, 8);
+		if (found == expect)
+			ok = 1;
+		for (j = durable > i ? durable : i, later = expect; j < upto && !ok; j++)
+			if (found == (later = apply_op(j, ops[i].key, later)))
+				ok = 1;
+		if (!ok) {
+			printf("  key %016lx: found %p, expected %p\n", ops[i].key, found, expect);
+			return -1;
+		}
+		if (found)
+			present++;
+	}
+
+	if (art_size(tree) != present) {
+		printf("  size %lu, %lu keys present\n", (unsigned long)art_size(tree), present);
+		return -1;
+	}
+
+	iter_count = 0;
+	iter_bad = 0;
+	art_iter(tree, count_cb, &upto);
+	if (iter_bad || iter_count != present) {
+		printf("  iteration saw %lu keys, %lu present%s\n", iter_count, present,
+				iter_bad ? ", some unknown" : "");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Checks that the transaction of ops [from, to) left either all
+ * or none of its values, on top of the ops before it
+ */
+static int verify_txn(int from, int to) {
+	int i, j, all = 1, none = 1;
+
+	for (i = from; i < to; i++) {
+		void *found, *before = NULL;
+
+		// The last put of each key in the transaction
+		for (j = i + 1; j < to; j++)
+			if (ops[j].key == ops[i].key)
+				break;
+		if (j < to)
+			continue;
+		for (j = 0; j < from; j++)
+			if (ops[j].key == ops[i].key)
+				before = ops[j].value;
+		found = art_search(tree, ops[i].key, 8);
+		if (found != ops[i].value)
+			all = 0;
+		if (found != before)
+			none = 0;
+	}
+	if (all || none)
+		return 0;
+	printf("  transaction of ops %d-%d applied in part\n", from, to - 1);
+	return -1;
+}
+
+/*
+ * Crashes at the given point and checks every requested image
+ * @return the number of failing images.
+ */
+static int crash_at(unsigned long point, int variants) {
+	int v, crashed, durable, failed = 0;
+
+	reset_pool();
+	synced_op = 0;
+	if (setjmp(crash_env) == 0) {
+		art_crash_arm(pool->hdr, POOL_SIZE, point, &crash_env);
+		run_workload();
+		art_crash_disarm();
+		return 0;
+	}
+	crashed = cur_op;
+	durable = synced_op;
+
+	for (v = 0; v < variants; v++) {
+		art_crash_image(image, v);
+		memcpy(pool->hdr, image, POOL_SIZE);
+		art_pool_reload(pool);
+
+		if (art_tree_open(tree) || verify(durable, crashed) ||
+				(txn_mode && verify_txn(durable, crashed + 1))) {
+			printf("crash point %lu, op %d, image %d: inconsistent after recovery\n",
+					point, crashed, v);
+			failed++;
+			continue;
+		}
+
+		// The recovered tree must keep working, redo what may be lost
+		run_ops(durable, nops < crashed + 8 ? nops : crashed + 8, 0);
+		if (verify(synced_op, synced_op - 1)) {
+			printf("crash point %lu, op %d, image %d: inconsistent after new inserts\n",
+					point, crashed, v);
+			failed++;
+		}
+	}
+	return failed;
+}
+
+int main(int argc, char **argv) {
+	const char *path = "crash_test.pool";
+	unsigned long point, only = 0, total;
+	int c, n = 0, variants = 4, failed = 0;
+
+	while ((c = getopt(argc, argv, "n:v:k:axc:d:p:")) != -1) {
+		switch (c) {
+			case 'n': n = atoi(optarg); break;
+			case 'v': variants = atoi(optarg); break;
+			case 'k': only = strtoul(optarg, NULL, 0); break;
+			case 'a': async_mode = 1; break;
+			case 'x': txn_mode = 1; break;
+			case 'c': compact_every = atoi(optarg); break;
+			case 'd': drop_every = atoi(optarg); break;
+			case 'p': path = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-n ops] [-v variants] [-k point] [-a] [-x] [-c every] "
+						"[-d every] [-p pool]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (drop_every && (drop_every < 2 || txn_mode)) {
+		fprintf(stderr, "-d needs an interval of 2 or more and no -x\n");
+		return 2;
+	}
+	if (!n)
+		n = drop_every ? DROP_OPS : DEFAULT_OPS;
+
+	pool = art_pool_create(path, POOL_SIZE, sizeof(art_tree));
+	if (!pool) {
+		fprintf(stderr, "cannot create pool %s\n", path);
+		return 2;
+	}
+	art_set_allocator(art_pool_alloc, art_pool_free);
+	tree = art_pool_root(pool);
+	art_tree_init(tree);
+
+	pristine = malloc(POOL_SIZE);
+	image = malloc(POOL_SIZE);
+	memcpy(pristine, pool->hdr, POOL_SIZE);
+	make_ops(n);
+
+	// Count the crash points of a clean run
+	reset_pool();
+	art_crash_arm(pool->hdr, POOL_SIZE, 0, &crash_env);
+	run_workload();
+	total = art_crash_points();
+	art_crash_disarm();
+	if (verify(nops, nops - 1)) {
+		printf("inconsistent without a crash\n");
+		return 1;
+	}
+
+	for (point = only ? only : 1; point <= (only ? only : total); point++)
+		failed += crash_at(point, variants);
+
+	printf("%d ops, %lu crash points, %d images each: %d inconsistent\n",
+			nops, only ? 1 : total, variants, failed);
+	art_pool_close(pool);
+	unlink(path);
+	return failed ? 1 : 0;
+}
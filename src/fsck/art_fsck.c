@@ -0,0 +1,154 @@
+/*
+ * Offline consistency checker for a tree in a pool file.
+ *
+ * Checks every node and leaf with art_check() from several threads
+ * and lists the allocations of the pool that neither the tree nor
+ * the pool header reach. With -r it first runs the recovery of
+ * art_tree_open(), then repairs what art_check() can, frees the
+ * unreachable allocations if the tree showed no damage that could
+ * hide live memory, and checks again. Build together with
+ * art_pool.c and one tree (-DUSE_WOART for WOART).
+ *
+ * usage: art_fsck [-r] [-t threads] [-v] pool
+ *
+ * Exits like fsck(8): 0 if the pool is clean, 1 if errors were
+ * repaired, 4 if errors are left, 8 if the pool cannot be checked.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "../pool/art_pool.h"
+#ifdef USE_WOART
+#include "../woart/woart.h"
+#else
+#include "../wort/wort.h"
+#endif
+
+#define FSCK_OK			0
+#define FSCK_REPAIRED	1
+#define FSCK_LEFT		4
+#define FSCK_FAILED		8
+
+static art_pool *pool;
+static unsigned char *reached;
+
+static int mark_block(void *data, const void *ptr) {
+	long i = art_pool_block_of(pool, ptr);
+
+	(void)data;
+	if (i < 0)
+		return -1;
+	__atomic_store_n(&reached[i], 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Counts the allocations not reached by the last check, and
+ * frees them if asked to
+ */
+static unsigned long sweep(bool release, bool verbose, unsigned long *bytes) {
+	art_pool_block *b;
+	unsigned long i, leaked = 0;
+
+	*bytes = 0;
+	for (i = 0; i < pool->hdr->nblocks; i++) {
+		b = &pool->blocks[i];
+		if (!b->size || !b->used || reached[i])
+			continue;
+		leaked++;
+		*bytes += b->size;
+		if (verbose)
+			printf("  unreachable block %lu at offset %#lx, %u bytes\n",
+					i, (unsigned long)b->off, b->size);
+		if (release)
+			art_pool_free((char *)pool->hdr + b->off);
+	}
+	return leaked;
+}
+
+static int check(art_tree *t, art_check_report *r, int threads, bool repair) {
+	memset(reached, 0, pool->hdr->max_blocks);
+	mark_block(NULL, t);
+	return art_check(t, r, mark_block, NULL, threads, repair);
+}
+
+static uint64_t damage(const art_check_report *r) {
+	return r->bad_header + r->bad_node + r->bad_leaf + r->bad_pointer + r->bad_size;
+}
+
+static void print_report(const art_check_report *r, unsigned long leaked, unsigned long bytes) {
+	printf("%lu nodes, %lu leaves, %lu stale headers, %lu pending logs\n",
+			(unsigned long)r->nodes, (unsigned long)r->leaves,
+			(unsigned long)r->stale, (unsigned long)r->pending);
+	printf("bad headers %lu, bad nodes %lu, bad leaves %lu, bad pointers %lu, bad size %lu\n",
+			(unsigned long)r->bad_header, (unsigned long)r->bad_node,
+			(unsigned long)r->bad_leaf, (unsigned long)r->bad_pointer,
+			(unsigned long)r->bad_size);
+	printf("%lu unreachable allocations, %lu bytes\n", leaked, bytes);
+}
+
+int main(int argc, char **argv) {
+	art_check_report r;
+	unsigned long leaked, bytes;
+	bool repair = false, verbose = false, found;
+	int c, threads = sysconf(_SC_NPROCESSORS_ONLN);
+	art_tree *t;
+
+	while ((c = getopt(argc, argv, "rt:v")) != -1) {
+		switch (c) {
+			case 'r': repair = true; break;
+			case 't': threads = atoi(optarg); break;
+			case 'v': verbose = true; break;
+			default:
+				fprintf(stderr, "usage: %s [-r] [-t threads] [-v] pool\n", argv[0]);
+				return FSCK_FAILED;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-r] [-t threads] [-v] pool\n", argv[0]);
+		return FSCK_FAILED;
+	}
+
+	pool = art_pool_open(argv[optind]);
+	if (!pool) {
+		fprintf(stderr, "cannot open pool %s\n", argv[optind]);
+		return FSCK_FAILED;
+	}
+	art_set_allocator(art_pool_alloc, art_pool_free);
+	t = art_pool_root(pool);
+	reached = malloc(pool->hdr->max_blocks);
+	if (!reached)
+		return FSCK_FAILED;
+
+	// Replay the logs first, as the next run would
+	if (repair) {
+		if (art_tree_open(t)) {
+			fprintf(stderr, "no tree of this geometry in %s\n", argv[optind]);
+			return FSCK_FAILED;
+		}
+		art_reclaim_wait(t);
+	}
+	if (check(t, &r, threads, repair)) {
+		fprintf(stderr, "no tree of this geometry in %s\n", argv[optind]);
+		return FSCK_FAILED;
+	}
+
+	// Damage may hide live memory, leave it allocated then
+	leaked = sweep(repair && !damage(&r) && !r.pending, verbose, &bytes);
+	print_report(&r, leaked, bytes);
+	found = damage(&r) || leaked;
+	if (!repair)
+		return found ? FSCK_LEFT : FSCK_OK;
+
+	found = found || r.repaired || r.stale;
+	if (check(t, &r, threads, false))
+		return FSCK_FAILED;
+	leaked = sweep(false, verbose, &bytes);
+	printf("after repair:\n");
+	print_report(&r, leaked, bytes);
+	art_pool_close(pool);
+	if (damage(&r) || leaked)
+		return FSCK_LEFT;
+	return found ? FSCK_REPAIRED : FSCK_OK;
+}
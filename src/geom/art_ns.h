@@ -0,0 +1,81 @@
+/*
+ * Renames the types and functions of a tree header to ART_NS(name).
+ * Included by wort.h and woart.h when ART_NS is defined, so that
+ * several instances of a tree, e.g. for several key widths, can be
+ * built and linked into one binary. Every instance is a separate
+ * build of wort.c or woart.c with its own constants, see wort32.c.
+ */
+#define art_key              ART_NS(key)
+#define art_callback         ART_NS(callback)
+#define art_op_hook          ART_NS(op_hook)
+#define art_node             ART_NS(node)
+#define art_node4            ART_NS(node4)
+#define art_node16           ART_NS(node16)
+#define art_node48           ART_NS(node48)
+#define art_node256          ART_NS(node256)
+#define art_leaf             ART_NS(leaf)
+#define art_meta             ART_NS(meta)
+#define art_dram_slot        ART_NS(dram_slot)
+#define art_dram             ART_NS(dram)
+#define art_size_stripe      ART_NS(size_stripe)
+#define art_hot_cache        ART_NS(hot_cache)
+#define art_count_slot       ART_NS(count_slot)
+#define art_counts           ART_NS(counts)
+#define art_arena            ART_NS(arena)
+#define art_arena_slot       ART_NS(arena_slot)
+#define art_arena_map        ART_NS(arena_map)
+#define art_posting          ART_NS(posting)
+#define art_txn_entry        ART_NS(txn_entry)
+#define art_txn_log          ART_NS(txn_log)
+#define art_prefix_log       ART_NS(prefix_log)
+#define art_reclaimer        ART_NS(reclaimer)
+#define art_retired          ART_NS(retired)
+#define art_cow              ART_NS(cow)
+#define art_view             ART_NS(view)
+#define art_tree             ART_NS(tree)
+#define art_ticket           ART_NS(ticket)
+#define art_txn              ART_NS(txn)
+#define art_tree_stats       ART_NS(tree_stats)
+#define art_check_fn         ART_NS(check_fn)
+#define art_check_report     ART_NS(check_report)
+#define path_comp            ART_NS(path_comp)
+#define slot_array           ART_NS(slot_array)
+#define key_pos              ART_NS(key_pos)
+
+#define art_tree_init        ART_NS(tree_init)
+#define art_tree_open        ART_NS(tree_open)
+#define art_set_allocator    ART_NS(set_allocator)
+#define art_set_op_hook      ART_NS(set_op_hook)
+#define art_set_dram_levels  ART_NS(set_dram_levels)
+#define art_set_hot_cache    ART_NS(set_hot_cache)
+#define art_set_counts       ART_NS(set_counts)
+#define art_set_multi_value  ART_NS(set_multi_value)
+#define art_size             ART_NS(size)
+#define art_insert           ART_NS(insert)
+#define art_insert_async     ART_NS(insert_async)
+#define art_sync             ART_NS(sync)
+#define art_durable          ART_NS(durable)
+#define art_txn_begin        ART_NS(txn_begin)
+#define art_txn_put          ART_NS(txn_put)
+#define art_txn_commit       ART_NS(txn_commit)
+#define art_search           ART_NS(search)
+#define art_values           ART_NS(values)
+#define art_value_count      ART_NS(value_count)
+#define art_remove_value     ART_NS(remove_value)
+#define art_iter             ART_NS(iter)
+#define art_view_open        ART_NS(view_open)
+#define art_view_search      ART_NS(view_search)
+#define art_view_iter        ART_NS(view_iter)
+#define art_view_close       ART_NS(view_close)
+#define art_rank             ART_NS(rank)
+#define art_count_range      ART_NS(count_range)
+#define art_select           ART_NS(select)
+#define art_lower_bound      ART_NS(lower_bound)
+#define art_floor            ART_NS(floor)
+#define art_stats            ART_NS(stats)
+#define art_parallel_scan    ART_NS(parallel_scan)
+#define art_check            ART_NS(check)
+#define art_compact          ART_NS(compact)
+#define art_drop_prefix      ART_NS(drop_prefix)
+#define art_attach_prefix    ART_NS(attach_prefix)
+#define art_reclaim_wait     ART_NS(reclaim_wait)
@@ -0,0 +1,93 @@
+/*
+ * Ends the inclusion of a tree instance header. Drops the renames
+ * and the geometry of the instance, so that the header of another
+ * instance can follow it in the same file.
+ */
+#undef art_key
+#undef art_callback
+#undef art_op_hook
+#undef art_node
+#undef art_node4
+#undef art_node16
+#undef art_node48
+#undef art_node256
+#undef art_leaf
+#undef art_meta
+#undef art_dram_slot
+#undef art_dram
+#undef art_size_stripe
+#undef art_hot_cache
+#undef art_count_slot
+#undef art_counts
+#undef art_arena
+#undef art_arena_slot
+#undef art_arena_map
+#undef art_posting
+#undef art_txn_entry
+#undef art_txn_log
+#undef art_prefix_log
+#undef art_reclaimer
+#undef art_retired
+#undef art_cow
+#undef art_view
+#undef art_tree
+#undef art_ticket
+#undef art_txn
+#undef art_tree_stats
+#undef art_check_fn
+#undef art_check_report
+#undef path_comp
+#undef slot_array
+#undef key_pos
+
+#undef art_tree_init
+#undef art_tree_open
+#undef art_set_allocator
+#undef art_set_op_hook
+#undef art_set_dram_levels
+#undef art_set_hot_cache
+#undef art_set_counts
+#undef art_set_multi_value
+#undef art_size
+#undef art_insert
+#undef art_insert_async
+#undef art_sync
+#undef art_durable
+#undef art_txn_begin
+#undef art_txn_put
+#undef art_txn_commit
+#undef art_search
+#undef art_values
+#undef art_value_count
+#undef art_remove_value
+#undef art_iter
+#undef art_view_open
+#undef art_view_search
+#undef art_view_iter
+#undef art_view_close
+#undef art_rank
+#undef art_count_range
+#undef art_select
+#undef art_lower_bound
+#undef art_floor
+#undef art_stats
+#undef art_parallel_scan
+#undef art_check
+#undef art_compact
+#undef art_drop_prefix
+#undef art_attach_prefix
+#undef art_reclaim_wait
+
+#undef ART_NS
+#undef ART_KEY_BITS
+#undef NODE_BITS
+#undef MAX_DEPTH
+#undef NUM_NODE_ENTRIES
+#undef LOW_BIT_MASK
+#undef MAX_PREFIX_LEN
+#undef MAX_HEIGHT
+#undef ART_HEADER_ALIGN
+#undef ART_MAGIC
+#undef ART_FORMAT_VERSION
+#undef WORT_H
+#undef WOART_H
@@ -0,0 +1,229 @@
+/*
+ * Tree geometry check.
+ *
+ * Links every instance of this directory into one binary and feeds
+ * the same stream of inserts to all of them at once, each keeping
+ * the low bits of the key that fit its width. Every instance is then
+ * compared with a sorted reference of its own keys: its scan, its
+ * lookups, its size and the rank of selected keys, again after
+ * art_tree_open(). Build with wort32.c, wort64.c, wort128.c,
+ * woart32.c, woart64.c and woart128.c.
+ *
+ * usage: geom_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "wort32.h"
+#include "wort64.h"
+#include "wort128.h"
+#include "woart32.h"
+#include "woart64.h"
+#include "woart128.h"
+
+typedef unsigned __int128 wide_key;
+
+/**
+ * One insert in the widest key, seq orders the inserts of a key
+ */
+typedef struct {
+	wide_key key;
+	void *value;
+	unsigned long seq;
+} ref_entry;
+
+static unsigned long rnd_state = 88172645463325252UL;
+
+static unsigned long rnd(void) {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static wide_key make_key(unsigned long i) {
+	switch (i % 4) {
+		case 0:
+			return (wide_key)rnd() << 64 | rnd();
+		case 1:
+			// The same low bits under many high ones
+			return (wide_key)rnd() << 64 | (rnd() & 0xff);
+		case 2:
+			return i;
+		default:
+			// Keys that differ in the top bits of a 32-bit key only
+			return (wide_key)(rnd() & 0xff) << 24 | (i & 0xff);
+	}
+}
+
+static int ref_cmp(const void *a, const void *b) {
+	const ref_entry *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * Truncates the inserts to the given width, sorts them by key and
+ * keeps the last one of each key
+ * @return the number of distinct keys.
+ */
+static unsigned long ref_build(ref_entry *ref, const ref_entry *ins, unsigned long n, int bits) {
+	wide_key mask = bits == 128 ? ~(wide_key)0 : ((wide_key)1 << bits) - 1;
+	unsigned long i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		ref[i] = ins[i];
+		ref[i].key &= mask;
+	}
+	qsort(ref, n, sizeof(ref_entry), ref_cmp);
+	for (i = 0; i < n; i++) {
+		if (m && ref[m - 1].key == ref[i].key)
+			m--;
+		ref[m++] = ref[i];
+	}
+	return m;
+}
+
+/**
+ * Position of a scan in the reference
+ */
+typedef struct {
+	const ref_entry *ref;
+	unsigned long n;
+	unsigned long pos;
+	int fails;
+} ref_cursor;
+
+#define GEOM(name)	wort32_##name
+#define GEOM_NAME	"wort32"
+#include "geom_test.h"
+#undef GEOM
+#undef GEOM_NAME
+
+#define GEOM(name)	wort64_##name
+#define GEOM_NAME	"wort64"
+#include "geom_test.h"
+#undef GEOM
+#undef GEOM_NAME
+
+#define GEOM(name)	wort128_##name
+#define GEOM_NAME	"wort128"
+#include "geom_test.h"
+#undef GEOM
+#undef GEOM_NAME
+
+#define GEOM(name)	woart32_##name
+#define GEOM_NAME	"woart32"
+#include "geom_test.h"
+#undef GEOM
+#undef GEOM_NAME
+
+#define GEOM(name)	woart64_##name
+#define GEOM_NAME	"woart64"
+#include "geom_test.h"
+#undef GEOM
+#undef GEOM_NAME
+
+#define GEOM(name)	woart128_##name
+#define GEOM_NAME	"woart128"
+#include "geom_test.h"
+#undef GEOM
+#undef GEOM_NAME
+
+/**
+ * Allocates a tree with the 64-byte alignment of its persistent parts
+ */
+static void* tree_alloc(unsigned long size) {
+	void *ret;
+
+	if (posix_memalign(&ret, 64, size)) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return ret;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 50000, m, i;
+	ref_entry *ins, *ref;
+	wort32_tree *w32 = tree_alloc(sizeof(wort32_tree));
+	wort64_tree *w64 = tree_alloc(sizeof(wort64_tree));
+	wort128_tree *w128 = tree_alloc(sizeof(wort128_tree));
+	woart32_tree *o32 = tree_alloc(sizeof(woart32_tree));
+	woart64_tree *o64 = tree_alloc(sizeof(woart64_tree));
+	woart128_tree *o128 = tree_alloc(sizeof(woart128_tree));
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	ins = malloc(n * sizeof(ref_entry));
+	ref = malloc(n * sizeof(ref_entry));
+	if (!ins || !ref) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	wort32_tree_init(w32);
+	wort64_tree_init(w64);
+	wort128_tree_init(w128);
+	woart32_tree_init(o32);
+	woart64_tree_init(o64);
+	woart128_tree_init(o128);
+	wort64_set_counts(w64, true);
+	woart128_set_counts(o128, true);
+
+	for (i = 0; i < n; i++) {
+		ins[i].key = make_key(i);
+		ins[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ins[i].seq = i;
+		wort32_insert(w32, (wort32_key)ins[i].key, sizeof(wort32_key), ins[i].value);
+		wort64_insert(w64, (wort64_key)ins[i].key, sizeof(wort64_key), ins[i].value);
+		wort128_insert(w128, (wort128_key)ins[i].key, sizeof(wort128_key), ins[i].value);
+		woart32_insert(o32, (woart32_key)ins[i].key, sizeof(woart32_key), ins[i].value);
+		woart64_insert(o64, (woart64_key)ins[i].key, sizeof(woart64_key), ins[i].value);
+		woart128_insert(o128, (woart128_key)ins[i].key, sizeof(woart128_key), ins[i].value);
+	}
+
+	m = ref_build(ref, ins, n, 32);
+	fails += wort32_compare(w32, ref, m, "inserted") + woart32_compare(o32, ref, m, "inserted");
+	if (wort32_tree_open(w32) || woart32_tree_open(o32))
+		fails++;
+	fails += wort32_compare(w32, ref, m, "reopened") + woart32_compare(o32, ref, m, "reopened");
+
+	m = ref_build(ref, ins, n, 64);
+	fails += wort64_compare(w64, ref, m, "inserted") + woart64_compare(o64, ref, m, "inserted");
+	if (wort64_tree_open(w64) || woart64_tree_open(o64))
+		fails++;
+	fails += wort64_compare(w64, ref, m, "reopened") + woart64_compare(o64, ref, m, "reopened");
+
+	m = ref_build(ref, ins, n, 128);
+	fails += wort128_compare(w128, ref, m, "inserted") + woart128_compare(o128, ref, m, "inserted");
+	if (wort128_tree_open(w128) || woart128_tree_open(o128))
+		fails++;
+	fails += wort128_compare(w128, ref, m, "reopened") + woart128_compare(o128, ref, m, "reopened");
+
+	// A tree of one geometry is not opened as another
+	if (!wort64_tree_open((wort64_tree *)w32) || !woart32_tree_open((woart32_tree *)o64)) {
+		fprintf(stderr, "a tree was opened with the wrong geometry\n");
+		fails++;
+	}
+
+	free(ref);
+	free(ins);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
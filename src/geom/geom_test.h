@@ -0,0 +1,53 @@
+/*
+ * Checks of one instance, included by geom_test.c once per instance
+ * with GEOM(name) naming its types and functions and GEOM_NAME
+ * holding its name.
+ */
+static int GEOM(iter_cb)(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	ref_cursor *c = data;
+	GEOM(key) k;
+
+	memcpy(&k, key, sizeof(GEOM(key)));
+	if (key_len != sizeof(GEOM(key)) || c->pos >= c->n ||
+			c->ref[c->pos].key != (wide_key)k || c->ref[c->pos].value != value) {
+		fprintf(stderr, GEOM_NAME ": key %lu of the scan is wrong\n", c->pos);
+		c->fails++;
+		return 1;
+	}
+	c->pos++;
+	return 0;
+}
+
+static int GEOM(compare)(GEOM(tree) *t, const ref_entry *ref, unsigned long n, const char *when) {
+	ref_cursor c = { ref, n, 0, 0 };
+	unsigned long i;
+	GEOM(leaf) *l;
+
+	GEOM(iter)(t, GEOM(iter_cb), &c);
+	if (!c.fails && c.pos != n) {
+		fprintf(stderr, GEOM_NAME " %s: the scan has %lu keys, expected %lu\n", when, c.pos, n);
+		c.fails++;
+	}
+	if (GEOM(size)(t) != n) {
+		fprintf(stderr, GEOM_NAME " %s: size %lu, expected %lu\n", when,
+				(unsigned long)GEOM(size)(t), n);
+		c.fails++;
+	}
+	for (i = 0; i < n; i++) {
+		if (GEOM(search)(t, (GEOM(key))ref[i].key, sizeof(GEOM(key))) != ref[i].value) {
+			fprintf(stderr, GEOM_NAME " %s: key %lu not found\n", when, i);
+			c.fails++;
+			break;
+		}
+	}
+	for (i = 0; i < n; i += n / 100 + 1) {
+		l = GEOM(select)(t, i);
+		if (!l || (wide_key)l->key != ref[i].key ||
+				GEOM(rank)(t, l->key, sizeof(GEOM(key))) != i) {
+			fprintf(stderr, GEOM_NAME " %s: rank %lu is wrong\n", when, i);
+			c.fails++;
+			break;
+		}
+	}
+	return c.fails;
+}
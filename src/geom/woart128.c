@@ -0,0 +1,6 @@
+/*
+ * WOART with 128-bit keys, see woart128.h
+ */
+#define ART_KEY_BITS		128
+#define ART_NS(name)		woart128_##name
+#include "../woart/woart.c"
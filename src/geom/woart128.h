@@ -0,0 +1,13 @@
+/*
+ * WOART with 128-bit keys. Types and functions are named woart128_*,
+ * e.g. woart128_tree and woart128_insert(), with the semantics of art_*.
+ */
+#ifndef WOART128_H
+#define WOART128_H
+
+#define ART_KEY_BITS		128
+#define ART_NS(name)		woart128_##name
+#include "../woart/woart.h"
+#include "art_ns_end.h"
+
+#endif
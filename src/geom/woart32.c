@@ -0,0 +1,6 @@
+/*
+ * WOART with 32-bit keys, see woart32.h
+ */
+#define ART_KEY_BITS		32
+#define ART_NS(name)		woart32_##name
+#include "../woart/woart.c"
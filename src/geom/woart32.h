@@ -0,0 +1,13 @@
+/*
+ * WOART with 32-bit keys. Types and functions are named woart32_*,
+ * e.g. woart32_tree and woart32_insert(), with the semantics of art_*.
+ */
+#ifndef WOART32_H
+#define WOART32_H
+
+#define ART_KEY_BITS		32
+#define ART_NS(name)		woart32_##name
+#include "../woart/woart.h"
+#include "art_ns_end.h"
+
+#endif
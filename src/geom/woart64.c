@@ -0,0 +1,6 @@
+/*
+ * WOART with 64-bit keys, see woart64.h
+ */
+#define ART_KEY_BITS		64
+#define ART_NS(name)		woart64_##name
+#include "../woart/woart.c"
@@ -0,0 +1,13 @@
+/*
+ * WOART with 64-bit keys. Types and functions are named woart64_*,
+ * e.g. woart64_tree and woart64_insert(), with the semantics of art_*.
+ */
+#ifndef WOART64_H
+#define WOART64_H
+
+#define ART_KEY_BITS		64
+#define ART_NS(name)		woart64_##name
+#include "../woart/woart.h"
+#include "art_ns_end.h"
+
+#endif
@@ -0,0 +1,6 @@
+/*
+ * WORT with 128-bit keys, see wort128.h
+ */
+#define ART_KEY_BITS		128
+#define ART_NS(name)		wort128_##name
+#include "../wort/wort.c"
@@ -0,0 +1,13 @@
+/*
+ * WORT with 128-bit keys. Types and functions are named wort128_*,
+ * e.g. wort128_tree and wort128_insert(), with the semantics of art_*.
+ */
+#ifndef WORT128_H
+#define WORT128_H
+
+#define ART_KEY_BITS		128
+#define ART_NS(name)		wort128_##name
+#include "../wort/wort.h"
+#include "art_ns_end.h"
+
+#endif
@@ -0,0 +1,6 @@
+/*
+ * WORT with 32-bit keys, see wort32.h
+ */
+#define ART_KEY_BITS		32
+#define ART_NS(name)		wort32_##name
+#include "../wort/wort.c"
@@ -0,0 +1,13 @@
+/*
+ * WORT with 32-bit keys. Types and functions are named wort32_*,
+ * e.g. wort32_tree and wort32_insert(), with the semantics of art_*.
+ */
+#ifndef WORT32_H
+#define WORT32_H
+
+#define ART_KEY_BITS		32
+#define ART_NS(name)		wort32_##name
+#include "../wort/wort.h"
+#include "art_ns_end.h"
+
+#endif
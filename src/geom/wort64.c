@@ -0,0 +1,6 @@
+/*
+ * WORT with 64-bit keys, see wort64.h
+ */
+#define ART_KEY_BITS		64
+#define ART_NS(name)		wort64_##name
+#include "../wort/wort.c"
@@ -0,0 +1,13 @@
+/*
+ * WORT with 64-bit keys. Types and functions are named wort64_*,
+ * e.g. wort64_tree and wort64_insert(), with the semantics of art_*.
+ */
+#ifndef WORT64_H
+#define WORT64_H
+
+#define ART_KEY_BITS		64
+#define ART_NS(name)		wort64_##name
+#include "../wort/wort.h"
+#include "art_ns_end.h"
+
+#endif
@@ -0,0 +1,279 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "art_hybrid.h"
+
+static inline art_hybrid_region* route(art_hybrid_tree *ht, const unsigned long key) {
+	return &ht->regions[key >> (64 - ART_HYBRID_BITS)];
+}
+
+static inline uint64_t region_size(const art_hybrid_region *r) {
+	if (r->kind == ART_HYBRID_WORT)
+		return wort64_size(r->wort);
+	return woart64_size(r->woart);
+}
+
+/**
+ * Allocates and initializes an empty tree of the given kind
+ * @return NULL on failure.
+ */
+static void* region_alloc(int kind) {
+	void *ret;
+
+	if (posix_memalign(&ret, 64, kind == ART_HYBRID_WORT ?
+				sizeof(wort64_tree) : sizeof(woart64_tree)))
+		return NULL;
+	if (kind == ART_HYBRID_WORT)
+		wort64_tree_init(ret);
+	else
+		woart64_tree_init(ret);
+	return ret;
+}
+
+typedef struct {
+	unsigned long last;
+	uint64_t keys;
+	uint64_t groups;
+} fanout_walk;
+
+// Keys arrive in order, a new group starts where the bits above
+// the last nibble change
+static int fanout_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	fanout_walk *w = data;
+	unsigned long k = *(const unsigned long *)key;
+	(void)key_len;
+	(void)value;
+
+	if (!w->keys++ || (k >> 4) != (w->last >> 4))
+		w->groups++;
+	w->last = k;
+	return 0;
+}
+
+/**
+ * Returns the keys per 16-key group of a region, in 1/16. This is
+ * the fanout of the last level of nibble nodes, whichever kind
+ * holds the keys, so both kinds measure the same.
+ */
+static unsigned int region_fanout(art_hybrid_region *r) {
+	fanout_walk w;
+
+	memset(&w, 0, sizeof(w));
+	if (r->kind == ART_HYBRID_WORT)
+		wort64_iter(r->wort, fanout_cb, &w);
+	else
+		woart64_iter(r->woart, fanout_cb, &w);
+	return w.groups ? w.keys * 16 / w.groups : 0;
+}
+
+static int copy_wort_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	wort64_insert_async(data, *(const unsigned long *)key, key_len, value, NULL);
+	return 0;
+}
+
+static int copy_woart_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	woart64_insert_async(data, *(const unsigned long *)key, key_len, value, NULL);
+	return 0;
+}
+
+/**
+ * Drops the keys of the tree of a region under prefix, waits for
+ * its nodes to be reclaimed and frees the tree
+ */
+static void region_free(art_hybrid_region *r, unsigned long prefix, int bits) {
+	if (r->kind == ART_HYBRID_WORT) {
+		wort64_drop_prefix(r->wort, prefix, bits);
+		wort64_reclaim_wait(r->wort);
+		free(r->wort);
+	} else if (r->kind == ART_HYBRID_WOART) {
+		woart64_drop_prefix(r->woart, prefix, bits);
+		woart64_reclaim_wait(r->woart);
+		free(r->woart);
+	}
+}
+
+/**
+ * Moves a region into a tree of the other kind. The copy is
+ * complete before the region switches to it, the keys of the old
+ * tree are then dropped and its nodes reclaimed. The region keeps
+ * its kind if the copy cannot be allocated.
+ * Called with the region write locked.
+ */
+static void region_convert(art_hybrid_region *r, unsigned long prefix, int kind) {
+	void *copy = region_alloc(kind);
+
+	if (!copy)
+		return;
+	if (kind == ART_HYBRID_WORT) {
+		woart64_iter(r->woart, copy_wort_cb, copy);
+		wort64_sync(copy);
+	} else {
+		wort64_iter(r->wort, copy_woart_cb, copy);
+		woart64_sync(copy);
+	}
+
+	region_free(r, prefix, ART_HYBRID_BITS);
+	if (kind == ART_HYBRID_WORT)
+		r->wort = copy;
+	else
+		r->woart = copy;
+	r->kind = kind;
+	r->conversions++;
+}
+
+/**
+ * Measures a region and converts it if the other kind suits it.
+ * Called with the region write locked.
+ */
+static void region_adapt(art_hybrid_region *r, unsigned long key) {
+	int kind = r->kind;
+
+	r->fanout = region_fanout(r);
+	r->next_check = region_size(r) * 2;
+	if (r->fanout >= ART_HYBRID_DENSE * 16)
+		kind = ART_HYBRID_WORT;
+	else if (r->fanout < ART_HYBRID_SPARSE * 16)
+		kind = ART_HYBRID_WOART;
+	if (kind != r->kind)
+		region_convert(r, key >> (64 - ART_HYBRID_BITS) << (64 - ART_HYBRID_BITS), kind);
+}
+
+/**
+ * Initializes a hybrid tree. Regions are created on their first
+ * insert, as WOART.
+ * @return 0 on success.
+ */
+int art_hybrid_init(art_hybrid_tree *ht) {
+	int i;
+
+	ht->regions = calloc(ART_HYBRID_REGIONS, sizeof(art_hybrid_region));
+	if (!ht->regions)
+		return -1;
+	for (i = 0; i < ART_HYBRID_REGIONS; i++) {
+		art_hybrid_region *r = &ht->regions[i];
+		pthread_rwlock_init(&r->lock, NULL);
+		r->next_check = ART_HYBRID_MIN_KEYS;
+	}
+	return 0;
+}
+
+/**
+ * Releases the regions and their trees. The keys are dropped and
+ * the nodes reclaimed.
+ */
+void art_hybrid_destroy(art_hybrid_tree *ht) {
+	int i;
+
+	for (i = 0; i < ART_HYBRID_REGIONS; i++) {
+		region_free(&ht->regions[i], 0, 0);
+		pthread_rwlock_destroy(&ht->regions[i].lock);
+	}
+	free(ht->regions);
+	ht->regions = NULL;
+}
+
+/**
+ * Inserts a new value, measuring and converting the region
+ * when it reaches its next measurement
+ * @arg ht The hybrid tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @arg old If not NULL, receives NULL if the item was newly
+ * inserted, otherwise the old value pointer.
+ * @return 0 on success, -1 if the tree of a new region could not
+ * be allocated.
+ */
+int art_hybrid_insert(art_hybrid_tree *ht, const unsigned long key, int key_len, void *value,
+		void **old) {
+	art_hybrid_region *r = route(ht, key);
+	void *prev;
+
+	pthread_rwlock_wrlock(&r->lock);
+	if (r->kind == ART_HYBRID_NONE) {
+		r->woart = region_alloc(ART_HYBRID_WOART);
+		if (!r->woart) {
+			pthread_rwlock_unlock(&r->lock);
+			return -1;
+		}
+		r->kind = ART_HYBRID_WOART;
+	}
+	if (r->kind == ART_HYBRID_WORT)
+		prev = wort64_insert(r->wort, key, key_len, value);
+	else
+		prev = woart64_insert(r->woart, key, key_len, value);
+	if (region_size(r) >= r->next_check)
+		region_adapt(r, key);
+	pthread_rwlock_unlock(&r->lock);
+	if (old)
+		*old = prev;
+	return 0;
+}
+
+/**
+ * Searches for a value in the owning region
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_hybrid_search(art_hybrid_tree *ht, const unsigned long key, int key_len) {
+	art_hybrid_region *r = route(ht, key);
+	void *value = NULL;
+
+	pthread_rwlock_rdlock(&r->lock);
+	if (r->kind == ART_HYBRID_WORT)
+		value = wort64_search(r->wort, key, key_len);
+	else if (r->kind == ART_HYBRID_WOART)
+		value = woart64_search(r->woart, key, key_len);
+	pthread_rwlock_unlock(&r->lock);
+	return value;
+}
+
+/**
+ * Iterates over all regions in key order.
+ * @return 0 on success, or the return of the callback.
+ */
+int art_hybrid_iter(art_hybrid_tree *ht, wort64_callback cb, void *data) {
+	int i, res = 0;
+
+	for (i = 0; i < ART_HYBRID_REGIONS && !res; i++) {
+		art_hybrid_region *r = &ht->regions[i];
+		pthread_rwlock_rdlock(&r->lock);
+		if (r->kind == ART_HYBRID_WORT)
+			res = wort64_iter(r->wort, cb, data);
+		else if (r->kind == ART_HYBRID_WOART)
+			res = woart64_iter(r->woart, cb, data);
+		pthread_rwlock_unlock(&r->lock);
+	}
+	return res;
+}
+
+/**
+ * Returns the number of keys over all regions.
+ */
+uint64_t art_hybrid_size(art_hybrid_tree *ht) {
+	uint64_t size = 0;
+	int i;
+
+	for (i = 0; i < ART_HYBRID_REGIONS; i++) {
+		art_hybrid_region *r = &ht->regions[i];
+		pthread_rwlock_rdlock(&r->lock);
+		if (r->kind != ART_HYBRID_NONE)
+			size += region_size(r);
+		pthread_rwlock_unlock(&r->lock);
+	}
+	return size;
+}
+
+/**
+ * Returns the kind of the region holding a key, one of
+ * ART_HYBRID_*.
+ */
+int art_hybrid_kind(art_hybrid_tree *ht, const unsigned long key) {
+	art_hybrid_region *r = route(ht, key);
+	int kind;
+
+	pthread_rwlock_rdlock(&r->lock);
+	kind = r->kind;
+	pthread_rwlock_unlock(&r->lock);
+	return kind;
+}
@@ -0,0 +1,128 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#ifndef ART_HYBRID_H
+#define ART_HYBRID_H
+
+/* Both tree variants with 64-bit keys, built from src/geom/wort64.c
+ * and src/geom/woart64.c. */
+#include "../geom/wort64.h"
+#include "../geom/woart64.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Keys are split into regions by their top ART_HYBRID_BITS, a
+ * multiple of the node span of both variants */
+#define ART_HYBRID_BITS			8
+#define ART_HYBRID_REGIONS		(1 << ART_HYBRID_BITS)
+
+/* Kinds of region */
+#define ART_HYBRID_NONE			0
+#define ART_HYBRID_WORT			1
+#define ART_HYBRID_WOART		2
+
+/* A region is measured once it holds ART_HYBRID_MIN_KEYS keys and
+ * again each time it doubled. It turns WORT if its keys fill at
+ * least ART_HYBRID_DENSE of the 16 slots of a nibble node on
+ * average, WOART if less than ART_HYBRID_SPARSE, and keeps its kind
+ * in between. */
+#define ART_HYBRID_MIN_KEYS		4096
+#define ART_HYBRID_DENSE		8
+#define ART_HYBRID_SPARSE		4
+
+/**
+ * One region: a WORT or a WOART tree holding the keys with the
+ * same top bits. fanout is the observed keys per 16-key group,
+ * in 1/16, at the last measurement.
+ */
+typedef struct {
+	int kind;
+	union {
+		wort64_tree *wort;
+		woart64_tree *woart;
+	};
+	pthread_rwlock_t lock;
+	uint64_t next_check;
+	unsigned int fanout;
+	unsigned int conversions;
+} art_hybrid_region;
+
+/**
+ * Hybrid front-end. Each region is a subtree of the key space
+ * kept in the variant that suits its density: dense 16-way WORT
+ * nodes where keys are close together, e.g. sequential ids, and
+ * adaptive WOART nodes where they are scattered, e.g. hashes.
+ * Inserts and searches take the lock of their region, so regions
+ * are written in parallel.
+ * The front-end is volatile: the region table and the pointers to
+ * the trees live in DRAM and there is no open or recovery path, so
+ * the trees cannot be found again after a restart, whichever
+ * allocator holds their nodes.
+ */
+typedef struct {
+	art_hybrid_region *regions;
+} art_hybrid_tree;
+
+/**
+ * Initializes a hybrid tree. Regions are created on their first
+ * insert, as WOART.
+ * @return 0 on success.
+ */
+int art_hybrid_init(art_hybrid_tree *ht);
+
+/**
+ * Releases the regions and their trees. The keys are dropped and
+ * the nodes reclaimed.
+ */
+void art_hybrid_destroy(art_hybrid_tree *ht);
+
+/**
+ * Inserts a new value. The insert that brings a region to its
+ * next measurement measures it, and converts it if it is in the
+ * wrong kind: the keys are copied into a tree of the other kind
+ * with one group commit, the region switches to it with a plain
+ * store and the old tree is reclaimed. Measuring and converting cost O(n) in the
+ * keys of the region, O(1) per insert amortized. A region that
+ * cannot get a tree of the other kind keeps its kind.
+ * @arg ht The hybrid tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @arg old If not NULL, receives NULL if the item was newly
+ * inserted, otherwise the old value pointer.
+ * @return 0 on success, -1 if the tree of a new region could not
+ * be allocated.
+ */
+int art_hybrid_insert(art_hybrid_tree *ht, const unsigned long key, int key_len, void *value,
+		void **old);
+
+/**
+ * Searches for a value in the owning region
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_hybrid_search(art_hybrid_tree *ht, const unsigned long key, int key_len);
+
+/**
+ * Iterates over all regions in key order.
+ * @return 0 on success, or the return of the callback.
+ */
+int art_hybrid_iter(art_hybrid_tree *ht, wort64_callback cb, void *data);
+
+/**
+ * Returns the number of keys over all regions.
+ */
+uint64_t art_hybrid_size(art_hybrid_tree *ht);
+
+/**
+ * Returns the kind of the region holding a key, one of
+ * ART_HYBRID_*.
+ */
+int art_hybrid_kind(art_hybrid_tree *ht, const unsigned long key);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
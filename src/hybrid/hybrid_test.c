@@ -0,0 +1,294 @@
+/*
+ * Hybrid front-end check.
+ *
+ * Fills regions of the key space with sequential keys, some from
+ * parallel writers, and others with scattered ones, and checks that
+ * the dense regions turned WORT, the sparse ones stayed WOART and
+ * that a region that went dense then sparse converted both ways.
+ * Scans, lookups, sizes and the old values returned by replacements
+ * must follow a sorted reference throughout. Build with
+ * art_hybrid.c, wort64.c and woart64.c.
+ *
+ * usage: hybrid_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "art_hybrid.h"
+
+#define REGION(r)	((unsigned long)(r) << (64 - ART_HYBRID_BITS))
+
+/* Keys of each dense and sparse region, two measurements' worth */
+#define REGION_KEYS	(2 * ART_HYBRID_MIN_KEYS)
+#define THREADS		4
+
+#define DENSE		0x01
+#define FLIP		0x02
+#define PARALLEL	0x10
+#define SPARSE		0x80
+#define EMPTY		0xff
+
+/**
+ * One insert, seq orders the inserts of a key
+ */
+typedef struct {
+	unsigned long key;
+	void *value;
+	unsigned long seq;
+} ref_entry;
+
+static unsigned long rnd_state = 88172645463325252UL;
+
+static unsigned long rnd(void) {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+static int ref_cmp(const void *a, const void *b) {
+	const ref_entry *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int ref_key_cmp(const void *a, const void *b) {
+	const ref_entry *x = a, *y = b;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/**
+ * Sorts the inserts by key and keeps the last one of each key
+ * @return the number of distinct keys.
+ */
+static unsigned long ref_build(ref_entry *ref, unsigned long n) {
+	unsigned long i, m = 0;
+
+	qsort(ref, n, sizeof(ref_entry), ref_cmp);
+	for (i = 0; i < n; i++) {
+		if (m && ref[m - 1].key == ref[i].key)
+			m--;
+		ref[m++] = ref[i];
+	}
+	return m;
+}
+
+/**
+ * Position of a scan in the reference
+ */
+typedef struct {
+	const ref_entry *ref;
+	unsigned long n;
+	unsigned long pos;
+	int fails;
+} ref_cursor;
+
+static int iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	ref_cursor *c = data;
+	unsigned long k;
+
+	memcpy(&k, key, sizeof(k));
+	if (key_len != sizeof(k) || c->pos >= c->n ||
+			k != c->ref[c->pos].key || value != c->ref[c->pos].value) {
+		fprintf(stderr, "scan differs at %lu: %#lx\n", c->pos, k);
+		c->fails++;
+		return 1;
+	}
+	c->pos++;
+	return 0;
+}
+
+/**
+ * Compares the scan, the lookups of every key and of the key after
+ * it, and the size with the reference
+ * @return the number of failed checks.
+ */
+static int compare(art_hybrid_tree *ht, const ref_entry *ref, unsigned long n, const char *when) {
+	ref_cursor c = { ref, n, 0, 0 };
+	ref_entry e, *hit;
+	unsigned long i;
+
+	art_hybrid_iter(ht, iter_cb, &c);
+	if (!c.fails && c.pos != n) {
+		fprintf(stderr, "%s: the scan has %lu keys, expected %lu\n", when, c.pos, n);
+		c.fails++;
+	}
+	if (art_hybrid_size(ht) != n) {
+		fprintf(stderr, "%s: size %lu, expected %lu\n", when,
+				(unsigned long)art_hybrid_size(ht), n);
+		c.fails++;
+	}
+	for (i = 0; i < n; i++) {
+		e.key = ref[i].key + 1;
+		hit = bsearch(&e, ref, n, sizeof(ref_entry), ref_key_cmp);
+		if (art_hybrid_search(ht, ref[i].key, sizeof(unsigned long)) != ref[i].value ||
+				art_hybrid_search(ht, e.key, sizeof(unsigned long)) != (hit ? hit->value : NULL)) {
+			fprintf(stderr, "%s: lookup of %#lx is wrong\n", when, ref[i].key);
+			c.fails++;
+			break;
+		}
+	}
+	return c.fails;
+}
+
+/**
+ * Inserts a key that is new, recording it
+ * @return the number of failed checks.
+ */
+static int insert_new(art_hybrid_tree *ht, ref_entry *e, unsigned long key, unsigned long seq) {
+	void *old = (void *)1;
+
+	e->key = key;
+	e->value = (void *)(seq << 1 | 1);
+	e->seq = seq;
+	if (art_hybrid_insert(ht, key, sizeof(unsigned long), e->value, &old) || old) {
+		fprintf(stderr, "insert of the new key %#lx failed\n", key);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * A writer of one dense region
+ */
+typedef struct {
+	art_hybrid_tree *ht;
+	ref_entry *e;
+	unsigned long region;
+	unsigned long seq;
+	int fails;
+} writer;
+
+static void* write_region(void *arg) {
+	writer *w = arg;
+	unsigned long i;
+
+	for (i = 0; i < REGION_KEYS; i++)
+		w->fails += insert_new(w->ht, &w->e[i], REGION(w->region) | i, w->seq + i);
+	return NULL;
+}
+
+static int check_kind(art_hybrid_tree *ht, unsigned long region, int kind, const char *name) {
+	if (art_hybrid_kind(ht, REGION(region)) != kind) {
+		fprintf(stderr, "%s region %#lx is of kind %d, expected %d\n", name, region,
+				art_hybrid_kind(ht, REGION(region)), kind);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Checks the kind of every region the inserts shaped
+ * @return the number of failed checks.
+ */
+static int check_kinds(art_hybrid_tree *ht) {
+	int i, fails = 0;
+
+	fails += check_kind(ht, DENSE, ART_HYBRID_WORT, "dense");
+	for (i = 0; i < THREADS; i++)
+		fails += check_kind(ht, PARALLEL + i, ART_HYBRID_WORT, "parallel");
+	fails += check_kind(ht, SPARSE, ART_HYBRID_WOART, "sparse");
+	fails += check_kind(ht, FLIP, ART_HYBRID_WOART, "flipped");
+	fails += check_kind(ht, EMPTY, ART_HYBRID_NONE, "empty");
+	if (ht->regions[FLIP].conversions != 2) {
+		fprintf(stderr, "the flipped region converted %u times, expected 2\n",
+				ht->regions[FLIP].conversions);
+		fails++;
+	}
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 40000, total, seq, m, i, j;
+	writer w[THREADS];
+	pthread_t tid[THREADS];
+	art_hybrid_tree ht;
+	ref_entry *ref;
+	void *old;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	// n scattered keys, then the dense, sparse and flipped regions
+	total = n + (4 + THREADS) * REGION_KEYS;
+	ref = malloc(total * sizeof(ref_entry));
+	if (!ref || art_hybrid_init(&ht)) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	fails += compare(&ht, ref, 0, "empty");
+
+	seq = 0;
+	for (i = 0; i < n; i++, seq++) {
+		ref[seq].key = rnd() % REGION(EMPTY);
+		ref[seq].value = (void *)(seq << 1 | 1);
+		ref[seq].seq = seq;
+		art_hybrid_insert(&ht, ref[seq].key, sizeof(unsigned long), ref[seq].value, NULL);
+	}
+	for (i = 0; i < REGION_KEYS; i++, seq++)
+		fails += insert_new(&ht, &ref[seq], REGION(DENSE) | i, seq);
+	for (i = 0; i < REGION_KEYS; i++, seq++)
+		fails += insert_new(&ht, &ref[seq], REGION(SPARSE) | rnd() >> 16 << 8 | 1, seq);
+	// Dense up to the first measurement, then scattered up to the second
+	for (i = 0; i < ART_HYBRID_MIN_KEYS; i++, seq++)
+		fails += insert_new(&ht, &ref[seq], REGION(FLIP) | i, seq);
+	for (i = 0; i < ART_HYBRID_MIN_KEYS; i++, seq++)
+		fails += insert_new(&ht, &ref[seq], REGION(FLIP) | rnd() >> 16 << 8 | 1, seq);
+
+	for (i = 0; i < THREADS; i++) {
+		w[i].ht = &ht;
+		w[i].e = &ref[seq];
+		w[i].region = PARALLEL + i;
+		w[i].seq = seq;
+		w[i].fails = 0;
+		seq += REGION_KEYS;
+		if (pthread_create(&tid[i], NULL, write_region, &w[i])) {
+			fprintf(stderr, "cannot start a writer\n");
+			return 1;
+		}
+	}
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(tid[i], NULL);
+		fails += w[i].fails;
+	}
+
+	m = ref_build(ref, seq);
+	fails += compare(&ht, ref, m, "inserted");
+	fails += check_kinds(&ht);
+
+	// Replacements return the old value and keep the kinds
+	for (i = 0; i < m; i++, seq++) {
+		j = rnd() % m;
+		old = NULL;
+		art_hybrid_insert(&ht, ref[j].key, sizeof(unsigned long), (void *)(seq << 1 | 1), &old);
+		if (old != ref[j].value) {
+			fprintf(stderr, "replacing %#lx returned %p, expected %p\n", ref[j].key,
+					old, ref[j].value);
+			fails++;
+			break;
+		}
+		ref[j].value = (void *)(seq << 1 | 1);
+	}
+	fails += compare(&ht, ref, m, "replaced");
+	fails += check_kinds(&ht);
+
+	art_hybrid_destroy(&ht);
+	free(ref);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
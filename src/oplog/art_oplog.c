@@ -0,0 +1,307 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "art_oplog.h"
+#ifdef ART_CRASH_TEST
+#include "../crash/art_crash.h"
+#endif
+
+/**
+ * Flushes the cache line holding addr and fences
+ */
+static void log_persist(void *addr) {
+	asm volatile ("clflush %0\n" : "+m" (*(char *)addr));
+#ifdef ART_CRASH_TEST
+	art_crash_flush(addr);
+#endif
+	asm volatile ("mfence" ::: "memory");
+#ifdef ART_CRASH_TEST
+	art_crash_fence();
+#endif
+}
+
+/**
+ * Maps a log file and checks its header
+ * @return NULL on failure.
+ */
+static art_oplog* log_map(const char *path, bool writer) {
+	art_oplog_hdr *h;
+	art_oplog *log;
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, writer ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (unsigned long)st.st_size < ART_OPLOG_LINE) {
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, writer ? PROT_READ | PROT_WRITE : PROT_READ,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	h = base;
+	if (h->magic != ART_OPLOG_MAGIC || h->version != ART_OPLOG_VERSION ||
+			h->key_bytes != sizeof(art_key) || !h->nrecs || (h->nrecs & (h->nrecs - 1)) ||
+			ART_OPLOG_LINE + h->nrecs * sizeof(art_oplog_rec) != (uint64_t)st.st_size) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	log = calloc(1, sizeof(art_oplog));
+	if (!log) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+	log->hdr = h;
+	log->recs = (art_oplog_rec *)((char *)base + ART_OPLOG_LINE);
+	log->mask = h->nrecs - 1;
+	log->size = st.st_size;
+	return log;
+}
+
+/**
+ * Returns the newest LSN in the ring, 0 if it is empty
+ */
+static uint64_t log_newest(const art_oplog *log) {
+	uint64_t i, lsn, newest = 0;
+
+	for (i = 0; i <= log->mask; i++) {
+		lsn = __atomic_load_n(&log->recs[i].lsn, __ATOMIC_ACQUIRE);
+		if (lsn > newest)
+			newest = lsn;
+	}
+	return newest;
+}
+
+/**
+ * Creates a log file and maps it for appending
+ * @arg path The log file
+ * @arg nrecs Size of the ring in records, rounded up to a power
+ * of two. Followers that fall this far behind lose records.
+ * @return NULL on failure.
+ */
+art_oplog* art_oplog_create(const char *path, unsigned long nrecs) {
+	art_oplog_hdr h;
+	unsigned long n = 2;
+	int fd;
+
+	while (n < nrecs)
+		n *= 2;
+	memset(&h, 0, sizeof(h));
+	h.magic = ART_OPLOG_MAGIC;
+	h.version = ART_OPLOG_VERSION;
+	h.key_bytes = sizeof(art_key);
+	h.nrecs = n;
+
+	// The ring is zero filled, an LSN of 0 marks an empty slot
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, ART_OPLOG_LINE + n * sizeof(art_oplog_rec)) ||
+			pwrite(fd, &h, sizeof(h), 0) != sizeof(h) || fsync(fd)) {
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	return art_oplog_open(path);
+}
+
+/**
+ * Maps an existing log for appending, after the writer restarted
+ * @return NULL on failure.
+ */
+art_oplog* art_oplog_open(const char *path) {
+	art_oplog *log = log_map(path, true);
+	art_oplog_rec *r;
+	uint64_t lsn, newest;
+
+	if (!log)
+		return NULL;
+	newest = log_newest(log);
+	log->next = newest + 1;
+
+	// Concurrent appends may have died below the newest one
+	lsn = newest > log->mask ? newest - log->mask : 1;
+	for (; lsn < newest; lsn++) {
+		r = &log->recs[lsn & log->mask];
+		if (r->lsn == lsn)
+			continue;
+		r->lsn = 0;
+		r->op = ART_OP_NONE;
+		r->key_len = 0;
+		r->value = 0;
+		r->key = 0;
+		r->lsn = lsn;
+		log_persist(r);
+	}
+	return log;
+}
+
+/**
+ * Maps a log read-only to follow it
+ * @arg path The log file
+ * @arg lsn The first LSN to read, 0 for the oldest in the ring
+ * @return NULL on failure.
+ */
+art_oplog* art_oplog_follow(const char *path, uint64_t lsn) {
+	art_oplog *log = log_map(path, false);
+	uint64_t newest;
+
+	if (!log)
+		return NULL;
+	if (!lsn) {
+		newest = log_newest(log);
+		lsn = newest > log->mask ? newest - log->mask : 1;
+	}
+	log->next = lsn;
+	return log;
+}
+
+/**
+ * Unmaps the log.
+ */
+void art_oplog_close(art_oplog *log) {
+	munmap(log->hdr, log->size);
+	free(log);
+}
+
+/**
+ * Appends a record, durable when the call returns
+ * @return the LSN of the record.
+ */
+uint64_t art_oplog_append(art_oplog *log, int op, const art_key key, int key_len, void *value) {
+	uint64_t lsn = __atomic_fetch_add(&log->next, 1, __ATOMIC_RELAXED);
+	art_oplog_rec *r = &log->recs[lsn & log->mask];
+
+	// A follower still reading the record of the last lap sees it go first
+	__atomic_store_n(&r->lsn, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->op = op;
+	r->key_len = key_len;
+	r->value = (uintptr_t)value;
+	r->key = key;
+
+	// The record fills part of one line, which reaches PM with its
+	// stores in order, so one flush of the LSN commits all of it
+	__atomic_store_n(&r->lsn, lsn, __ATOMIC_RELEASE);
+	log_persist(r);
+	return lsn;
+}
+
+static void log_hook(void *data, int op, const art_key key, int key_len, void *value) {
+	art_oplog_append(data, op, key, key_len, value);
+}
+
+/**
+ * Appends every change of t to the log before it is made
+ * @arg log The log, opened for appending
+ * @arg t The tree
+ */
+void art_oplog_attach(art_oplog *log, art_tree *t) {
+	art_set_op_hook(t, log_hook, log);
+}
+
+/**
+ * Reads the next record without waiting
+ * @return 1 if a record was read, 0 if it was not appended yet,
+ * -1 if it was overwritten.
+ */
+int art_oplog_read(art_oplog *log, art_oplog_rec *rec) {
+	art_oplog_rec *r = &log->recs[log->next & log->mask];
+	uint64_t lsn = __atomic_load_n(&r->lsn, __ATOMIC_ACQUIRE);
+
+	// An older lap, or the record being written
+	if (lsn != log->next)
+		return lsn > log->next ? -1 : 0;
+
+	memcpy(rec, r, sizeof(art_oplog_rec));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&r->lsn, __ATOMIC_RELAXED) != lsn)
+		return -1;
+	log->next++;
+	return 1;
+}
+
+/**
+ * Applies the inserts of a transaction collected by the follower
+ */
+static void apply_txn(art_oplog *log, art_tree *t) {
+	art_txn tx;
+	int i;
+
+	if (art_txn_begin(t, &tx)) {
+		for (i = 0; i < log->ntxn; i++)
+			art_insert(t, log->txn[i].key, log->txn[i].key_len, log->txn[i].value);
+	} else {
+		for (i = 0; i < log->ntxn; i++)
+			art_txn_put(&tx, log->txn[i].key, log->txn[i].key_len, log->txn[i].value);
+		art_txn_commit(&tx);
+	}
+	log->ntxn = 0;
+}
+
+/**
+ * Applies the records appended so far to a tree
+ * @arg log The log, opened to follow it
+ * @arg t The tree of the follower
+ * @arg max Most records to read, 0 for no limit
+ * @return the number of records read, or -1 if a record was
+ * overwritten before it was read.
+ */
+long art_oplog_apply(art_oplog *log, art_tree *t, unsigned long max) {
+	art_oplog_rec rec;
+	unsigned long n;
+	int res;
+
+	for (n = 0; !max || n < max; n++) {
+		res = art_oplog_read(log, &rec);
+		if (res <= 0)
+			return res < 0 ? -1 : (long)n;
+
+		switch (rec.op) {
+			case ART_OP_TXN:
+			case ART_OP_INSERT:
+				if (rec.op == ART_OP_INSERT && !log->ntxn) {
+					art_insert(t, rec.key, rec.key_len, (void *)(uintptr_t)rec.value);
+					break;
+				}
+				// The writer commits at most ART_TXN_MAX inserts at once
+				if (log->ntxn == ART_TXN_MAX)
+					apply_txn(log, t);
+				log->txn[log->ntxn].key = rec.key;
+				log->txn[log->ntxn].key_len = rec.key_len;
+				log->txn[log->ntxn].value = (void *)(uintptr_t)rec.value;
+				log->ntxn++;
+				if (rec.op == ART_OP_INSERT)
+					apply_txn(log, t);
+				break;
+			case ART_OP_DROP:
+				art_drop_prefix(t, rec.key, rec.key_len);
+				break;
+			case ART_OP_REMOVE:
+				art_remove_value(t, rec.key, rec.key_len, (void *)(uintptr_t)rec.value);
+				break;
+			case ART_OP_MULTI:
+				art_set_multi_value(t, rec.key_len);
+				break;
+		}
+	}
+	return n;
+}
+
+/**
+ * Returns the LSN the next append gets, or the next LSN a follower
+ * reads
+ */
+uint64_t art_oplog_next(const art_oplog *log) {
+	return __atomic_load_n(&log->next, __ATOMIC_RELAXED);
+}
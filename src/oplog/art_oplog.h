@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef ART_OPLOG_H
+#define ART_OPLOG_H
+
+/* A log holds the keys of one tree variant,
+ * WORT by default or WOART with -DUSE_WOART. */
+#ifdef USE_WOART
+#include "../woart/woart.h"
+#else
+#include "../wort/wort.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ART_OPLOG_MAGIC		0x474f4c504f545241UL	/* "ARTOPLOG" */
+#define ART_OPLOG_VERSION	1
+#define ART_OPLOG_LINE		64
+
+/* Operation of a record that fills the hole of a lost append */
+#define ART_OP_NONE			0
+
+/**
+ * One change, with the ART_OP_* of art_op_hook. Values are stored
+ * as their 64-bit word, so they should not be pointers into the
+ * process. A record never crosses a cache line and lsn is its
+ * commit word: 0 while the record is written, else the LSN it
+ * holds. The record of LSN n sits in slot n modulo the ring size.
+ */
+typedef struct {
+	uint64_t lsn;
+	uint32_t op;
+	int32_t key_len;
+	uint64_t value;
+	art_key key;
+} __attribute__((aligned(32))) art_oplog_rec;
+
+/**
+ * File header of a log. The ring of nrecs records follows at
+ * ART_OPLOG_LINE. The file holds no pointers, so it can be
+ * mapped anywhere and by several processes.
+ */
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t key_bytes;
+	uint64_t nrecs;
+} art_oplog_hdr;
+
+/**
+ * A log mapped by its writer or by a follower. next is the LSN of
+ * the next append, or of the next record the follower reads. A
+ * follower collects the inserts of a transaction in txn until its
+ * last one arrives.
+ */
+typedef struct {
+	art_oplog_hdr *hdr;
+	art_oplog_rec *recs;
+	uint64_t mask;
+	uint64_t next;
+	unsigned long size;
+	int ntxn;
+	art_txn_entry txn[ART_TXN_MAX];
+} art_oplog;
+
+/**
+ * Creates a log file and maps it for appending
+ * @arg path The log file
+ * @arg nrecs Size of the ring in records, rounded up to a power
+ * of two. Followers that fall this far behind lose records.
+ * @return NULL on failure.
+ */
+art_oplog* art_oplog_create(const char *path, unsigned long nrecs);
+
+/**
+ * Maps an existing log for appending, after the writer restarted.
+ * Appending goes on after the newest record; holes left by appends
+ * that did not complete are filled with ART_OP_NONE records.
+ * @return NULL on failure, or if the log was written with another
+ * key width.
+ */
+art_oplog* art_oplog_open(const char *path);
+
+/**
+ * Maps a log read-only to follow it, e.g. from another process
+ * @arg path The log file
+ * @arg lsn The first LSN to read, e.g. the art_oplog_next() of an
+ * earlier follower. 0 starts at the oldest record in the ring.
+ * @return NULL on failure, or if the log was written with another
+ * key width.
+ */
+art_oplog* art_oplog_follow(const char *path, uint64_t lsn);
+
+/**
+ * Unmaps the log.
+ */
+void art_oplog_close(art_oplog *log);
+
+/**
+ * Appends a record. It is durable when the call returns. Threads
+ * may append to one log concurrently.
+ * @arg log The log, opened for appending
+ * @arg op One of ART_OP_*
+ * @arg key The key, or the prefix of ART_OP_DROP
+ * @arg key_len The length of the key, the bits of the prefix, or
+ * the setting of ART_OP_MULTI
+ * @arg value Opaque value.
+ * @return the LSN of the record.
+ */
+uint64_t art_oplog_append(art_oplog *log, int op, const art_key key, int key_len, void *value);
+
+/**
+ * Appends every change of t to the log before it is made, see
+ * art_set_op_hook(). art_set_op_hook(t, NULL, NULL) stops it.
+ * @arg log The log, opened for appending
+ * @arg t The tree
+ */
+void art_oplog_attach(art_oplog *log, art_tree *t);
+
+/**
+ * Reads the next record without waiting
+ * @arg log The log, opened to follow it
+ * @arg rec Receives the record
+ * @return 1 if a record was read, 0 if the writer has not
+ * appended it yet, -1 if it was overwritten before it was read.
+ * The follower must then start again from a full copy.
+ */
+int art_oplog_read(art_oplog *log, art_oplog_rec *rec);
+
+/**
+ * Applies the records appended so far to a tree. The inserts of a
+ * transaction are applied together with art_txn_commit() once its
+ * last record has been read.
+ * @arg log The log, opened to follow it
+ * @arg t The tree of the follower
+ * @arg max Most records to read, 0 for no limit
+ * @return the number of records read, or -1 if a record was
+ * overwritten before it was read.
+ */
+long art_oplog_apply(art_oplog *log, art_tree *t, unsigned long max);
+
+/**
+ * Returns the LSN the next append gets, or the next LSN a follower
+ * reads. A copy of the tree taken by its writer starts at the
+ * art_oplog_next() taken with it.
+ */
+uint64_t art_oplog_next(const art_oplog *log);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,337 @@
+/*
+ * Operation log check.
+ *
+ * Logs every change of a writer tree with art_oplog_attach(), in
+ * batches of inserts, replacements, transactions, asynchronous
+ * inserts, prefix drops and attaches, and has a follower apply the
+ * log after each batch. Writer and follower must both hold the keys
+ * of a sorted reference, also after the writer reopened the log, for
+ * a follower that starts late from the oldest record, and in
+ * multi-value mode with removed values. A follower lapped by a small
+ * ring must notice. Build with art_oplog.c and one tree (-DUSE_WOART
+ * for WOART).
+ *
+ * usage: oplog_test [-n keys] [-p path]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "art_oplog.h"
+#include "../test/ref.h"
+
+#define RING		(1UL << 20)
+#define SMALL_RING	64
+#define TXN_SIZE	7
+
+#define TOP(x, bits)	((art_key)(x) << (ART_KEY_BITS - (bits)))
+
+static art_tree* tree_new(void) {
+	void *ret;
+
+	if (posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	art_tree_init(ret);
+	return ret;
+}
+
+/**
+ * The reference: the keys after the last batch, then the inserts of
+ * the batch in progress
+ */
+typedef struct {
+	ref_entry *e;
+	unsigned long n;
+	unsigned long seq;
+} ref_state;
+
+static void ref_add(ref_state *r, art_key key, void *value) {
+	r->e[r->n].key = key;
+	r->e[r->n].value = value;
+	r->e[r->n++].seq = r->seq++;
+}
+
+static void ref_drop(ref_state *r, art_key prefix, int bits) {
+	unsigned long i, j;
+
+	for (i = j = 0; i < r->n; i++)
+		if (r->e[i].key >> (ART_KEY_BITS - bits) != prefix >> (ART_KEY_BITS - bits))
+			r->e[j++] = r->e[i];
+	r->n = j;
+}
+
+static art_key make_key(ref_state *r, unsigned long i) {
+	if (i % 3 == 2 && r->n)
+		return r->e[rnd() % r->n].key;
+	return i % 2 ? (art_key)rnd() : (art_key)(i * 11);
+}
+
+/**
+ * Runs one batch of each kind of change on the writer
+ */
+static void write_batch(art_tree *t, ref_state *r, unsigned long keys, int batch) {
+	art_tree *src;
+	art_txn tx;
+	art_key key, prefix;
+	unsigned long i;
+	void *value;
+	int j;
+
+	for (i = 0; i < keys; i++) {
+		key = make_key(r, i);
+		value = (void *)(uintptr_t)(r->seq << 1 | 1);
+		ref_add(r, key, value);
+		switch (batch % 3) {
+			case 0:
+				art_insert(t, key, sizeof(art_key), value);
+				break;
+			case 1:
+				art_insert_async(t, key, sizeof(art_key), value, NULL);
+				break;
+			default:
+				art_txn_begin(t, &tx);
+				art_txn_put(&tx, key, sizeof(art_key), value);
+				for (j = 1; j < TXN_SIZE && ++i < keys; j++) {
+					key = make_key(r, i);
+					value = (void *)(uintptr_t)(r->seq << 1 | 1);
+					ref_add(r, key, value);
+					art_txn_put(&tx, key, sizeof(art_key), value);
+				}
+				art_txn_commit(&tx);
+		}
+	}
+	art_sync(t);
+	r->n = ref_build(r->e, r->n);
+
+	// Drop a top digit, then move other keys under another one
+	prefix = TOP((batch * 37 + 1) % 256, 8);
+	art_drop_prefix(t, prefix, 8);
+	ref_drop(r, prefix, 8);
+	prefix = TOP((batch * 37 + 101) % 256, 8);
+	art_drop_prefix(t, prefix, 8);
+	ref_drop(r, prefix, 8);
+	src = tree_new();
+	for (i = 0; i < keys / 8; i++) {
+		key = prefix | (art_key)(rnd() >> 8);
+		value = (void *)(uintptr_t)(r->seq << 1 | 1);
+		ref_add(r, key, value);
+		art_insert(src, key, sizeof(art_key), value);
+	}
+	if (art_attach_prefix(t, prefix, 8, src)) {
+		fprintf(stderr, "batch %d: attach failed\n", batch);
+		exit(1);
+	}
+	free(src);
+	r->n = ref_build(r->e, r->n);
+	art_reclaim_wait(t);
+}
+
+/**
+ * Applies the whole log to the follower and compares both trees with
+ * the reference
+ * @return the number of failed checks.
+ */
+static int follow(art_oplog *f, art_tree *ft, art_tree *t, const ref_state *r, const char *when) {
+	int fails = 0;
+
+	if (art_oplog_apply(f, ft, 0) < 0) {
+		fprintf(stderr, "%s: the follower lost records\n", when);
+		return 1;
+	}
+	art_reclaim_wait(ft);
+	fails += ref_compare(t, r->e, r->n, when);
+	fails += ref_compare(ft, r->e, r->n, when);
+	return fails;
+}
+
+/**
+ * Collects the key and value pairs of a multi-value tree
+ */
+static int pair_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	ref_state *r = data;
+
+	(void)key_len;
+	memcpy(&r->e[r->n].key, key, sizeof(art_key));
+	r->e[r->n].value = value;
+	r->e[r->n++].seq = (uintptr_t)value;
+	return 0;
+}
+
+/**
+ * Logs multi-value inserts and removals and checks that the
+ * follower holds the same values as a sorted reference
+ * @return the number of failed checks.
+ */
+static int check_multi(const char *path, unsigned long n) {
+	art_tree *t = tree_new(), *ft = tree_new();
+	ref_state r, got;
+	art_oplog *log, *f;
+	unsigned long i, j;
+	int fails = 0;
+
+	r.e = malloc(n * sizeof(ref_entry));
+	got.e = malloc(n * sizeof(ref_entry));
+	if (!r.e || !got.e || !(log = art_oplog_create(path, RING))) {
+		fprintf(stderr, "cannot create %s\n", path);
+		exit(1);
+	}
+	art_oplog_attach(log, t);
+	art_set_multi_value(t, true);
+	r.n = r.seq = 0;
+	for (i = 0; i < n; i++)
+		ref_add(&r, (art_key)(rnd() % (n / 8 + 1)), (void *)(uintptr_t)(i << 1 | 1));
+	for (i = 0; i < n; i++)
+		art_insert(t, r.e[i].key, sizeof(art_key), r.e[i].value);
+	// Remove every third value
+	for (i = j = 0; i < n; i++) {
+		if (i % 3 == 1)
+			art_remove_value(t, r.e[i].key, sizeof(art_key), r.e[i].value);
+		else
+			r.e[j++] = r.e[i];
+	}
+	r.n = j;
+	for (i = 0; i < r.n; i++)
+		r.e[i].seq = (uintptr_t)r.e[i].value;
+	qsort(r.e, r.n, sizeof(ref_entry), ref_cmp);
+
+	f = art_oplog_follow(path, 0);
+	if (!f || art_oplog_apply(f, ft, 0) < 0) {
+		fprintf(stderr, "multi-value: cannot follow the log\n");
+		exit(1);
+	}
+	got.n = 0;
+	art_iter(ft, pair_cb, &got);
+	qsort(got.e, got.n, sizeof(ref_entry), ref_cmp);
+	if (got.n != r.n || memcmp(got.e, r.e, r.n * sizeof(ref_entry))) {
+		fprintf(stderr, "multi-value: the follower holds %lu values, expected %lu\n", got.n, r.n);
+		fails++;
+	}
+
+	art_oplog_close(f);
+	art_oplog_close(log);
+	free(got.e);
+	free(r.e);
+	free(ft);
+	free(t);
+	return fails;
+}
+
+/**
+ * Has a follower fall behind a small ring
+ * @return the number of failed checks.
+ */
+static int check_lapped(const char *path) {
+	art_tree *t = tree_new(), *ft = tree_new();
+	art_oplog *log, *f;
+	unsigned long i;
+	int fails = 0;
+
+	if (!(log = art_oplog_create(path, SMALL_RING)) || !(f = art_oplog_follow(path, 0))) {
+		fprintf(stderr, "cannot create %s\n", path);
+		exit(1);
+	}
+	art_oplog_attach(log, t);
+	for (i = 0; i < SMALL_RING / 2; i++)
+		art_insert(t, (art_key)rnd(), sizeof(art_key), (void *)1);
+	if (art_oplog_apply(f, ft, 0) != SMALL_RING / 2) {
+		fprintf(stderr, "the follower missed records of the ring\n");
+		fails++;
+	}
+	for (i = 0; i < 3 * SMALL_RING; i++)
+		art_insert(t, (art_key)rnd(), sizeof(art_key), (void *)1);
+	if (art_oplog_apply(f, ft, 0) >= 0) {
+		fprintf(stderr, "the follower did not notice it was lapped\n");
+		fails++;
+	}
+
+	art_oplog_close(f);
+	art_oplog_close(log);
+	free(ft);
+	free(t);
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	const char *path = "oplog_test.log";
+	unsigned long n = 20000;
+	uint64_t next;
+	art_tree *t, *ft, *late;
+	art_oplog *log, *f, *lf;
+	ref_state r;
+	int opt, batch, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				path = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys] [-p path]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16 || n > RING / 4) {
+		fprintf(stderr, "need 16 to %lu keys\n", RING / 4);
+		return 2;
+	}
+
+	// Every batch inserts n / 8 keys and attaches n / 64
+	r.e = malloc(2 * n * sizeof(ref_entry));
+	r.n = r.seq = 0;
+	t = tree_new();
+	ft = tree_new();
+	if (!r.e || !(log = art_oplog_create(path, RING)) || !(f = art_oplog_follow(path, 0))) {
+		fprintf(stderr, "cannot create %s\n", path);
+		return 1;
+	}
+	art_oplog_attach(log, t);
+
+	for (batch = 0; batch < 6; batch++) {
+		write_batch(t, &r, n / 8, batch);
+		fails += follow(f, ft, t, &r, "batch");
+	}
+
+	// The writer restarts and appends after its last record
+	next = art_oplog_next(log);
+	art_oplog_close(log);
+	if (!(log = art_oplog_open(path)) || art_oplog_next(log) != next) {
+		fprintf(stderr, "the log did not reopen at %lu\n", (unsigned long)next);
+		return 1;
+	}
+	art_oplog_attach(log, t);
+	for (; batch < 8; batch++) {
+		write_batch(t, &r, n / 8, batch);
+		fails += follow(f, ft, t, &r, "reopened");
+	}
+
+	// A follower that starts from the oldest record catches up
+	late = tree_new();
+	if (!(lf = art_oplog_follow(path, 0))) {
+		fprintf(stderr, "cannot follow %s\n", path);
+		return 1;
+	}
+	fails += follow(lf, late, t, &r, "late follower");
+	if (art_oplog_next(lf) != art_oplog_next(log)) {
+		fprintf(stderr, "the late follower stopped at %lu\n", (unsigned long)art_oplog_next(lf));
+		fails++;
+	}
+
+	art_oplog_close(lf);
+	art_oplog_close(f);
+	art_oplog_close(log);
+	free(late);
+	free(ft);
+	free(t);
+	free(r.e);
+
+	fails += check_multi(path, n);
+	fails += check_lapped(path);
+	unlink(path);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
@@ -0,0 +1,215 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "art_perf.h"
+
+/**
+ * Counters of one thread. A counter that could not be opened has
+ * fd -1. depth counts nested art_perf_begin() calls. The totals
+ * are kept after the thread exits.
+ */
+typedef struct perf_thread {
+	int fds[ART_PERF_COUNTERS];
+	struct perf_event_mmap_page *pages[ART_PERF_COUNTERS];
+	uint64_t start[ART_PERF_COUNTERS];
+	uint64_t start_tsc;
+	int depth;
+	art_perf_stats stats[ART_PERF_OPS];
+	struct perf_thread *next;
+} perf_thread;
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} events[ART_PERF_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+		PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+	{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+		PERF_COUNT_HW_CACHE_RESULT_MISS << 16 },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static const char *op_names[ART_PERF_OPS] = { "insert", "search" };
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static perf_thread *threads;
+static __thread perf_thread *self;
+
+static inline unsigned long read_tsc(void)
+{
+	unsigned int hi, lo;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long)hi << 32) | lo;
+}
+
+/**
+ * Opens the counters of the calling thread, user space only
+ */
+static perf_thread* perf_attach(void) {
+	struct perf_event_attr attr;
+	perf_thread *p;
+	void *page;
+	int i;
+
+	p = calloc(1, sizeof(perf_thread));
+	if (!p)
+		return NULL;
+	for (i = 0; i < ART_PERF_COUNTERS; i++) {
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = events[i].type;
+		attr.config = events[i].config;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		p->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+		if (p->fds[i] < 0)
+			continue;
+		page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, p->fds[i], 0);
+		p->pages[i] = page == MAP_FAILED ? NULL : page;
+	}
+
+	pthread_mutex_lock(&threads_lock);
+	p->next = threads;
+	threads = p;
+	pthread_mutex_unlock(&threads_lock);
+	return p;
+}
+
+/**
+ * Reads a counter, with rdpmc if the kernel has it scheduled on a
+ * register and lets user space read it, else with a system call
+ */
+static uint64_t perf_read(perf_thread *p, int i) {
+	struct perf_event_mmap_page *pc = p->pages[i];
+	uint64_t count, pmc;
+	uint32_t seq, idx;
+	unsigned int hi, lo;
+
+	if (pc) {
+		do {
+			seq = pc->lock;
+			asm volatile("" ::: "memory");
+			idx = pc->index;
+			count = pc->offset;
+			if (!pc->cap_user_rdpmc || !idx)
+				break;
+			asm volatile ("rdpmc" : "=a" (lo), "=d" (hi) : "c" (idx - 1));
+			pmc = (uint64_t)hi << 32 | lo;
+			count += (int64_t)(pmc << (64 - pc->pmc_width)) >> (64 - pc->pmc_width);
+			asm volatile("" ::: "memory");
+			if (pc->lock == seq)
+				return count;
+		} while (1);
+	}
+	if (read(p->fds[i], &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
+
+/**
+ * Starts measuring an operation of the calling thread
+ */
+void art_perf_begin(void) {
+	perf_thread *p = self;
+	int i;
+
+	if (!p && !(p = self = perf_attach()))
+		return;
+	if (p->depth++)
+		return;
+	for (i = 0; i < ART_PERF_COUNTERS; i++)
+		if (p->fds[i] >= 0)
+			p->start[i] = perf_read(p, i);
+	p->start_tsc = read_tsc();
+}
+
+/**
+ * Ends the operation started by art_perf_begin()
+ * @arg op One of ART_PERF_*
+ */
+void art_perf_end(int op) {
+	uint64_t tsc = read_tsc();
+	perf_thread *p = self;
+	art_perf_stats *s;
+	int i;
+
+	if (!p || --p->depth)
+		return;
+	s = &p->stats[op];
+	s->ops++;
+	s->cycles += tsc - p->start_tsc;
+	for (i = 0; i < ART_PERF_COUNTERS; i++)
+		if (p->fds[i] >= 0)
+			s->counts[i] += perf_read(p, i) - p->start[i];
+}
+
+/**
+ * Sums the totals of an operation over all threads
+ * @arg op One of ART_PERF_*
+ * @arg stats Filled with the totals
+ */
+void art_perf_get(int op, art_perf_stats *stats) {
+	perf_thread *p;
+	int i;
+
+	memset(stats, 0, sizeof(art_perf_stats));
+	stats->valid = (1U << ART_PERF_COUNTERS) - 1;
+	pthread_mutex_lock(&threads_lock);
+	for (p = threads; p; p = p->next) {
+		if (!p->stats[op].ops)
+			continue;
+		stats->ops += p->stats[op].ops;
+		stats->cycles += p->stats[op].cycles;
+		for (i = 0; i < ART_PERF_COUNTERS; i++) {
+			stats->counts[i] += p->stats[op].counts[i];
+			if (p->fds[i] < 0)
+				stats->valid &= ~(1U << i);
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+	if (!stats->ops)
+		stats->valid = 0;
+}
+
+/**
+ * Zeroes the totals of all threads.
+ */
+void art_perf_reset(void) {
+	perf_thread *p;
+
+	pthread_mutex_lock(&threads_lock);
+	for (p = threads; p; p = p->next)
+		memset(p->stats, 0, sizeof(p->stats));
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * Prints the counters per operation
+ */
+void art_perf_print(FILE *f) {
+	static const char *names[ART_PERF_COUNTERS] = { "instr", "llc", "dtlb", "branch" };
+	art_perf_stats s;
+	int op, i;
+
+	for (op = 0; op < ART_PERF_OPS; op++) {
+		art_perf_get(op, &s);
+		if (!s.ops)
+			continue;
+		fprintf(f, "%s: %lu ops, cycles/op %.1f", op_names[op], s.ops,
+				(double)s.cycles / s.ops);
+		for (i = 0; i < ART_PERF_COUNTERS; i++) {
+			if (s.valid & (1U << i))
+				fprintf(f, ", %s/op %.2f", names[i], (double)s.counts[i] / s.ops);
+			else
+				fprintf(f, ", %s/op -", names[i]);
+		}
+		fprintf(f, "\n");
+	}
+}
@@ -0,0 +1,77 @@
+#include <stdint.h>
+#include <stdio.h>
+#ifndef ART_PERF_H
+#define ART_PERF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Hardware counters per operation. Trees built with -DART_PERF
+ * wrap art_insert() and art_search() in art_perf_begin() and
+ * art_perf_end(). Each thread opens its own counters with
+ * perf_event_open() on first use and reads them with rdpmc where
+ * the kernel allows it, else with read().
+ */
+
+/* Operations */
+#define ART_PERF_INSERT			0
+#define ART_PERF_SEARCH			1
+#define ART_PERF_OPS			2
+
+/* Counters */
+#define ART_PERF_INSTRUCTIONS	0
+#define ART_PERF_LLC_MISSES		1
+#define ART_PERF_DTLB_MISSES	2
+#define ART_PERF_BRANCH_MISSES	3
+#define ART_PERF_COUNTERS		4
+
+/**
+ * Totals of one operation. cycles are read_tsc() cycles. Bit i of
+ * valid is set if counter i could be opened in every thread that
+ * ran the operation; the others stay 0.
+ */
+typedef struct {
+	uint64_t ops;
+	uint64_t cycles;
+	uint64_t counts[ART_PERF_COUNTERS];
+	unsigned int valid;
+} art_perf_stats;
+
+/**
+ * Starts measuring an operation of the calling thread. Nested
+ * operations are counted as part of the outer one.
+ */
+void art_perf_begin(void);
+
+/**
+ * Ends the operation started by art_perf_begin()
+ * @arg op One of ART_PERF_*
+ */
+void art_perf_end(int op);
+
+/**
+ * Sums the totals of an operation over all threads. Call it while
+ * the threads are not measuring.
+ * @arg op One of ART_PERF_*
+ * @arg stats Filled with the totals
+ */
+void art_perf_get(int op, art_perf_stats *stats);
+
+/**
+ * Zeroes the totals of all threads.
+ */
+void art_perf_reset(void);
+
+/**
+ * Prints cycles, instructions, LLC, dTLB and branch misses per
+ * operation, one line per operation, "-" for a counter that is
+ * not available.
+ */
+void art_perf_print(FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "art_trace.h"
+
+/**
+ * Trace state of one thread. spent holds the cycles of each phase
+ * of the current operation, last the time of the latest switch.
+ * The histograms are kept after the thread exits.
+ */
+typedef struct trace_thread {
+	int depth;
+	int phase;
+	uint64_t start;
+	uint64_t last;
+	uint64_t spent[ART_PHASES];
+	art_hist hists[ART_TRACE_OPS][ART_PHASES + 1];
+	struct trace_thread *next;
+} trace_thread;
+
+static const char *op_names[ART_TRACE_OPS] = { "insert", "search" };
+static const char *phase_names[ART_PHASES + 1] = {
+	"walk", "prefix", "leaf", "alloc", "grow", "flush", "publish", "total"
+};
+
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_thread *threads;
+static __thread trace_thread *self;
+
+static inline unsigned long read_tsc(void)
+{
+	unsigned int hi, lo;
+
+	asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((unsigned long)hi << 32) | lo;
+}
+
+static inline int hist_index(uint64_t v) {
+	int e;
+
+	if (v < (1UL << ART_HIST_SUB_BITS))
+		return v;
+	e = 63 - __builtin_clzl(v);
+	return (e - ART_HIST_SUB_BITS + 1) << ART_HIST_SUB_BITS |
+		((v >> (e - ART_HIST_SUB_BITS)) & ((1UL << ART_HIST_SUB_BITS) - 1));
+}
+
+/**
+ * Returns the largest value of a bucket
+ */
+static inline uint64_t hist_value(int i) {
+	int b = i >> ART_HIST_SUB_BITS;
+
+	if (!b)
+		return i;
+	return (((1UL << ART_HIST_SUB_BITS) + (i & ((1 << ART_HIST_SUB_BITS) - 1)) + 1)
+			<< (b - 1)) - 1;
+}
+
+static inline void hist_add(art_hist *h, uint64_t v) {
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+	h->buckets[hist_index(v)]++;
+}
+
+static trace_thread* trace_attach(void) {
+	trace_thread *t = calloc(1, sizeof(trace_thread));
+
+	if (!t)
+		return NULL;
+	pthread_mutex_lock(&threads_lock);
+	t->next = threads;
+	threads = t;
+	pthread_mutex_unlock(&threads_lock);
+	return t;
+}
+
+/**
+ * Starts tracing an operation of the calling thread
+ */
+void art_trace_begin(void) {
+	trace_thread *t = self;
+
+	if (!t && !(t = self = trace_attach()))
+		return;
+	if (t->depth++)
+		return;
+	memset(t->spent, 0, sizeof(t->spent));
+	t->phase = ART_PHASE_WALK;
+	t->start = t->last = read_tsc();
+}
+
+/**
+ * Switches the calling thread to another phase
+ * @return the phase left.
+ */
+int art_trace_enter(int phase) {
+	trace_thread *t = self;
+	uint64_t now;
+	int prev;
+
+	if (!t || !t->depth)
+		return phase;
+	prev = t->phase;
+	if (phase == prev || (phase == ART_PHASE_FLUSH && prev == ART_PHASE_PUBLISH))
+		return prev;
+	now = read_tsc();
+	t->spent[prev] += now - t->last;
+	t->last = now;
+	t->phase = phase;
+	return prev;
+}
+
+/**
+ * Ends the operation and records its phases
+ * @arg op One of ART_TRACE_*
+ */
+void art_trace_end(int op) {
+	trace_thread *t = self;
+	uint64_t now = read_tsc();
+	int i;
+
+	if (!t || --t->depth)
+		return;
+	t->spent[t->phase] += now - t->last;
+	// Phases the operation did not go through are not recorded
+	for (i = 0; i < ART_PHASES; i++)
+		if (t->spent[i])
+			hist_add(&t->hists[op][i], t->spent[i]);
+	hist_add(&t->hists[op][ART_PHASE_TOTAL], now - t->start);
+}
+
+/**
+ * Merges the histograms of all threads
+ */
+void art_trace_get(int op, int phase, art_hist *hist) {
+	trace_thread *t;
+	art_hist *h;
+	int i;
+
+	memset(hist, 0, sizeof(art_hist));
+	pthread_mutex_lock(&threads_lock);
+	for (t = threads; t; t = t->next) {
+		h = &t->hists[op][phase];
+		if (!h->count)
+			continue;
+		hist->count += h->count;
+		hist->sum += h->sum;
+		if (h->max > hist->max)
+			hist->max = h->max;
+		for (i = 0; i < ART_HIST_BUCKETS; i++)
+			hist->buckets[i] += h->buckets[i];
+	}
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * Returns a percentile of a histogram
+ */
+uint64_t art_hist_percentile(const art_hist *hist, double q) {
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!hist->count)
+		return 0;
+	rank = q * hist->count;
+	if (rank >= hist->count)
+		rank = hist->count - 1;
+	for (i = 0; i < ART_HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen > rank)
+			return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+	}
+	return hist->max;
+}
+
+/**
+ * Zeroes the histograms of all threads.
+ */
+void art_trace_reset(void) {
+	trace_thread *t;
+
+	pthread_mutex_lock(&threads_lock);
+	for (t = threads; t; t = t->next)
+		memset(t->hists, 0, sizeof(t->hists));
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/**
+ * Prints the histograms of every operation
+ */
+void art_trace_print(FILE *f) {
+	art_hist *h = malloc(sizeof(art_hist));
+	int op, phase;
+
+	if (!h)
+		return;
+	for (op = 0; op < ART_TRACE_OPS; op++) {
+		art_trace_get(op, ART_PHASE_TOTAL, h);
+		if (!h->count)
+			continue;
+		fprintf(f, "%s cycles:%10s %10s %10s %10s %10s %10s\n", op_names[op],
+				"count", "mean", "p50", "p99", "p999", "max");
+		for (phase = -1; phase < ART_PHASES; phase++) {
+			art_trace_get(op, phase < 0 ? ART_PHASE_TOTAL : phase, h);
+			if (!h->count)
+				continue;
+			fprintf(f, "  %-12s %10lu %10lu %10lu %10lu %10lu %10lu\n",
+					phase_names[phase < 0 ? ART_PHASE_TOTAL : phase],
+					h->count, h->sum / h->count, art_hist_percentile(h, 0.5),
+					art_hist_percentile(h, 0.99), art_hist_percentile(h, 0.999), h->max);
+		}
+	}
+	free(h);
+}
@@ -0,0 +1,107 @@
+#include <stdint.h>
+#include <stdio.h>
+#ifndef ART_TRACE_H
+#define ART_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Latency of the phases of an operation. Trees built with
+ * -DART_TRACE mark the phases of art_insert() and art_search()
+ * with art_trace_enter(). The read_tsc() cycles spent in each
+ * phase of one operation are added up and recorded in a histogram
+ * per operation and phase when the operation ends. Time is charged
+ * to the innermost phase, e.g. the allocation of a node growth
+ * counts as ART_PHASE_ALLOC.
+ */
+
+/* Operations */
+#define ART_TRACE_INSERT		0
+#define ART_TRACE_SEARCH		1
+#define ART_TRACE_OPS			2
+
+/* Phases */
+#define ART_PHASE_WALK			0	/* Descent, everything not below */
+#define ART_PHASE_PREFIX		1	/* Prefix mismatch, minimum walk, stale header */
+#define ART_PHASE_LEAF			2	/* Key compare against a leaf */
+#define ART_PHASE_ALLOC			3	/* Node and leaf allocation */
+#define ART_PHASE_GROW			4	/* Copy into a larger node */
+#define ART_PHASE_FLUSH			5	/* Flushes and fences */
+#define ART_PHASE_PUBLISH		6	/* Commit store, with its flush and fence */
+#define ART_PHASES				7
+/* Histogram of whole operations */
+#define ART_PHASE_TOTAL			ART_PHASES
+
+/*
+ * Log-linear buckets: values below 2^ART_HIST_SUB_BITS have their
+ * own bucket, every power of two above is split in as many, so a
+ * bucket is within 1/32 of its values.
+ */
+#define ART_HIST_SUB_BITS		5
+#define ART_HIST_BUCKETS		((64 - ART_HIST_SUB_BITS + 1) << ART_HIST_SUB_BITS)
+
+/**
+ * A histogram of cycle counts
+ */
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[ART_HIST_BUCKETS];
+} art_hist;
+
+/**
+ * Starts tracing an operation of the calling thread, in
+ * ART_PHASE_WALK. Nested operations are part of the outer one.
+ */
+void art_trace_begin(void);
+
+/**
+ * Switches the calling thread to another phase. Flushes inside
+ * ART_PHASE_PUBLISH stay in it.
+ * @arg phase One of ART_PHASE_*
+ * @return the phase left, to switch back to.
+ */
+int art_trace_enter(int phase);
+
+/**
+ * Ends the operation and records its phases
+ * @arg op One of ART_TRACE_*
+ */
+void art_trace_end(int op);
+
+/**
+ * Merges the histograms of all threads. Call it while the threads
+ * are not tracing.
+ * @arg op One of ART_TRACE_*
+ * @arg phase One of ART_PHASE_*, or ART_PHASE_TOTAL
+ * @arg hist Filled with the merged histogram
+ */
+void art_trace_get(int op, int phase, art_hist *hist);
+
+/**
+ * Returns a percentile of a histogram
+ * @arg hist The histogram
+ * @arg q The quantile, e.g. 0.999
+ * @return the largest value of the bucket holding it, 0 if the
+ * histogram is empty.
+ */
+uint64_t art_hist_percentile(const art_hist *hist, double q);
+
+/**
+ * Zeroes the histograms of all threads.
+ */
+void art_trace_reset(void);
+
+/**
+ * Prints count, mean, p50, p99, p999 and max cycles of every
+ * operation and of the phases it went through.
+ */
+void art_trace_print(FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
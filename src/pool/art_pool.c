@@ -0,0 +1,251 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "art_pool.h"
+#ifdef ART_CRASH_TEST
+#include "../crash/art_crash.h"
+#endif
+
+#define NCLASSES	ART_POOL_CLASSES
+#define NO_BLOCK	((uint32_t)-1)
+
+static art_pool *cur_pool;
+
+static void pool_flush(void *buf, unsigned long len) {
+	unsigned long i;
+	len = len + ((unsigned long)(buf) & (ART_POOL_UNIT - 1));
+	for (i = 0; i < len; i += ART_POOL_UNIT) {
+		asm volatile ("clflush %0\n" : "+m" (*(char *)(buf+i)));
+#ifdef ART_CRASH_TEST
+		art_crash_flush((char *)buf + i);
+#endif
+	}
+}
+
+static art_pool* pool_map(int fd, unsigned long size) {
+	art_pool *p;
+	void *addr;
+
+	addr = mmap((void *)ART_POOL_BASE, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+	if (addr == MAP_FAILED)
+		return NULL;
+	if (addr != (void *)ART_POOL_BASE) {
+		munmap(addr, size);
+		return NULL;
+	}
+
+	p = calloc(1, sizeof(art_pool));
+	p->hdr = addr;
+	p->fd = fd;
+	return p;
+}
+
+static inline unsigned long units(unsigned long size) {
+	return (size + ART_POOL_UNIT - 1) / ART_POOL_UNIT;
+}
+
+/**
+ * Rebuilds the volatile allocator state from the block table,
+ * after the contents of the mapping were replaced.
+ */
+void art_pool_reload(art_pool *p) {
+	art_pool_hdr *h = p->hdr;
+	unsigned long i, u, top = h->heap;
+	uint32_t c;
+
+	p->blocks = (art_pool_block *)((char *)h + ART_POOL_HDR_SIZE);
+	free(p->unit_block);
+	free(p->next_free);
+	p->unit_block = malloc(sizeof(uint32_t) * units(h->size));
+	p->next_free = malloc(sizeof(uint32_t) * h->max_blocks);
+	memset(p->unit_block, 0xff, sizeof(uint32_t) * units(h->size));
+	for (c = 0; c < NCLASSES; c++)
+		p->free_head[c] = NO_BLOCK;
+
+	for (i = 0; i < h->nblocks; i++) {
+		art_pool_block *b = &p->blocks[i];
+		// An entry whose flush was lost in a crash
+		if (!b->size)
+			continue;
+		if (b->off + b->size > top)
+			top = b->off + b->size;
+		if (b->used) {
+			for (u = b->off / ART_POOL_UNIT; u < units(b->off + b->size); u++)
+				p->unit_block[u] = i;
+		} else if (units(b->size) < NCLASSES) {
+			c = units(b->size);
+			p->next_free[i] = p->free_head[c];
+			p->free_head[c] = i;
+		}
+	}
+
+	if (h->top < top) {
+		h->top = top;
+		pool_flush(&h->top, sizeof(uint64_t));
+	}
+}
+
+/**
+ * Creates a pool file and maps it at ART_POOL_BASE
+ * @arg path The pool file
+ * @arg size Size of the pool in bytes
+ * @arg root_size Size of the root object, zero filled
+ * @return NULL on failure.
+ */
+art_pool* art_pool_create(const char *path, unsigned long size, unsigned long root_size) {
+	art_pool_hdr *h;
+	art_pool *p;
+	void *root;
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, size) || !(p = pool_map(fd, size))) {
+		close(fd);
+		return NULL;
+	}
+
+	h = p->hdr;
+	h->size = size;
+	h->base = ART_POOL_BASE;
+	h->max_blocks = size / 256;
+	h->heap = ART_POOL_HDR_SIZE + h->max_blocks * sizeof(art_pool_block);
+	h->heap = units(h->heap) * ART_POOL_UNIT;
+	h->top = h->heap;
+	h->nblocks = 0;
+	art_pool_reload(p);
+	cur_pool = p;
+
+	root = art_pool_alloc(root_size);
+	memset(root, 0, root_size);
+	h->root = (char *)root - (char *)h;
+	pool_flush(root, root_size);
+	pool_flush(h, sizeof(art_pool_hdr));
+	asm volatile("mfence" ::: "memory");
+
+	h->magic = ART_POOL_MAGIC;
+	pool_flush(h, sizeof(art_pool_hdr));
+	asm volatile("mfence" ::: "memory");
+	return p;
+}
+
+/**
+ * Maps an existing pool file and rebuilds the allocator state
+ * @return NULL on failure.
+ */
+art_pool* art_pool_open(const char *path) {
+	art_pool_hdr h;
+	art_pool *p;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return NULL;
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != ART_POOL_MAGIC ||
+			h.base != ART_POOL_BASE || !(p = pool_map(fd, h.size))) {
+		close(fd);
+		return NULL;
+	}
+
+	art_pool_reload(p);
+	cur_pool = p;
+	return p;
+}
+
+/**
+ * Unmaps the pool.
+ */
+void art_pool_close(art_pool *p) {
+	if (cur_pool == p)
+		cur_pool = NULL;
+	munmap(p->hdr, p->hdr->size);
+	close(p->fd);
+	free(p->unit_block);
+	free(p->next_free);
+	free(p);
+}
+
+/**
+ * Returns the root object of the pool
+ */
+void* art_pool_root(art_pool *p) {
+	return (char *)p->hdr + p->hdr->root;
+}
+
+/**
+ * Allocates 64-byte aligned memory from the last created or
+ * opened pool. The allocation is flushed but not fenced; it
+ * becomes durable with the next fence of the caller.
+ * @return NULL if the pool is full.
+ */
+void* art_pool_alloc(unsigned long size) {
+	art_pool *p = cur_pool;
+	art_pool_hdr *h = p->hdr;
+	art_pool_block *b;
+	unsigned long u, i, c = units(size);
+
+	if (c < NCLASSES && p->free_head[c] != NO_BLOCK) {
+		i = p->free_head[c];
+		p->free_head[c] = p->next_free[i];
+		b = &p->blocks[i];
+	} else {
+		if (h->nblocks == h->max_blocks || h->top + c * ART_POOL_UNIT > h->size)
+			return NULL;
+		i = h->nblocks;
+		b = &p->blocks[i];
+		b->off = h->top;
+		b->size = c * ART_POOL_UNIT;
+		h->top += b->size;
+		h->nblocks++;
+		pool_flush(&h->top, 2 * sizeof(uint64_t));
+	}
+	b->used = 1;
+	pool_flush(b, sizeof(art_pool_block));
+
+	for (u = b->off / ART_POOL_UNIT; u < units(b->off + b->size); u++)
+		p->unit_block[u] = i;
+	return (char *)h + b->off;
+}
+
+/**
+ * Finds the block holding ptr
+ * @return The block index, or -1 if ptr is not allocated.
+ */
+long art_pool_block_of(art_pool *p, const void *ptr) {
+	unsigned long off = (const char *)ptr - (const char *)p->hdr;
+
+	if ((const char *)ptr < (const char *)p->hdr || off >= p->hdr->size)
+		return -1;
+	if (p->unit_block[off / ART_POOL_UNIT] == NO_BLOCK)
+		return -1;
+	return p->unit_block[off / ART_POOL_UNIT];
+}
+
+/**
+ * Returns an allocation of the last created or opened pool.
+ */
+void art_pool_free(void *ptr) {
+	art_pool *p = cur_pool;
+	art_pool_block *b;
+	unsigned long u, c;
+	long i = art_pool_block_of(p, ptr);
+
+	if (i < 0)
+		abort();
+	b = &p->blocks[i];
+	b->used = 0;
+	pool_flush(b, sizeof(art_pool_block));
+
+	for (u = b->off / ART_POOL_UNIT; u < units(b->off + b->size); u++)
+		p->unit_block[u] = NO_BLOCK;
+	c = units(b->size);
+	if (c < NCLASSES) {
+		p->next_free[i] = p->free_head[c];
+		p->free_head[c] = i;
+	}
+}
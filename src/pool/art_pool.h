@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef ART_POOL_H
+#define ART_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ART_POOL_MAGIC		0x4c4f4f50545241UL	/* "ARTPOOL" */
+#define ART_POOL_BASE		0x100000000000UL
+#define ART_POOL_HDR_SIZE	4096
+#define ART_POOL_UNIT		64
+#define ART_POOL_CLASSES	64
+
+/**
+ * One allocation. The table of blocks lets recovery and
+ * offline tools enumerate every allocation in the pool.
+ */
+typedef struct {
+	uint64_t off;
+	uint32_t size;
+	uint32_t used;
+} art_pool_block;
+
+/**
+ * Persistent pool header, at the start of the file. The pool is
+ * always mapped at base so that the pointers stored in it stay
+ * valid across runs. The block table follows the header and the
+ * heap follows the table.
+ */
+typedef struct {
+	uint64_t magic;
+	uint64_t size;
+	uint64_t base;
+	uint64_t root;
+	uint64_t heap;
+	uint64_t top;
+	uint64_t nblocks;
+	uint64_t max_blocks;
+} art_pool_hdr;
+
+/**
+ * An open pool. Only hdr points into the pool, the rest is
+ * volatile allocator state rebuilt by art_pool_open().
+ */
+typedef struct {
+	art_pool_hdr *hdr;
+	art_pool_block *blocks;
+	int fd;
+	uint32_t *unit_block;
+	uint32_t *next_free;
+	uint32_t free_head[ART_POOL_CLASSES];
+} art_pool;
+
+/**
+ * Creates a pool file and maps it at ART_POOL_BASE
+ * @arg path The pool file
+ * @arg size Size of the pool in bytes
+ * @arg root_size Size of the root object, zero filled
+ * @return NULL on failure.
+ */
+art_pool* art_pool_create(const char *path, unsigned long size, unsigned long root_size);
+
+/**
+ * Maps an existing pool file and rebuilds the allocator state
+ * @return NULL on failure.
+ */
+art_pool* art_pool_open(const char *path);
+
+/**
+ * Rebuilds the volatile allocator state from the block table,
+ * after the contents of the mapping were replaced.
+ */
+void art_pool_reload(art_pool *p);
+
+/**
+ * Unmaps the pool.
+ */
+void art_pool_close(art_pool *p);
+
+/**
+ * Returns the root object of the pool
+ */
+void* art_pool_root(art_pool *p);
+
+/**
+ * Allocates 64-byte aligned memory from the last created or
+ * opened pool. The allocation is flushed but not fenced; it
+ * becomes durable with the next fence of the caller.
+ * @return NULL if the pool is full.
+ */
+void* art_pool_alloc(unsigned long size);
+
+/**
+ * Returns an allocation of the last created or opened pool.
+ */
+void art_pool_free(void *ptr);
+
+/**
+ * Finds the block holding ptr
+ * @return The block index, or -1 if ptr is not allocated.
+ */
+long art_pool_block_of(art_pool *p, const void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "art_shard.h"
+
+static inline art_shard* route(art_shard_tree *st, const art_key key) {
+	if (st->nshards == 1)
+		return st->shards;
+	return &st->shards[key >> st->shift];
+}
+
+// Applies queued inserts in batches until stopped. Callers are
+// released only once their batch is durable.
+static void* shard_writer(void *arg) {
+	art_shard *s = arg;
+	art_shard_req *batch[SHARD_QUEUE_LEN];
+	int i, cnt;
+
+	for (;;) {
+		pthread_mutex_lock(&s->qlock);
+		while (s->head == s->tail && !s->stop)
+			pthread_cond_wait(&s->not_empty, &s->qlock);
+		if (s->head == s->tail) {
+			pthread_mutex_unlock(&s->qlock);
+			break;
+		}
+		for (cnt = 0; s->head != s->tail; cnt++, s->head++)
+			batch[cnt] = s->queue[s->head % SHARD_QUEUE_LEN];
+		pthread_cond_broadcast(&s->not_full);
+		pthread_mutex_unlock(&s->qlock);
+
+		// Group commit: one fence makes the whole batch durable
+		pthread_rwlock_wrlock(&s->lock);
+		for (i = 0; i < cnt; i++)
+			batch[i]->old = art_insert_async(s->tree, batch[i]->key, batch[i]->key_len,
+					batch[i]->value, NULL);
+		art_sync(s->tree);
+		pthread_rwlock_unlock(&s->lock);
+
+		pthread_mutex_lock(&s->qlock);
+		for (i = 0; i < cnt; i++)
+			batch[i]->done = 1;
+		pthread_cond_broadcast(&s->done);
+		pthread_mutex_unlock(&s->qlock);
+	}
+	return NULL;
+}
+
+/**
+ * Releases the locks and the tree of a shard whose writer is not
+ * running
+ */
+static void shard_release(art_shard *s) {
+	pthread_rwlock_destroy(&s->lock);
+	pthread_mutex_destroy(&s->qlock);
+	pthread_cond_destroy(&s->not_empty);
+	pthread_cond_destroy(&s->not_full);
+	pthread_cond_destroy(&s->done);
+	art_drop_prefix(s->tree, 0, 0);
+	art_reclaim_wait(s->tree);
+	free(s->tree);
+}
+
+/**
+ * Initializes a sharded tree and starts one writer per shard
+ * @arg st The sharded tree
+ * @arg nshards Number of shards, a power of two up to SHARD_MAX
+ * @return 0 on success.
+ */
+int art_shard_init(art_shard_tree *st, int nshards) {
+	int i, bits = 0;
+	void *ret;
+
+	if (nshards < 1 || (unsigned long)nshards > SHARD_MAX || (nshards & (nshards - 1)))
+		return -1;
+	while ((1 << bits) < nshards)
+		bits++;
+
+	st->nshards = 0;
+	st->shift = (MAX_DEPTH + 1) * NODE_BITS - bits;
+	st->shards = calloc(nshards, sizeof(art_shard));
+	if (!st->shards)
+		return -1;
+
+	for (i = 0; i < nshards; i++) {
+		art_shard *s = &st->shards[i];
+		if (posix_memalign(&ret, 64, sizeof(art_tree)))
+			goto fail;
+		s->tree = ret;
+		art_tree_init(s->tree);
+		pthread_rwlock_init(&s->lock, NULL);
+		pthread_mutex_init(&s->qlock, NULL);
+		pthread_cond_init(&s->not_empty, NULL);
+		pthread_cond_init(&s->not_full, NULL);
+		pthread_cond_init(&s->done, NULL);
+		if (pthread_create(&s->writer, NULL, shard_writer, s)) {
+			shard_release(s);
+			goto fail;
+		}
+		st->nshards++;
+	}
+	return 0;
+
+fail:
+	// Stops the writers started so far
+	art_shard_destroy(st);
+	return -1;
+}
+
+/**
+ * Stops the writers and destroys the shards with their trees.
+ * The keys are dropped and the nodes reclaimed.
+ */
+void art_shard_destroy(art_shard_tree *st) {
+	int i;
+
+	for (i = 0; i < st->nshards; i++) {
+		art_shard *s = &st->shards[i];
+		pthread_mutex_lock(&s->qlock);
+		s->stop = 1;
+		pthread_cond_signal(&s->not_empty);
+		pthread_mutex_unlock(&s->qlock);
+		pthread_join(s->writer, NULL);
+		shard_release(s);
+	}
+	free(st->shards);
+	st->shards = NULL;
+	st->nshards = 0;
+}
+
+/**
+ * Inserts a new value, applied by the owning shard's writer
+ * @arg st The sharded tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned.
+ */
+void* art_shard_insert(art_shard_tree *st, const art_key key, int key_len, void *value) {
+	art_shard *s = route(st, key);
+	art_shard_req req;
+
+	req.key = key;
+	req.key_len = key_len;
+	req.value = value;
+	req.old = NULL;
+	req.done = 0;
+
+	pthread_mutex_lock(&s->qlock);
+	while (s->tail - s->head == SHARD_QUEUE_LEN)
+		pthread_cond_wait(&s->not_full, &s->qlock);
+	s->queue[s->tail % SHARD_QUEUE_LEN] = &req;
+	s->tail++;
+	pthread_cond_signal(&s->not_empty);
+
+	while (!req.done)
+		pthread_cond_wait(&s->done, &s->qlock);
+	pthread_mutex_unlock(&s->qlock);
+	return req.old;
+}
+
+/**
+ * Searches for a value in the owning shard
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_shard_search(art_shard_tree *st, const art_key key, int key_len) {
+	art_shard *s = route(st, key);
+	void *value;
+
+	pthread_rwlock_rdlock(&s->lock);
+	value = art_search(s->tree, key, key_len);
+	pthread_rwlock_unlock(&s->lock);
+	return value;
+}
+
+/**
+ * Iterates over all shards in key order.
+ * @return 0 on success, or the return of the callback.
+ */
+int art_shard_iter(art_shard_tree *st, art_callback cb, void *data) {
+	int i, res = 0;
+
+	for (i = 0; i < st->nshards && !res; i++) {
+		art_shard *s = &st->shards[i];
+		pthread_rwlock_rdlock(&s->lock);
+		res = art_iter(s->tree, cb, data);
+		pthread_rwlock_unlock(&s->lock);
+	}
+	return res;
+}
+
+/**
+ * Returns the number of keys over all shards.
+ */
+uint64_t art_shard_size(art_shard_tree *st) {
+	uint64_t size = 0;
+	int i;
+
+	for (i = 0; i < st->nshards; i++)
+		size += art_size(st->shards[i].tree);
+	return size;
+}
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#ifndef ART_SHARD_H
+#define ART_SHARD_H
+
+/* The front-end is built against one tree variant,
+ * WORT by default or WOART with -DUSE_WOART. */
+#ifdef USE_WOART
+#include "../woart/woart.h"
+#else
+#include "../wort/wort.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHARD_MAX			NUM_NODE_ENTRIES
+#define SHARD_QUEUE_LEN		256
+
+/**
+ * A pending insert handed to a shard's writer thread.
+ */
+typedef struct {
+	art_key key;
+	int key_len;
+	void *value;
+	void *old;
+	volatile int done;
+} art_shard_req;
+
+/**
+ * One independent tree with its own writer thread.
+ * The writer drains the queue in batches under the write
+ * side of lock and group commits each batch with art_sync(),
+ * searches and scans take the read side.
+ */
+typedef struct {
+	art_tree *tree;
+	pthread_t writer;
+	pthread_rwlock_t lock;
+	pthread_mutex_t qlock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+	pthread_cond_t done;
+	art_shard_req *queue[SHARD_QUEUE_LEN];
+	unsigned int head;
+	unsigned int tail;
+	int stop;
+} art_shard;
+
+/**
+ * Sharded front-end. Keys are routed by their top NODE_BITS,
+ * the digit the root splits on, so each shard owns a contiguous
+ * key range and scanning the shards in order is a global scan.
+ * The front-end is volatile: the trees are allocated with
+ * posix_memalign() and there is no reopen path, so they cannot be
+ * found after a restart, whichever allocator holds their nodes.
+ */
+typedef struct {
+	int nshards;
+	int shift;
+	art_shard *shards;
+} art_shard_tree;
+
+/**
+ * Initializes a sharded tree and starts one writer per shard
+ * @arg st The sharded tree
+ * @arg nshards Number of shards, a power of two up to SHARD_MAX
+ * @return 0 on success.
+ */
+int art_shard_init(art_shard_tree *st, int nshards);
+
+/**
+ * Stops the writers and destroys the shards with their trees.
+ * The keys are dropped and the nodes reclaimed.
+ */
+void art_shard_destroy(art_shard_tree *st);
+
+/**
+ * Inserts a new value, applied by the owning shard's writer
+ * @arg st The sharded tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned.
+ */
+void* art_shard_insert(art_shard_tree *st, const art_key key, int key_len, void *value);
+
+/**
+ * Searches for a value in the owning shard
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_shard_search(art_shard_tree *st, const art_key key, int key_len);
+
+/**
+ * Iterates over all shards in key order.
+ * @return 0 on success, or the return of the callback.
+ */
+int art_shard_iter(art_shard_tree *st, art_callback cb, void *data);
+
+/**
+ * Returns the number of keys over all shards.
+ */
+uint64_t art_shard_size(art_shard_tree *st);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
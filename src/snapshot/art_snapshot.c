@@ -0,0 +1,285 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "art_snapshot.h"
+
+#define LINE_KEYS		(ART_SNAP_LINE / sizeof(art_key))
+
+static inline uint64_t line_align(uint64_t off) {
+	return (off + ART_SNAP_LINE - 1) & ~(uint64_t)(ART_SNAP_LINE - 1);
+}
+
+static inline uint64_t lines(uint64_t entries) {
+	return (entries + LINE_KEYS - 1) / LINE_KEYS;
+}
+
+/**
+ * Places the arrays of a snapshot of count keys
+ * @return the size of the file.
+ */
+static uint64_t layout(art_snapshot_hdr *h, uint64_t count) {
+	uint64_t off, m;
+
+	memset(h, 0, sizeof(art_snapshot_hdr));
+	h->magic = ART_SNAP_MAGIC;
+	h->version = ART_SNAP_VERSION;
+	h->key_bytes = sizeof(art_key);
+	h->per_line = LINE_KEYS;
+	h->count = count;
+
+	off = line_align(sizeof(art_snapshot_hdr));
+	h->keys = off;
+	off = line_align(off + count * sizeof(art_key));
+	h->values = off;
+	off = line_align(off + count * sizeof(uint64_t));
+
+	// One entry per line of the level below, up to a single line
+	for (m = lines(count); m > 1 && h->levels < ART_SNAP_MAX_LEVELS; m = lines(m)) {
+		h->level[h->levels] = off;
+		h->level_len[h->levels] = m;
+		h->levels++;
+		off = line_align(off + m * sizeof(art_key));
+	}
+	h->size = off;
+	return off;
+}
+
+typedef struct {
+	art_key *keys;
+	uint64_t *values;
+	uint64_t count;
+	uint64_t max;
+} freeze_ctx;
+
+static int freeze_leaf(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	freeze_ctx *c = data;
+	(void)key_len;
+
+	if (c->count == c->max)
+		return 1;
+	memcpy(&c->keys[c->count], key, sizeof(art_key));
+	c->values[c->count] = (uintptr_t)value;
+	c->count++;
+	return 0;
+}
+
+static int count_value(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	(void)key;
+	(void)key_len;
+	(void)value;
+	(*(uint64_t *)data)++;
+	return 0;
+}
+
+/**
+ * Writes a read-only, pointer-free copy of the tree to a file.
+ * Values are stored as their 64-bit word, so they should not be
+ * pointers into the process. The file is written under a
+ * temporary name and renamed, so readers never see it half done.
+ * A multi-value tree is stored with one entry per value.
+ * @arg t The tree, not modified while freezing
+ * @arg path The snapshot file
+ * @return 0 on success.
+ */
+int art_freeze(art_tree *t, const char *path) {
+	art_snapshot_hdr h;
+	freeze_ctx c;
+	art_key *below, *level;
+	uint64_t count, size, i;
+	char *tmp, *base;
+	int fd, l, ret = -1;
+
+	// A key of a multi-value tree takes one entry per value
+	count = art_size(t);
+	if (t->meta.flags & ART_FLAG_MULTI) {
+		count = 0;
+		art_iter(t, count_value, &count);
+	}
+
+	size = layout(&h, count);
+	if (h.levels == ART_SNAP_MAX_LEVELS)
+		return -1;
+
+	tmp = malloc(strlen(path) + 5);
+	if (!tmp)
+		return -1;
+	sprintf(tmp, "%s.tmp", path);
+
+	fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+	if (ftruncate(fd, size)) {
+		close(fd);
+		goto out_unlink;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		goto out_unlink;
+
+	c.keys = (art_key *)(base + h.keys);
+	c.values = (uint64_t *)(base + h.values);
+	c.count = 0;
+	c.max = h.count;
+	if (art_iter(t, freeze_leaf, &c) || c.count != h.count)
+		goto out_unmap;
+
+	below = c.keys;
+	for (l = 0; l < (int)h.levels; l++) {
+		level = (art_key *)(base + h.level[l]);
+		for (i = 0; i < h.level_len[l]; i++)
+			level[i] = below[i * LINE_KEYS];
+		below = level;
+	}
+
+	memcpy(base, &h, sizeof(h));
+	if (msync(base, size, MS_SYNC))
+		goto out_unmap;
+	if (!rename(tmp, path))
+		ret = 0;
+
+out_unmap:
+	munmap(base, size);
+out_unlink:
+	if (ret)
+		unlink(tmp);
+out:
+	free(tmp);
+	return ret;
+}
+
+/**
+ * Maps a snapshot written by art_freeze(). Nothing is read or
+ * converted, queries run directly on the mapping.
+ * @return NULL on failure, or if the snapshot was written with
+ * another key width.
+ */
+art_snapshot* art_snapshot_open(const char *path) {
+	const art_snapshot_hdr *h;
+	art_snapshot *s;
+	struct stat st;
+	void *base;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || (unsigned long)st.st_size < sizeof(art_snapshot_hdr)) {
+		close(fd);
+		return NULL;
+	}
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return NULL;
+
+	h = base;
+	if (h->magic != ART_SNAP_MAGIC || h->version != ART_SNAP_VERSION ||
+			h->key_bytes != sizeof(art_key) || h->size != (uint64_t)st.st_size ||
+			h->per_line != LINE_KEYS || h->levels > ART_SNAP_MAX_LEVELS) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+
+	s = malloc(sizeof(art_snapshot));
+	if (!s) {
+		munmap(base, st.st_size);
+		return NULL;
+	}
+	s->hdr = h;
+	s->keys = (const art_key *)((const char *)base + h->keys);
+	s->values = (const uint64_t *)((const char *)base + h->values);
+	s->size = st.st_size;
+	return s;
+}
+
+/**
+ * Unmaps the snapshot.
+ */
+void art_snapshot_close(art_snapshot *s) {
+	munmap((void *)s->hdr, s->size);
+	free(s);
+}
+
+/**
+ * Returns the number of keys in the snapshot.
+ */
+uint64_t art_snapshot_size(const art_snapshot *s) {
+	return s->hdr->count;
+}
+
+/**
+ * Finds the position of the first key not below key. Each level
+ * picks the last entry of its line that is below key, whose line
+ * below holds the answer or ends right before it. An entry equal
+ * to key is passed over, as copies of a key in a multi-value
+ * snapshot may end the line before it.
+ */
+static uint64_t lower_bound(const art_snapshot *s, const art_key key) {
+	const art_snapshot_hdr *h = s->hdr;
+	const art_key *e;
+	uint64_t i, end, line = 0;
+	int l;
+
+	for (l = (int)h->levels - 1; l >= 0; l--) {
+		e = (const art_key *)((const char *)h + h->level[l]);
+		i = line * LINE_KEYS;
+		end = i + LINE_KEYS < h->level_len[l] ? i + LINE_KEYS : h->level_len[l];
+		for (line = i++; i < end && e[i] < key; i++)
+			line = i;
+	}
+
+	i = line * LINE_KEYS;
+	end = i + LINE_KEYS < h->count ? i + LINE_KEYS : h->count;
+	while (i < end && s->keys[i] < key)
+		i++;
+	return i;
+}
+
+/**
+ * Searches for a value in the snapshot
+ * @arg s The snapshot
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value is returned.
+ */
+void* art_snapshot_search(const art_snapshot *s, const art_key key, int key_len) {
+	uint64_t i = lower_bound(s, key);
+	(void)key_len;
+
+	if (i < s->hdr->count && s->keys[i] == key)
+		return (void *)(uintptr_t)s->values[i];
+	return NULL;
+}
+
+/**
+ * Iterates over the keys in [lo, hi] in ascending order, with the
+ * callback of art_iter(). The key passed to it points into the
+ * mapping.
+ * @arg s The snapshot
+ * @arg lo The smallest key of the range
+ * @arg hi The largest key of the range
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_snapshot_range(const art_snapshot *s, const art_key lo, const art_key hi,
+		art_callback cb, void *data) {
+	uint64_t i;
+	int res;
+
+	if (lo > hi)
+		return 0;
+	for (i = lower_bound(s, lo); i < s->hdr->count && s->keys[i] <= hi; i++) {
+		res = cb(data, (const unsigned char *)&s->keys[i], sizeof(art_key),
+				(void *)(uintptr_t)s->values[i]);
+		if (res)
+			return res;
+	}
+	return 0;
+}
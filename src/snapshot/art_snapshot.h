@@ -0,0 +1,116 @@
+#include <stdint.h>
+#include <stdbool.h>
+#ifndef ART_SNAPSHOT_H
+#define ART_SNAPSHOT_H
+
+/* Snapshots are written from one tree variant,
+ * WORT by default or WOART with -DUSE_WOART. */
+#ifdef USE_WOART
+#include "../woart/woart.h"
+#else
+#include "../wort/wort.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ART_SNAP_MAGIC		0x50414e53545241UL	/* "ARTSNAP" */
+#define ART_SNAP_VERSION	1
+#define ART_SNAP_LINE		64
+#define ART_SNAP_MAX_LEVELS	32
+
+/**
+ * File header of a frozen tree. The file holds no pointers, only
+ * offsets from its start, so it can be mapped anywhere.
+ *
+ * keys is the sorted array of the count keys and values the
+ * matching array of 64-bit values. Above the keys sit levels of
+ * an implicit B-tree: entry i of level 0 is the first key of
+ * cache line i of the keys, entry i of level l + 1 the first
+ * entry of line i of level l. A lookup reads one line per level
+ * and finds the next line by arithmetic. Every array starts on
+ * a cache line.
+ */
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t key_bytes;
+	uint64_t count;
+	uint64_t size;
+	uint32_t levels;
+	uint32_t per_line;
+	uint64_t keys;
+	uint64_t values;
+	uint64_t level[ART_SNAP_MAX_LEVELS];
+	uint64_t level_len[ART_SNAP_MAX_LEVELS];
+} art_snapshot_hdr;
+
+/**
+ * A snapshot mapped read-only by art_snapshot_open()
+ */
+typedef struct {
+	const art_snapshot_hdr *hdr;
+	const art_key *keys;
+	const uint64_t *values;
+	unsigned long size;
+} art_snapshot;
+
+/**
+ * Writes a read-only, pointer-free copy of the tree to a file.
+ * Values are stored as their 64-bit word, so they should not be
+ * pointers into the process. The file is written under a
+ * temporary name and renamed, so readers never see it half done.
+ * A multi-value tree is stored with one entry per value.
+ * @arg t The tree, not modified while freezing
+ * @arg path The snapshot file
+ * @return 0 on success.
+ */
+int art_freeze(art_tree *t, const char *path);
+
+/**
+ * Maps a snapshot written by art_freeze(). Nothing is read or
+ * converted, queries run directly on the mapping.
+ * @return NULL on failure, or if the snapshot was written with
+ * another key width.
+ */
+art_snapshot* art_snapshot_open(const char *path);
+
+/**
+ * Unmaps the snapshot.
+ */
+void art_snapshot_close(art_snapshot *s);
+
+/**
+ * Returns the number of keys in the snapshot.
+ */
+uint64_t art_snapshot_size(const art_snapshot *s);
+
+/**
+ * Searches for a value in the snapshot
+ * @arg s The snapshot
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value is returned.
+ */
+void* art_snapshot_search(const art_snapshot *s, const art_key key, int key_len);
+
+/**
+ * Iterates over the keys in [lo, hi] in ascending order, with the
+ * callback of art_iter(). The key passed to it points into the
+ * mapping.
+ * @arg s The snapshot
+ * @arg lo The smallest key of the range
+ * @arg hi The largest key of the range
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_snapshot_range(const art_snapshot *s, const art_key lo, const art_key hi,
+		art_callback cb, void *data);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,111 @@
+/*
+ * Snapshot lookup check.
+ *
+ * Freezes multi-value trees in which one key holds from 1 to
+ * 4 * LINE_KEYS values, so that its copies start at every offset
+ * of a cache line and span several lines, and checks that
+ * art_snapshot_range() and art_snapshot_search() find all of them
+ * from every lower bound around the key. Build with art_snapshot.c
+ * and one tree (-DUSE_WOART for WOART).
+ *
+ * usage: snapshot_test [-n keys] [-p path]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "art_snapshot.h"
+
+#define LINE_KEYS	(ART_SNAP_LINE / sizeof(art_key))
+
+static int count_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	(void)key;
+	(void)key_len;
+	(void)value;
+	(*(uint64_t *)data)++;
+	return 0;
+}
+
+/**
+ * Freezes keys 1 to n, where key dup_key holds dups values, and
+ * checks the ranges starting around dup_key
+ * @return the number of failed checks.
+ */
+static int check(const char *path, unsigned long n, unsigned long dup_key, unsigned long dups) {
+	art_snapshot *s;
+	art_tree *t;
+	uint64_t seen, want;
+	unsigned long k, lo;
+	void *ret;
+	int fails = 0;
+
+	if (posix_memalign(&ret, 64, sizeof(art_tree)))
+		return 1;
+	t = ret;
+	art_tree_init(t);
+	art_set_multi_value(t, true);
+	for (k = 1; k <= n; k++)
+		art_insert(t, k, sizeof(art_key), (void *)(k << 16));
+	for (k = 1; k < dups; k++)
+		art_insert(t, dup_key, sizeof(art_key), (void *)(dup_key << 16 | k));
+
+	if (art_freeze(t, path) || !(s = art_snapshot_open(path))) {
+		fprintf(stderr, "cannot freeze to %s\n", path);
+		exit(1);
+	}
+	if (!art_snapshot_search(s, dup_key, sizeof(art_key))) {
+		fprintf(stderr, "%lu values: key %lu not found\n", dups, dup_key);
+		fails++;
+	}
+
+	for (lo = dup_key - 2; lo <= dup_key + 2; lo++) {
+		want = n - lo + 1 + (lo <= dup_key ? dups - 1 : 0);
+		seen = 0;
+		art_snapshot_range(s, lo, n, count_cb, &seen);
+		if (seen != want) {
+			fprintf(stderr, "%lu values: range from %lu has %lu keys, expected %lu\n",
+					dups, lo, seen, want);
+			fails++;
+		}
+	}
+	seen = 0;
+	art_snapshot_range(s, dup_key, dup_key, count_cb, &seen);
+	if (seen != dups) {
+		fprintf(stderr, "%lu values: key %lu has %lu values\n", dups, dup_key, seen);
+		fails++;
+	}
+
+	art_snapshot_close(s);
+	free(t);
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	const char *path = "snapshot_test.snap";
+	unsigned long n = 4096, dups;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			case 'p':
+				path = optarg;
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys] [-p path]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	for (dups = 1; dups <= 4 * LINE_KEYS; dups++)
+		fails += check(path, n, n / 2, dups);
+	unlink(path);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
@@ -0,0 +1,144 @@
+/*
+ * Group commit check.
+ *
+ * Inserts dense and scattered keys with art_insert_async(), syncs
+ * every few groups and checks that the tickets become durable, that
+ * a replacing insert returns the old value and that art_iter()
+ * visits exactly the keys of a sorted reference, also after
+ * art_tree_open(). Build with one tree (-DUSE_WOART for WOART).
+ *
+ * usage: async_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ref.h"
+
+#define SYNC_EVERY	(3 * ART_GROUP_COMMIT + 5)
+
+/**
+ * Inserts ref[i] for i < n asynchronously, syncing every
+ * SYNC_EVERY inserts
+ * @arg old If not NULL, old[i] is the value ref[i] replaces
+ * @return the number of failed checks.
+ */
+static int insert_all(art_tree *t, const ref_entry *ref, void **old, unsigned long n) {
+	art_ticket ticket, last = 0, synced = 0;
+	unsigned long i;
+	void *ret;
+	int fails = 0;
+
+	for (i = 0; i < n; i++) {
+		ret = art_insert_async(t, ref[i].key, sizeof(art_key), ref[i].value, &ticket);
+		if (ret == ART_INSERT_FAILED) {
+			fprintf(stderr, "insert of %#lx failed\n", (unsigned long)ref[i].key);
+			return fails + 1;
+		}
+		if (old && ret != old[i]) {
+			fprintf(stderr, "insert of %#lx returned %p, expected %p\n",
+					(unsigned long)ref[i].key, ret, old[i]);
+			fails++;
+		}
+		if (ticket <= last) {
+			fprintf(stderr, "ticket %lu after %lu\n", (unsigned long)ticket, (unsigned long)last);
+			fails++;
+		}
+		last = ticket;
+		if (i % SYNC_EVERY == SYNC_EVERY - 1) {
+			art_sync(t);
+			if (!art_durable(t, last)) {
+				fprintf(stderr, "ticket %lu not durable after art_sync()\n", (unsigned long)last);
+				fails++;
+			}
+			synced = last;
+		}
+	}
+	// Inserts before the last sync stay durable
+	if (synced && !art_durable(t, synced)) {
+		fprintf(stderr, "ticket %lu no longer durable\n", (unsigned long)synced);
+		fails++;
+	}
+	art_sync(t);
+	if (!art_durable(t, last)) {
+		fprintf(stderr, "ticket %lu not durable after art_sync()\n", (unsigned long)last);
+		fails++;
+	}
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 100000, m, i, j;
+	ref_entry *ref, *upd;
+	art_tree *t;
+	void **old, *ret;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	ref = malloc(n * sizeof(ref_entry));
+	upd = calloc(n, sizeof(ref_entry));
+	old = malloc(n * sizeof(void *));
+	if (!ref || !upd || !old || posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	t = ret;
+	art_tree_init(t);
+
+	// Every fourth key is a repeat, which replaces the value in place
+	for (i = 0; i < n; i++) {
+		if (i % 4 == 3)
+			ref[i].key = ref[rnd() % i].key;
+		else
+			ref[i].key = i % 2 ? (art_key)rnd() : (art_key)i;
+		ref[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ref[i].seq = i;
+	}
+	fails += insert_all(t, ref, NULL, n);
+	m = ref_build(ref, n);
+	fails += ref_compare(t, ref, m, "inserted");
+
+	// Replace every third key, in random order
+	for (i = j = 0; i < m; i += 3, j++) {
+		upd[j] = ref[i];
+		upd[j].value = (void *)(uintptr_t)((n + i) << 1 | 1);
+	}
+	for (i = j; i > 1; i--) {
+		ref_entry e = upd[i - 1];
+		unsigned long r = rnd() % i;
+		upd[i - 1] = upd[r];
+		upd[r] = e;
+	}
+	for (i = 0; i < j; i++)
+		old[i] = ((ref_entry *)bsearch(&upd[i], ref, m, sizeof(ref_entry), ref_key_cmp))->value;
+	fails += insert_all(t, upd, old, j);
+	for (i = 0; i < m; i += 3)
+		ref[i].value = (void *)(uintptr_t)((n + i) << 1 | 1);
+	fails += ref_compare(t, ref, m, "replaced");
+
+	if (art_tree_open(t)) {
+		fprintf(stderr, "cannot reopen the tree\n");
+		fails++;
+	} else
+		fails += ref_compare(t, ref, m, "reopened");
+
+	free(old);
+	free(upd);
+	free(ref);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Lower bound and floor check.
+ *
+ * Checks art_lower_bound() and art_floor() against the neighbours
+ * of present, absent and extreme keys in a sorted reference, on
+ * keys that share long compressed prefixes, dense runs and
+ * scattered keys, in an empty tree, in multi-value mode and after a
+ * prefix drop and a compaction. Build with one tree (-DUSE_WOART
+ * for WOART).
+ *
+ * usage: bound_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ref.h"
+
+#define TOP(x, bits)	((art_key)(x) << (ART_KEY_BITS - (bits)))
+
+static art_key make_key(unsigned long i) {
+	switch (i % 4) {
+		case 0:
+			return (art_key)rnd();
+		case 1:
+			// A long prefix shared with few other keys
+			return TOP(0xa5, 8) | (art_key)(rnd() % 7) << 12 | (art_key)(rnd() & 0xf);
+		case 2:
+			return (art_key)(i * 5);
+		default:
+			return TOP(rnd() & 0xf, 8) | (art_key)(rnd() & 0xffff) << 16;
+	}
+}
+
+/**
+ * Checks the bounds of one key
+ * @arg multi Whether the values of the leaves are not checked
+ * @return the number of failed checks.
+ */
+static int check_key(art_tree *t, const ref_entry *ref, unsigned long n, art_key key,
+		int multi, const char *when) {
+	const ref_entry *lower, *floor;
+	unsigned long j = ref_lower(ref, n, key);
+	art_leaf *l;
+	int fails = 0;
+
+	lower = j < n ? &ref[j] : NULL;
+	floor = j < n && ref[j].key == key ? &ref[j] : j ? &ref[j - 1] : NULL;
+
+	l = art_lower_bound(t, key, sizeof(art_key));
+	if (!l != !lower || (l && (l->key != lower->key || (!multi && l->value != lower->value)))) {
+		fprintf(stderr, "%s: lower bound of %#lx is %#lx, expected %#lx\n", when,
+				(unsigned long)key, l ? (unsigned long)l->key : 0UL,
+				lower ? (unsigned long)lower->key : 0UL);
+		fails++;
+	}
+	l = art_floor(t, key, sizeof(art_key));
+	if (!l != !floor || (l && (l->key != floor->key || (!multi && l->value != floor->value)))) {
+		fprintf(stderr, "%s: floor of %#lx is %#lx, expected %#lx\n", when,
+				(unsigned long)key, l ? (unsigned long)l->key : 0UL,
+				floor ? (unsigned long)floor->key : 0UL);
+		fails++;
+	}
+	return fails;
+}
+
+/**
+ * Checks the bounds of every key, of its neighbours, of random keys
+ * and of the extreme keys
+ * @return the number of failed checks.
+ */
+static int check_bounds(art_tree *t, const ref_entry *ref, unsigned long n, int multi,
+		const char *when) {
+	unsigned long i;
+	int fails = 0;
+
+	fails += check_key(t, ref, n, 0, multi, when);
+	fails += check_key(t, ref, n, (art_key)-1, multi, when);
+	for (i = 0; i < n && !fails; i++) {
+		fails += check_key(t, ref, n, ref[i].key, multi, when);
+		fails += check_key(t, ref, n, ref[i].key - 1, multi, when);
+		fails += check_key(t, ref, n, ref[i].key + 1, multi, when);
+		fails += check_key(t, ref, n, make_key(i), multi, when);
+	}
+	return fails;
+}
+
+static int check(unsigned long n, int multi) {
+	const char *mode = multi ? "multi-value" : "single value";
+	ref_entry *ref;
+	art_tree *t;
+	unsigned long i, m, j;
+	void *ret;
+	int fails = 0;
+
+	ref = malloc(n * sizeof(ref_entry));
+	if (!ref || posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	t = ret;
+	art_tree_init(t);
+	if (multi && art_set_multi_value(t, true))
+		fails++;
+	fails += check_bounds(t, ref, 0, multi, "empty");
+
+	for (i = 0; i < n; i++) {
+		ref[i].key = make_key(i);
+		ref[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ref[i].seq = i;
+		art_insert(t, ref[i].key, sizeof(art_key), ref[i].value);
+	}
+	m = ref_build(ref, n);
+	if (!multi)
+		fails += ref_compare(t, ref, m, mode);
+	fails += check_bounds(t, ref, m, multi, mode);
+
+	art_drop_prefix(t, TOP(0xa5, 8), 8);
+	art_reclaim_wait(t);
+	for (i = j = 0; i < m; i++)
+		if (ref[i].key >> (ART_KEY_BITS - 8) != 0xa5)
+			ref[j++] = ref[i];
+	m = j;
+	fails += check_bounds(t, ref, m, multi, "dropped");
+
+	art_compact(t, 0);
+	fails += check_bounds(t, ref, m, multi, "compacted");
+
+	free(ref);
+	free(t);
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 50000;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	fails += check(n, 0);
+	fails += check(n, 1);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
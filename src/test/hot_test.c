@@ -0,0 +1,158 @@
+/*
+ * Hot cache check.
+ *
+ * Looks keys up over and over through caches small enough to evict
+ * all the time and large enough to hold every key, while their
+ * values are replaced, with and without an open view, and while
+ * compaction and prefix drops free the cached leaves. Each round
+ * checks hits and misses against a sorted reference. Build with one
+ * tree (-DUSE_WOART for WOART).
+ *
+ * usage: hot_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ref.h"
+
+#define ROUNDS	3
+
+/**
+ * Looks up a skewed mix of present and absent keys, so that the
+ * same keys hit the cache again and again
+ * @return the number of failed checks.
+ */
+static int probe(art_tree *t, const ref_entry *ref, unsigned long n, const char *when) {
+	ref_entry e, *hit;
+	unsigned long i, r;
+
+	for (i = 0; i < 8 * n; i++) {
+		r = rnd();
+		if (i % 4 == 3)
+			e.key = (art_key)r;
+		else
+			e.key = ref[r % (i % 4 ? n / 64 + 1 : n)].key;
+		hit = bsearch(&e, ref, n, sizeof(ref_entry), ref_key_cmp);
+		if (art_search(t, e.key, sizeof(art_key)) != (hit ? hit->value : NULL)) {
+			fprintf(stderr, "%s: lookup of %#lx is wrong\n", when, (unsigned long)e.key);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Replaces the values of every other key of the reference, each
+ * round the other half
+ */
+static void replace(art_tree *t, ref_entry *ref, unsigned long n, unsigned long round) {
+	unsigned long i;
+
+	for (i = round % 2; i < n; i += 2) {
+		ref[i].value = (void *)(uintptr_t)((round << 40 | i) << 1 | 1);
+		art_insert(t, ref[i].key, sizeof(art_key), ref[i].value);
+	}
+}
+
+static int check(unsigned long n, unsigned long sets) {
+	ref_entry *ref;
+	art_tree *t;
+	art_view *v;
+	unsigned long i, m, j, round;
+	void *ret;
+	char when[64];
+	int fails = 0;
+
+	ref = malloc(n * sizeof(ref_entry));
+	if (!ref || posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	t = ret;
+	art_tree_init(t);
+	if (art_set_hot_cache(t, sets)) {
+		fprintf(stderr, "%lu sets refused\n", sets);
+		exit(1);
+	}
+
+	for (i = 0; i < n; i++) {
+		ref[i].key = i % 2 ? (art_key)rnd() : (art_key)(i * 17);
+		ref[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ref[i].seq = i;
+		art_insert(t, ref[i].key, sizeof(art_key), ref[i].value);
+	}
+	m = ref_build(ref, n);
+	snprintf(when, sizeof(when), "%lu sets", sets);
+	fails += ref_compare(t, ref, m, when) + probe(t, ref, m, when);
+
+	for (round = 1; round <= ROUNDS; round++) {
+		replace(t, ref, m, round);
+		fails += probe(t, ref, m, "replaced");
+	}
+
+	v = art_view_open(t);
+	replace(t, ref, m, ROUNDS + 1);
+	fails += probe(t, ref, m, "replaced under a view");
+	art_view_close(v);
+	replace(t, ref, m, ROUNDS + 2);
+	fails += probe(t, ref, m, "replaced after a view");
+
+	art_compact(t, 0);
+	fails += ref_compare(t, ref, m, "compacted") + probe(t, ref, m, "compacted");
+
+	// Drop the keys under the top digit of the largest key
+	art_drop_prefix(t, ref[m - 1].key, 8);
+	art_reclaim_wait(t);
+	for (i = j = 0; i < m; i++)
+		if (ref[i].key >> (ART_KEY_BITS - 8) != ref[m - 1].key >> (ART_KEY_BITS - 8))
+			ref[j++] = ref[i];
+	m = j;
+	fails += ref_compare(t, ref, m, "dropped") + probe(t, ref, m, "dropped");
+
+	if (art_tree_open(t) || t->hot) {
+		fprintf(stderr, "%s: the cache survived art_tree_open()\n", when);
+		fails++;
+	}
+	if (art_set_hot_cache(t, sets))
+		fails++;
+	fails += probe(t, ref, m, "reopened");
+	if (art_set_hot_cache(t, 0) || t->hot)
+		fails++;
+
+	free(ref);
+	free(t);
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 20000, sets;
+	art_tree t;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	art_tree_init(&t);
+	if (!art_set_hot_cache(&t, 3)) {
+		fprintf(stderr, "3 sets accepted\n");
+		fails++;
+	}
+
+	for (sets = 1; sets <= n; sets *= 16)
+		fails += check(n, sets);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * DRAM mirror check.
+ *
+ * Builds trees mirrored at every depth art_set_dram_levels()
+ * allows, with the mirror set on the empty tree or on a half full
+ * one, out of keys that differ in their top digits, in their low
+ * digits or in both. Checks hits and misses against a sorted
+ * reference, then again after a compaction, after a prefix drop and
+ * after art_tree_open() rebuilt the mirror. Build with one tree
+ * (-DUSE_WOART for WOART).
+ *
+ * usage: mirror_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ref.h"
+
+#define MAX_LEVELS	(ART_DRAM_MAX_BITS / NODE_BITS)
+#define TOP(x, bits)	((art_key)(x) << (ART_KEY_BITS - (bits)))
+
+static art_key make_key(unsigned long i) {
+	switch (i % 4) {
+		case 0:
+			return (art_key)rnd();
+		case 1:
+			// Only the mirrored digits differ
+			return TOP(rnd() & 0xffff, 16);
+		case 2:
+			return (art_key)i;
+		default:
+			// A few top digits over many low ones
+			return TOP(rnd() % 3, 8) | (art_key)(rnd() & 0xffffff);
+	}
+}
+
+/**
+ * Looks up keys that are mostly absent, next to present ones
+ * @return the number of failed checks.
+ */
+static int probe(art_tree *t, const ref_entry *ref, unsigned long n, const char *when) {
+	ref_entry e, *hit;
+	unsigned long i;
+
+	for (i = 0; i < 4 * n; i++) {
+		e.key = i % 2 ? make_key(i) : ref[i / 2 % n].key + (i % 4 == 0 ? 1 : -1);
+		hit = bsearch(&e, ref, n, sizeof(ref_entry), ref_key_cmp);
+		if (art_search(t, e.key, sizeof(art_key)) != (hit ? hit->value : NULL)) {
+			fprintf(stderr, "%s: lookup of %#lx is wrong\n", when, (unsigned long)e.key);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Builds a tree mirrored at the given depth and checks it
+ * @arg late Whether to set the mirror once half of the keys are in
+ * @return the number of failed checks.
+ */
+static int check(unsigned long n, int levels, int late) {
+	ref_entry *ref;
+	art_tree *t;
+	unsigned long i, m, j;
+	void *ret;
+	char when[64];
+	int fails = 0;
+
+	ref = malloc(n * sizeof(ref_entry));
+	if (!ref || posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	t = ret;
+	art_tree_init(t);
+	if (!late && art_set_dram_levels(t, levels))
+		fails++;
+
+	for (i = 0; i < n; i++) {
+		if (late && i == n / 2 && art_set_dram_levels(t, levels))
+			fails++;
+		ref[i].key = make_key(i);
+		ref[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ref[i].seq = i;
+		art_insert(t, ref[i].key, sizeof(art_key), ref[i].value);
+	}
+	m = ref_build(ref, n);
+	snprintf(when, sizeof(when), "%d levels%s", levels, late ? " set late" : "");
+	fails += ref_compare(t, ref, m, when) + probe(t, ref, m, when);
+
+	art_compact(t, 0);
+	fails += ref_compare(t, ref, m, "compacted") + probe(t, ref, m, "compacted");
+
+	// Drop the keys under the second top digit
+	art_drop_prefix(t, TOP(1, 8), 8);
+	art_reclaim_wait(t);
+	for (i = j = 0; i < m; i++)
+		if (ref[i].key >> (ART_KEY_BITS - 8) != 1)
+			ref[j++] = ref[i];
+	m = j;
+	fails += ref_compare(t, ref, m, "dropped") + probe(t, ref, m, "dropped");
+
+	if (art_tree_open(t) || (levels && (!t->dram || t->dram->levels != levels))) {
+		fprintf(stderr, "%s: the mirror was not rebuilt\n", when);
+		fails++;
+	} else
+		fails += ref_compare(t, ref, m, "reopened") + probe(t, ref, m, "reopened");
+
+	free(ref);
+	free(t);
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 50000;
+	art_tree t;
+	int opt, levels, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	art_tree_init(&t);
+	if (!art_set_dram_levels(&t, MAX_LEVELS + 1) || !art_set_dram_levels(&t, -1)) {
+		fprintf(stderr, "%d levels accepted\n", MAX_LEVELS + 1);
+		fails++;
+	}
+
+	for (levels = 0; levels <= MAX_LEVELS; levels++) {
+		fails += check(n, levels, 0);
+		fails += check(n, levels, 1);
+	}
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
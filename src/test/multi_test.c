@@ -0,0 +1,253 @@
+/*
+ * Multi-value check.
+ *
+ * Adds values to keys in multi-value mode, many more than a posting
+ * chunk holds for some keys, one for others and some key and value
+ * pairs twice, then removes every third pair and every value of a
+ * few keys. The values of each key, through art_values(),
+ * art_value_count() and art_search(), and every pair of art_iter()
+ * must match a sorted reference of the pairs, also after
+ * art_tree_open(), after a compaction and when new values reuse the
+ * freed slots. Build with one tree (-DUSE_WOART for WOART).
+ *
+ * usage: multi_test [-n values]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ref.h"
+
+/* Values per key of the crowded keys, on average */
+#define CROWD	(4 * ART_POSTING_SLOTS)
+
+/**
+ * The pairs that should be in the tree and the keys ever inserted,
+ * which stay without values
+ */
+typedef struct {
+	ref_entry *e;
+	unsigned long n;
+	art_key *keys;
+	unsigned long nkeys;
+} pairs;
+
+static int pair_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	pairs *p = data;
+
+	(void)key_len;
+	memcpy(&p->e[p->n].key, key, sizeof(art_key));
+	p->e[p->n].value = value;
+	p->e[p->n++].seq = (uintptr_t)value;
+	return 0;
+}
+
+static int key_cmp(const void *a, const void *b) {
+	const art_key *x = a, *y = b;
+	return *x < *y ? -1 : *x > *y;
+}
+
+static void add(art_tree *t, pairs *r, art_key key, void *value, int *fails) {
+	void *old = art_insert(t, key, sizeof(art_key), value);
+
+	if (old) {
+		fprintf(stderr, "adding %p to %#lx returned %p\n", value, (unsigned long)key, old);
+		(*fails)++;
+	}
+	r->e[r->n].key = key;
+	r->e[r->n].value = value;
+	r->e[r->n++].seq = (uintptr_t)value;
+	r->keys[r->nkeys++] = key;
+}
+
+/**
+ * Sorts the pairs by key and value, and the keys without repeats
+ */
+static void sort(pairs *r) {
+	unsigned long i, m = 0;
+
+	qsort(r->e, r->n, sizeof(ref_entry), ref_cmp);
+	qsort(r->keys, r->nkeys, sizeof(art_key), key_cmp);
+	for (i = 0; i < r->nkeys; i++)
+		if (!m || r->keys[m - 1] != r->keys[i])
+			r->keys[m++] = r->keys[i];
+	r->nkeys = m;
+}
+
+/**
+ * Compares the values of every key and every pair of a scan with
+ * the reference
+ * @arg got Room for the pairs of the reference
+ * @return the number of failed checks.
+ */
+static int compare(art_tree *t, const pairs *r, pairs *got, const char *when) {
+	unsigned long i, j, k;
+	ref_entry e;
+	void *v;
+	int fails = 0;
+
+	got->n = 0;
+	art_iter(t, pair_cb, got);
+	qsort(got->e, got->n, sizeof(ref_entry), ref_cmp);
+	if (got->n != r->n || memcmp(got->e, r->e, r->n * sizeof(ref_entry))) {
+		fprintf(stderr, "%s: the scan has %lu values, expected %lu\n", when, got->n, r->n);
+		fails++;
+	}
+	if (art_size(t) != r->nkeys) {
+		fprintf(stderr, "%s: size %lu, expected %lu\n", when, (unsigned long)art_size(t), r->nkeys);
+		fails++;
+	}
+
+	for (i = j = 0; i < r->nkeys && !fails; i++) {
+		for (k = j; k < r->n && r->e[k].key == r->keys[i]; k++)
+			;
+		got->n = 0;
+		art_values(t, r->keys[i], sizeof(art_key), pair_cb, got);
+		qsort(got->e, got->n, sizeof(ref_entry), ref_cmp);
+		if (got->n != k - j || memcmp(got->e, r->e + j, got->n * sizeof(ref_entry)) ||
+				art_value_count(t, r->keys[i], sizeof(art_key)) != k - j) {
+			fprintf(stderr, "%s: %#lx holds %lu values, expected %lu\n", when,
+					(unsigned long)r->keys[i], got->n, k - j);
+			fails++;
+		}
+		e.key = r->keys[i];
+		e.value = v = art_search(t, r->keys[i], sizeof(art_key));
+		e.seq = (uintptr_t)v;
+		if (k == j ? v != NULL : !bsearch(&e, r->e + j, k - j, sizeof(ref_entry), ref_cmp)) {
+			fprintf(stderr, "%s: %#lx was found with %p\n", when, (unsigned long)r->keys[i], v);
+			fails++;
+		}
+		// The key after it, unless it holds values too
+		e.key = r->keys[i] + 1;
+		if (!bsearch(&e.key, r->keys, r->nkeys, sizeof(art_key), key_cmp) &&
+				(art_value_count(t, e.key, sizeof(art_key)) ||
+				 art_search(t, e.key, sizeof(art_key)) ||
+				 !art_remove_value(t, e.key, sizeof(art_key), (void *)1))) {
+			fprintf(stderr, "%s: %#lx is not in the tree\n", when, (unsigned long)e.key);
+			fails++;
+		}
+		j = k;
+	}
+	return fails;
+}
+
+/**
+ * Removes every third pair and every value of every 64th key
+ * @return the number of failed checks.
+ */
+static int remove_values(art_tree *t, pairs *r) {
+	unsigned long i, j, k;
+	int fails = 0;
+
+	for (i = j = k = 0; i < r->n; i++) {
+		while (k < r->nkeys && r->keys[k] < r->e[i].key)
+			k++;
+		if (i % 3 != 1 && k % 64) {
+			r->e[j++] = r->e[i];
+			continue;
+		}
+		if (art_remove_value(t, r->e[i].key, sizeof(art_key), r->e[i].value)) {
+			fprintf(stderr, "cannot remove %p from %#lx\n", r->e[i].value,
+					(unsigned long)r->e[i].key);
+			fails++;
+		}
+	}
+	r->n = j;
+	if (!art_remove_value(t, r->keys[0], sizeof(art_key), (void *)0x2)) {
+		fprintf(stderr, "removed a value %#lx does not hold\n", (unsigned long)r->keys[0]);
+		fails++;
+	}
+	return fails;
+}
+
+static void insert_values(art_tree *t, pairs *r, unsigned long from, unsigned long to, int *fails) {
+	unsigned long i, j;
+
+	for (i = from; i < to; i++) {
+		if (i % 7 == 3 && r->n) {
+			// The same pair again
+			j = rnd() % r->n;
+			add(t, r, r->e[j].key, r->e[j].value, fails);
+		} else if (i % 4 == 0)
+			add(t, r, (art_key)rnd(), (void *)(uintptr_t)(i << 1 | 1), fails);
+		else
+			add(t, r, (art_key)(rnd() % (to / CROWD + 1)), (void *)(uintptr_t)(i << 1 | 1), fails);
+	}
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 40000;
+	pairs r, got;
+	art_tree *t;
+	void *ret;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n values]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 values\n");
+		return 2;
+	}
+
+	// n values, then n / 2 more after the removals
+	r.e = malloc(2 * n * sizeof(ref_entry));
+	r.keys = malloc(2 * n * sizeof(art_key));
+	got.e = malloc(2 * n * sizeof(ref_entry));
+	if (!r.e || !r.keys || !got.e || posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	t = ret;
+	art_tree_init(t);
+	r.n = r.nkeys = 0;
+
+	art_insert(t, 1, sizeof(art_key), (void *)1);
+	if (!art_set_multi_value(t, true)) {
+		fprintf(stderr, "switched a tree that is not empty\n");
+		fails++;
+	}
+	free(t);
+	if (posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	t = ret;
+	art_tree_init(t);
+	if (art_set_multi_value(t, true)) {
+		fprintf(stderr, "cannot switch an empty tree\n");
+		return 1;
+	}
+
+	insert_values(t, &r, 0, n, &fails);
+	sort(&r);
+	fails += compare(t, &r, &got, "inserted");
+
+	fails += remove_values(t, &r);
+	fails += compare(t, &r, &got, "removed");
+
+	art_tree_open(t);
+	fails += compare(t, &r, &got, "reopened");
+
+	art_compact(t, 0);
+	fails += compare(t, &r, &got, "compacted");
+
+	// New values fill the slots the removals freed
+	insert_values(t, &r, n, n + n / 2, &fails);
+	sort(&r);
+	fails += compare(t, &r, &got, "refilled");
+
+	free(got.e);
+	free(r.keys);
+	free(r.e);
+	free(t);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
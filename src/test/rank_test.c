@@ -0,0 +1,196 @@
+/*
+ * Rank and select check.
+ *
+ * Checks art_rank(), art_count_range() and art_select() against
+ * the positions of the keys in a sorted reference, with subtree
+ * counts kept from the start, enabled on a full tree, or disabled
+ * so that the queries walk the tree. The counts must follow
+ * inserts, replacements, a prefix drop, an attach, a compaction and
+ * art_tree_open(). Build with one tree (-DUSE_WOART for WOART).
+ *
+ * usage: rank_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ref.h"
+
+#define COUNTS_OFF		0
+#define COUNTS_EARLY	1
+#define COUNTS_LATE		2
+
+/* Queries per check, a tenth of them without counts, where each
+ * query walks the tree */
+#define QUERIES		2000
+
+#define TOP(x, bits)	((art_key)(x) << (ART_KEY_BITS - (bits)))
+
+static art_key make_key(unsigned long i) {
+	switch (i % 3) {
+		case 0:
+			return (art_key)rnd();
+		case 1:
+			return (art_key)(i * 3);
+		default:
+			return TOP(1, 8) | (art_key)(rnd() & 0xfffff);
+	}
+}
+
+/**
+ * Checks the rank and range counts of present and absent keys and
+ * selects ranks spread over the whole tree
+ * @return the number of failed checks.
+ */
+static int check_ranks(art_tree *t, const ref_entry *ref, unsigned long n, const char *when) {
+	unsigned long q = t->counts ? QUERIES : QUERIES / 10, i, want;
+	art_key key, lo, hi;
+	art_leaf *l;
+
+	for (i = rnd() % (n / q + 1); i < n; i += n / q + 1) {
+		l = art_select(t, i);
+		if (!l || l->key != ref[i].key || l->value != ref[i].value) {
+			fprintf(stderr, "%s: rank %lu selects %#lx, expected %#lx\n", when, i,
+					l ? (unsigned long)l->key : 0UL, (unsigned long)ref[i].key);
+			return 1;
+		}
+	}
+	if (art_select(t, n)) {
+		fprintf(stderr, "%s: rank %lu is past the last key\n", when, n);
+		return 1;
+	}
+
+	for (i = 0; i < q; i++) {
+		key = i % 2 ? ref[rnd() % n].key + (i % 4 == 1) : make_key(i);
+		want = ref_lower(ref, n, key);
+		if (art_rank(t, key, sizeof(art_key)) != want) {
+			fprintf(stderr, "%s: rank of %#lx is %lu, expected %lu\n", when, (unsigned long)key,
+					(unsigned long)art_rank(t, key, sizeof(art_key)), want);
+			return 1;
+		}
+
+		lo = ref[rnd() % n].key - (i % 3);
+		hi = i % 5 ? lo + (rnd() >> (i % 64)) : lo - 1;
+		if (hi < lo)
+			want = 0;
+		else if (hi == (art_key)-1)
+			want = n - ref_lower(ref, n, lo);
+		else
+			want = ref_lower(ref, n, hi + 1) - ref_lower(ref, n, lo);
+		if (art_count_range(t, lo, sizeof(art_key), hi, sizeof(art_key)) != want) {
+			fprintf(stderr, "%s: [%#lx, %#lx] holds %lu keys, expected %lu\n", when,
+					(unsigned long)lo, (unsigned long)hi,
+					(unsigned long)art_count_range(t, lo, sizeof(art_key), hi, sizeof(art_key)),
+					want);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int check(unsigned long n, int mode) {
+	static const char *modes[] = { "no counts", "counts", "late counts" };
+	ref_entry *ref;
+	art_tree *t, *src;
+	unsigned long i, m, j, k;
+	void *ret;
+	int fails = 0;
+
+	ref = malloc(2 * n * sizeof(ref_entry));
+	if (!ref || posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	t = ret;
+	if (posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	src = ret;
+	art_tree_init(t);
+	if (mode == COUNTS_EARLY && art_set_counts(t, true))
+		fails++;
+
+	for (i = 0; i < n; i++) {
+		ref[i].key = make_key(i);
+		ref[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ref[i].seq = i;
+		art_insert(t, ref[i].key, sizeof(art_key), ref[i].value);
+	}
+	if (mode == COUNTS_LATE && art_set_counts(t, true))
+		fails++;
+	m = ref_build(ref, n);
+	fails += ref_compare(t, ref, m, modes[mode]) + check_ranks(t, ref, m, modes[mode]);
+
+	// Replacing values leaves the ranks alone
+	for (i = 0; i < m; i += 5) {
+		ref[i].value = (void *)(uintptr_t)((n + i) << 1 | 1);
+		art_insert(t, ref[i].key, sizeof(art_key), ref[i].value);
+	}
+	fails += check_ranks(t, ref, m, "replaced");
+
+	art_drop_prefix(t, TOP(1, 8), 8);
+	art_reclaim_wait(t);
+	for (i = j = 0; i < m; i++)
+		if (ref[i].key >> (ART_KEY_BITS - 8) != 1)
+			ref[j++] = ref[i];
+	m = j;
+	fails += check_ranks(t, ref, m, "dropped");
+
+	// Put other keys under the dropped prefix back with an attach
+	art_tree_init(src);
+	if (mode != COUNTS_OFF && art_set_counts(src, true))
+		fails++;
+	for (i = 0, k = m; i < n / 3; i++, k++) {
+		ref[k].key = TOP(1, 8) | (art_key)(rnd() & 0xffff);
+		ref[k].value = (void *)(uintptr_t)((2 * n + i) << 1 | 1);
+		ref[k].seq = k;
+		art_insert(src, ref[k].key, sizeof(art_key), ref[k].value);
+	}
+	if (art_attach_prefix(t, TOP(1, 8), 8, src)) {
+		fprintf(stderr, "%s: attach failed\n", modes[mode]);
+		fails++;
+	}
+	m = ref_build(ref, k);
+	fails += ref_compare(t, ref, m, "attached") + check_ranks(t, ref, m, "attached");
+
+	art_compact(t, 0);
+	fails += check_ranks(t, ref, m, "compacted");
+
+	if (art_tree_open(t) || (mode != COUNTS_OFF) != (t->counts != NULL)) {
+		fprintf(stderr, "%s: the counts were not rebuilt\n", modes[mode]);
+		fails++;
+	} else
+		fails += check_ranks(t, ref, m, "reopened");
+
+	free(ref);
+	free(src);
+	free(t);
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 30000;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	fails += check(n, COUNTS_OFF);
+	fails += check(n, COUNTS_EARLY);
+	fails += check(n, COUNTS_LATE);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
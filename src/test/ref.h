@@ -0,0 +1,144 @@
+/*
+ * Sorted reference of the keys a check inserted, and the comparison
+ * of a tree against it. Included by the checks of this directory,
+ * built with one tree (-DUSE_WOART for WOART).
+ */
+#ifndef ART_REF_H
+#define ART_REF_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#ifdef USE_WOART
+#include "../woart/woart.h"
+#else
+#include "../wort/wort.h"
+#endif
+
+/**
+ * One insert, seq orders the inserts of a key
+ */
+typedef struct {
+	art_key key;
+	void *value;
+	unsigned long seq;
+} ref_entry;
+
+/**
+ * Position of a scan in the reference
+ */
+typedef struct {
+	const ref_entry *ref;
+	unsigned long n;
+	unsigned long pos;
+	int fails;
+} ref_cursor;
+
+static unsigned long rnd_state = 88172645463325252UL;
+
+static inline unsigned long rnd(void) {
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+	return rnd_state;
+}
+
+/**
+ * Orders entries by key, then by insert
+ */
+static inline int ref_cmp(const void *a, const void *b) {
+	const ref_entry *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * Orders entries by key, to look one up with bsearch()
+ */
+static inline int ref_key_cmp(const void *a, const void *b) {
+	const ref_entry *x = a, *y = b;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+/**
+ * Sorts the inserts by key and keeps the last one of each key
+ * @return the number of distinct keys.
+ */
+static inline unsigned long ref_build(ref_entry *ref, unsigned long n) {
+	unsigned long i, m = 0;
+
+	qsort(ref, n, sizeof(ref_entry), ref_cmp);
+	for (i = 0; i < n; i++) {
+		if (m && ref[m - 1].key == ref[i].key)
+			m--;
+		ref[m++] = ref[i];
+	}
+	return m;
+}
+
+/**
+ * Finds the first entry of the reference that is not below key
+ * @return its index, n if all entries are below key.
+ */
+static inline unsigned long ref_lower(const ref_entry *ref, unsigned long n, art_key key) {
+	unsigned long lo = 0, hi = n, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (ref[mid].key < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Callback of art_iter() that checks each key against the next
+ * entry of the reference
+ */
+static inline int ref_iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	ref_cursor *c = data;
+	art_key k;
+
+	(void)key_len;
+	memcpy(&k, key, sizeof(art_key));
+	if (c->pos >= c->n || c->ref[c->pos].key != k || c->ref[c->pos].value != value) {
+		fprintf(stderr, "key %lu of the scan is %#lx, expected %#lx\n", c->pos,
+				(unsigned long)k, c->pos < c->n ? (unsigned long)c->ref[c->pos].key : 0UL);
+		c->fails++;
+		return 1;
+	}
+	c->pos++;
+	return 0;
+}
+
+/**
+ * Compares the keys, values and size of a tree with the reference
+ * @return the number of failed checks.
+ */
+static inline int ref_compare(art_tree *t, const ref_entry *ref, unsigned long n, const char *when) {
+	ref_cursor c = { ref, n, 0, 0 };
+	unsigned long i;
+
+	art_iter(t, ref_iter_cb, &c);
+	if (!c.fails && c.pos != n) {
+		fprintf(stderr, "%s: the scan has %lu keys, expected %lu\n", when, c.pos, n);
+		c.fails++;
+	}
+	if (art_size(t) != n) {
+		fprintf(stderr, "%s: size %lu, expected %lu\n", when, (unsigned long)art_size(t), n);
+		c.fails++;
+	}
+	for (i = 0; i < n; i++) {
+		if (art_search(t, ref[i].key, sizeof(art_key)) != ref[i].value) {
+			fprintf(stderr, "%s: key %#lx not found\n", when, (unsigned long)ref[i].key);
+			c.fails++;
+			break;
+		}
+	}
+	return c.fails;
+}
+
+#endif
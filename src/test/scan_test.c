@@ -0,0 +1,190 @@
+/*
+ * Parallel scan check.
+ *
+ * Scans ranges of a tree with art_parallel_scan() from 1 to
+ * MAX_THREADS threads, each thread collecting the keys it visits,
+ * and checks that together they visited exactly the slice of a
+ * sorted reference that falls in the range, each key once with its
+ * value. The ranges cover the whole tree, single keys, absent keys,
+ * empty ranges and the ends of the key space. A callback that stops
+ * the scan must stop it. Build with one tree (-DUSE_WOART for
+ * WOART).
+ *
+ * usage: scan_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ref.h"
+
+#define MAX_THREADS	16
+#define STOP_AFTER	100
+#define STOPPED		7
+
+/**
+ * Keys visited by one thread
+ */
+typedef struct {
+	ref_entry *e;
+	unsigned long n;
+	unsigned long max;
+	art_key lo;
+	art_key hi;
+} visits;
+
+static int visit_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	visits *v = data;
+
+	(void)key_len;
+	if (v->n == v->max)
+		return -2;
+	memcpy(&v->e[v->n].key, key, sizeof(art_key));
+	v->e[v->n].value = value;
+	v->e[v->n].seq = 0;
+	if (v->e[v->n].key < v->lo || v->e[v->n].key > v->hi)
+		return -3;
+	v->n++;
+	return 0;
+}
+
+static int stop_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	visits *v = data;
+
+	(void)key;
+	(void)key_len;
+	(void)value;
+	return __sync_add_and_fetch(&v->n, 1) == STOP_AFTER ? STOPPED : 0;
+}
+
+/**
+ * Scans [lo, hi] and compares the merged visits with the reference
+ * @return the number of failed checks.
+ */
+static int check_range(art_tree *t, const ref_entry *ref, unsigned long n, visits *v,
+		ref_entry *all, art_key lo, art_key hi, int threads) {
+	unsigned long first, last, total, i;
+	void *data[MAX_THREADS];
+	int ret;
+
+	for (i = 0; i < (unsigned long)threads; i++) {
+		v[i].n = 0;
+		v[i].lo = lo;
+		v[i].hi = hi;
+		data[i] = &v[i];
+	}
+	if ((ret = art_parallel_scan(t, lo, hi, visit_cb, data, threads))) {
+		fprintf(stderr, "[%#lx, %#lx] with %d threads: the scan returned %d\n",
+				(unsigned long)lo, (unsigned long)hi, threads, ret);
+		return 1;
+	}
+
+	for (i = total = 0; i < (unsigned long)threads; i++) {
+		memcpy(all + total, v[i].e, v[i].n * sizeof(ref_entry));
+		total += v[i].n;
+	}
+	qsort(all, total, sizeof(ref_entry), ref_key_cmp);
+
+	first = ref_lower(ref, n, lo);
+	last = hi == (art_key)-1 ? n : ref_lower(ref, n, hi + 1);
+	if (lo > hi)
+		last = first;
+	for (i = 0; i < total && first + i < last; i++)
+		if (all[i].key != ref[first + i].key || all[i].value != ref[first + i].value)
+			break;
+	if (i != total || total != last - first) {
+		fprintf(stderr, "[%#lx, %#lx] with %d threads: %lu keys visited, expected %lu\n",
+				(unsigned long)lo, (unsigned long)hi, threads, total, last - first);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 50000, m, i, r;
+	visits v[MAX_THREADS];
+	void *data[MAX_THREADS];
+	ref_entry *ref, *all;
+	art_key lo, hi;
+	art_tree *t;
+	void *ret;
+	int opt, threads, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	ref = malloc(n * sizeof(ref_entry));
+	all = malloc(n * sizeof(ref_entry));
+	if (!ref || !all || posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < MAX_THREADS; i++) {
+		v[i].e = malloc(n * sizeof(ref_entry));
+		v[i].max = n;
+		if (!v[i].e) {
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+	}
+	t = ret;
+	art_tree_init(t);
+
+	// An empty tree has nothing to scan
+	if (check_range(t, ref, 0, v, all, 0, (art_key)-1, 4))
+		fails++;
+
+	for (i = 0; i < n; i++) {
+		ref[i].key = i % 3 ? (art_key)rnd() : (art_key)(rnd() & 0xffffff);
+		ref[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ref[i].seq = i;
+		art_insert(t, ref[i].key, sizeof(art_key), ref[i].value);
+	}
+	m = ref_build(ref, n);
+	fails += ref_compare(t, ref, m, "inserted");
+
+	for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		fails += check_range(t, ref, m, v, all, 0, (art_key)-1, threads);
+		fails += check_range(t, ref, m, v, all, 0, 0xffffff, threads);
+		fails += check_range(t, ref, m, v, all, ref[m / 2].key, ref[m / 2].key, threads);
+		fails += check_range(t, ref, m, v, all, ref[m / 2].key + 1, ref[m / 2 + 1].key - 1, threads);
+		fails += check_range(t, ref, m, v, all, ref[m / 2].key, ref[m / 2].key - 1, threads);
+		fails += check_range(t, ref, m, v, all, ref[m - 1].key, (art_key)-1, threads);
+		for (r = 0; r < 8; r++) {
+			lo = ref[rnd() % m].key - r;
+			hi = lo + ((art_key)rnd() >> (r * 8));
+			if (hi < lo)
+				hi = (art_key)-1;
+			fails += check_range(t, ref, m, v, all, lo, hi, threads);
+		}
+
+		// The scan ends with the first non-zero callback
+		v[0].n = 0;
+		for (i = 0; i < (unsigned long)threads; i++)
+			data[i] = &v[0];
+		if (art_parallel_scan(t, 0, (art_key)-1, stop_cb, data, threads) != STOPPED) {
+			fprintf(stderr, "%d threads: the scan did not stop\n", threads);
+			fails++;
+		}
+	}
+
+	for (i = 0; i < MAX_THREADS; i++)
+		free(v[i].e);
+	free(all);
+	free(ref);
+	free(t);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * Tree statistics check.
+ *
+ * Checks art_stats() on an empty tree, on a single key, on a
+ * complete tree whose shape is known exactly and on mixed keys,
+ * whose leaves must be those of a sorted reference, every one of
+ * them at some depth, with one child pointer per node and leaf
+ * below the root. Every walk must agree whatever the number of
+ * threads, and compaction and a prefix drop must keep the shape
+ * consistent. Build with one tree (-DUSE_WOART for WOART).
+ *
+ * usage: stats_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "ref.h"
+
+/* Complete tree of DENSE_LEVELS full levels of nodes */
+#define DENSE_LEVELS	(16 / NODE_BITS)
+#define FANOUT			(1UL << NODE_BITS)
+
+#ifdef USE_WOART
+static uint64_t total(const uint64_t *v) {
+	return v[0] + v[1] + v[2] + v[3];
+}
+#define NODES(s)		total((s)->nodes)
+#define CHILDREN(s)		total((s)->children)
+#else
+#define NODES(s)		((s)->nodes)
+#define CHILDREN(s)		((s)->children)
+#endif
+
+static art_tree* tree_new(void) {
+	void *ret;
+
+	if (posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	art_tree_init(ret);
+	return ret;
+}
+
+/**
+ * Walks the tree with several numbers of threads and checks that
+ * the walks agree and describe a well formed tree of n leaves
+ * @return the number of failed checks.
+ */
+static int check_stats(art_tree *t, uint64_t n, art_tree_stats *s, const char *when) {
+	static const int threads[] = { 2, 3, 16, 64 };
+	art_tree_stats p;
+	uint64_t depths = 0;
+	unsigned int i;
+	int fails = 0;
+
+	art_stats(t, s, 1);
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+		art_stats(t, &p, threads[i]);
+		if (memcmp(s, &p, sizeof(art_tree_stats))) {
+			fprintf(stderr, "%s: %d threads disagree\n", when, threads[i]);
+			fails++;
+		}
+	}
+
+	for (i = 0; i <= MAX_HEIGHT; i++)
+		depths += s->leaf_depth[i];
+	if (s->leaves != n || depths != n) {
+		fprintf(stderr, "%s: %lu leaves over %lu depths, expected %lu\n", when,
+				(unsigned long)s->leaves, (unsigned long)depths, (unsigned long)n);
+		fails++;
+	}
+	if (n && CHILDREN(s) != NODES(s) + n - 1) {
+		fprintf(stderr, "%s: %lu children under %lu nodes\n", when,
+				(unsigned long)CHILDREN(s), (unsigned long)NODES(s));
+		fails++;
+	}
+	if (s->stale || s->waste > s->bytes || s->bytes < n * sizeof(art_leaf)) {
+		fprintf(stderr, "%s: %lu stale, %lu of %lu bytes wasted\n", when,
+				(unsigned long)s->stale, (unsigned long)s->waste, (unsigned long)s->bytes);
+		fails++;
+	}
+	return fails;
+}
+
+/**
+ * Checks trees whose shape is known: no key, one key, and every
+ * key below FANOUT^DENSE_LEVELS
+ * @return the number of failed checks.
+ */
+static int check_shapes(void) {
+	art_tree_stats s, zero;
+	art_tree *t = tree_new();
+	unsigned long i, keys, nodes;
+	int fails = 0;
+
+	memset(&zero, 0, sizeof(zero));
+	fails += check_stats(t, 0, &s, "empty");
+	if (memcmp(&s, &zero, sizeof(s))) {
+		fprintf(stderr, "empty: the tree has a shape\n");
+		fails++;
+	}
+
+	art_insert(t, 42, sizeof(art_key), (void *)1);
+	fails += check_stats(t, 1, &s, "one key");
+	if (NODES(&s) || s.leaf_depth[0] != 1) {
+		fprintf(stderr, "one key: %lu nodes\n", (unsigned long)NODES(&s));
+		fails++;
+	}
+	free(t);
+
+	t = tree_new();
+	for (i = 0, keys = 1, nodes = 0; i < DENSE_LEVELS; i++) {
+		nodes += keys;
+		keys *= FANOUT;
+	}
+	for (i = 0; i < keys; i++)
+		art_insert(t, (art_key)i, sizeof(art_key), (void *)(uintptr_t)(i << 1 | 1));
+	fails += check_stats(t, keys, &s, "complete");
+	if (NODES(&s) != nodes || s.leaf_depth[DENSE_LEVELS] != keys) {
+		fprintf(stderr, "complete: %lu nodes, expected %lu\n", (unsigned long)NODES(&s), nodes);
+		fails++;
+	}
+#ifdef USE_WOART
+	if (s.nodes[3] != nodes) {
+		fprintf(stderr, "complete: %lu of %lu nodes are NODE256\n",
+				(unsigned long)s.nodes[3], nodes);
+		fails++;
+	}
+#endif
+	free(t);
+	return fails;
+}
+
+int main(int argc, char **argv) {
+	unsigned long n = 100000, m, i, j;
+	art_tree_stats s, c;
+	ref_entry *ref;
+	art_tree *t;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	fails += check_shapes();
+
+	ref = malloc(n * sizeof(ref_entry));
+	if (!ref) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	t = tree_new();
+	for (i = 0; i < n; i++) {
+		ref[i].key = i % 2 ? (art_key)rnd() : (art_key)i << 20;
+		ref[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ref[i].seq = i;
+		art_insert(t, ref[i].key, sizeof(art_key), ref[i].value);
+	}
+	m = ref_build(ref, n);
+	fails += ref_compare(t, ref, m, "mixed") + check_stats(t, m, &s, "mixed");
+
+	// Compaction moves the nodes but keeps the shape
+	art_compact(t, 0);
+	fails += check_stats(t, m, &c, "compacted");
+	if (NODES(&c) != NODES(&s) || CHILDREN(&c) != CHILDREN(&s) ||
+			memcmp(c.leaf_depth, s.leaf_depth, sizeof(s.leaf_depth))) {
+		fprintf(stderr, "compacted: the shape changed\n");
+		fails++;
+	}
+
+	art_drop_prefix(t, ref[m - 1].key, 8);
+	art_reclaim_wait(t);
+	for (i = j = 0; i < m; i++)
+		if (ref[i].key >> (ART_KEY_BITS - 8) != ref[m - 1].key >> (ART_KEY_BITS - 8))
+			ref[j++] = ref[i];
+	m = j;
+	fails += ref_compare(t, ref, m, "dropped") + check_stats(t, m, &s, "dropped");
+
+	free(ref);
+	free(t);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
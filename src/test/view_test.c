@@ -0,0 +1,198 @@
+/*
+ * View check.
+ *
+ * Opens views one after another while inserts add and replace keys,
+ * and checks that each view keeps returning the keys and values of
+ * a sorted reference taken when it was opened, through
+ * art_view_search() and art_view_iter(), also while another thread
+ * scans it as the writer goes on. Views are closed out of order,
+ * the tree itself must follow the newest reference throughout, and
+ * compaction and prefix drops must wait for the last view. Build
+ * with one tree (-DUSE_WOART for WOART).
+ *
+ * usage: view_test [-n keys]
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ref.h"
+
+#define VIEWS	4
+
+/**
+ * A view and the reference taken when it was opened
+ */
+typedef struct {
+	art_view *v;
+	ref_entry *ref;
+	unsigned long n;
+	const char *when;
+	int fails;
+} snap;
+
+static const char *names[VIEWS] = { "view 0", "view 1", "view 2", "view 3" };
+
+/**
+ * Compares a view with its reference, looking up every key and the
+ * key after it. Safe to call from a reader thread.
+ * @return the number of failed checks.
+ */
+static int view_compare(snap *s) {
+	ref_cursor c = { s->ref, s->n, 0, 0 };
+	ref_entry e, *hit;
+	unsigned long i;
+
+	art_view_iter(s->v, ref_iter_cb, &c);
+	if (!c.fails && c.pos != s->n) {
+		fprintf(stderr, "%s: the scan has %lu keys, expected %lu\n", s->when, c.pos, s->n);
+		c.fails++;
+	}
+	for (i = 0; i < s->n; i++) {
+		e.key = s->ref[i].key + 1;
+		hit = bsearch(&e, s->ref, s->n, sizeof(ref_entry), ref_key_cmp);
+		if (art_view_search(s->v, s->ref[i].key, sizeof(art_key)) != s->ref[i].value ||
+				art_view_search(s->v, e.key, sizeof(art_key)) != (hit ? hit->value : NULL)) {
+			fprintf(stderr, "%s: lookup of %#lx is wrong\n", s->when, (unsigned long)s->ref[i].key);
+			c.fails++;
+			break;
+		}
+	}
+	return c.fails;
+}
+
+static void* reader(void *arg) {
+	snap *s = arg;
+	s->fails += view_compare(s);
+	return NULL;
+}
+
+/**
+ * Inserts ins[from] up to ins[to], adding new keys and replacing
+ * old ones
+ */
+static void insert_range(art_tree *t, ref_entry *ins, unsigned long from, unsigned long to) {
+	unsigned long i;
+
+	for (i = from; i < to; i++) {
+		ins[i].key = i % 3 == 2 ? ins[rnd() % i].key : i % 2 ? (art_key)rnd() : (art_key)i;
+		ins[i].value = (void *)(uintptr_t)(i << 1 | 1);
+		ins[i].seq = i;
+		art_insert(t, ins[i].key, sizeof(art_key), ins[i].value);
+	}
+}
+
+/**
+ * Sorts the first n inserts into a fresh reference
+ */
+static ref_entry* ref_take(const ref_entry *ins, unsigned long n, unsigned long *m) {
+	ref_entry *ref = malloc((n ? n : 1) * sizeof(ref_entry));
+
+	if (!ref) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memcpy(ref, ins, n * sizeof(ref_entry));
+	*m = ref_build(ref, n);
+	return ref;
+}
+
+int main(int argc, char **argv) {
+	static const int close_order[VIEWS] = { 1, 3, 0, 2 };
+	unsigned long n = 40000, step, done, m, i;
+	snap views[VIEWS];
+	ref_entry *ins, *ref;
+	pthread_t tid;
+	art_tree *t;
+	void *ret;
+	int opt, fails = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				n = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-n keys]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 16) {
+		fprintf(stderr, "need at least 16 keys\n");
+		return 2;
+	}
+
+	ins = malloc(n * sizeof(ref_entry));
+	if (!ins || posix_memalign(&ret, 64, sizeof(art_tree))) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	t = ret;
+	art_tree_init(t);
+	// Opening takes 2 * VIEWS - 1 steps and a key, the reader one
+	// step and each close half a step
+	step = n / (2 * VIEWS + 3);
+
+	// An empty view, then views of growing trees
+	done = 0;
+	for (i = 0; i < VIEWS; i++) {
+		views[i].v = art_view_open(t);
+		views[i].ref = ref_take(ins, done, &views[i].n);
+		views[i].when = names[i];
+		views[i].fails = 0;
+		if (!views[i].v) {
+			fprintf(stderr, "cannot open %s\n", names[i]);
+			return 1;
+		}
+		insert_range(t, ins, done, done + step + (i ? step : 1));
+		done += step + (i ? step : 1);
+	}
+	ref = ref_take(ins, done, &m);
+	fails += ref_compare(t, ref, m, "tree");
+	free(ref);
+
+	if (!art_compact(t, 0) || !art_drop_prefix(t, 0, 8)) {
+		fprintf(stderr, "the tree was restructured under a view\n");
+		fails++;
+	}
+
+	// Scan a view from another thread while writing on
+	if (pthread_create(&tid, NULL, reader, &views[1])) {
+		fprintf(stderr, "cannot start the reader\n");
+		return 1;
+	}
+	insert_range(t, ins, done, done + step);
+	done += step;
+	pthread_join(tid, NULL);
+	fails += views[1].fails;
+
+	for (i = 0; i < VIEWS; i++)
+		fails += view_compare(&views[i]);
+
+	// Close out of order, writing between the closes
+	for (i = 0; i < VIEWS; i++) {
+		snap *s = &views[close_order[i]];
+		art_view_close(s->v);
+		free(s->ref);
+		s->v = NULL;
+		insert_range(t, ins, done, done + step / 2);
+		done += step / 2;
+		for (m = i + 1; m < VIEWS; m++)
+			fails += view_compare(&views[close_order[m]]);
+	}
+
+	ref = ref_take(ins, done, &m);
+	fails += ref_compare(t, ref, m, "closed");
+	if (art_compact(t, 0)) {
+		fprintf(stderr, "cannot compact after the views closed\n");
+		fails++;
+	}
+	fails += ref_compare(t, ref, m, "compacted");
+
+	free(ref);
+	free(ins);
+	free(t);
+	printf("%s\n", fails ? "FAILED" : "ok");
+	return fails != 0;
+}
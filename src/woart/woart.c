@@ -5,17 +5,81 @@
 #include <emmintrin.h>
 #include <assert.h>
 #include <x86intrin.h>
+#include <pthread.h>
+#include <sched.h>
 #include "woart.h"
+#ifdef ART_CRASH_TEST
+#include "../crash/art_crash.h"
+#endif
+#ifdef ART_PERF
+#include "../perf/art_perf.h"
+#else
+#define art_perf_begin()
+#define art_perf_end(op)
+#endif
+#ifdef ART_TRACE
+#include "../perf/art_trace.h"
+#define TRACE_ENTER(p, phase)	int p = art_trace_enter(phase)
+#define TRACE_LEAVE(p)			art_trace_enter(p)
+#else
+#define art_trace_begin()
+#define art_trace_end(op)
+#define TRACE_ENTER(p, phase)
+#define TRACE_LEAVE(p)
+#endif
 
+#ifdef ART_CRASH_TEST
+#define mfence() do { asm volatile("mfence":::"memory"); art_crash_fence(); } while (0)
+#else
 #define mfence() asm volatile("mfence":::"memory")
+#endif
+#define barrier() asm volatile("":::"memory")
 #define BITOP_WORD(nr)	((nr) / BITS_PER_LONG)
 
 /**
- * Macros to manipulate pointer tags
+ * Macros to manipulate pointer tags. A leaf pointer also carries
+ * a fingerprint of the key in the 16 bits above the address, so
+ * leaves must lie below 2^48; make_leaf() rejects any that do not.
  */
+#define LEAF_PTR_MASK	((1UL << 48) - 1)
 #define IS_LEAF(x) (((uintptr_t)x & 1))
-#define SET_LEAF(x) ((void*)((uintptr_t)x | 1))
-#define LEAF_RAW(x) ((art_leaf*)((void*)((uintptr_t)x & ~1)))
+#define SET_LEAF(x) leaf_tag(x)
+#define LEAF_RAW(x) ((art_leaf*)((void*)((uintptr_t)x & LEAF_PTR_MASK & ~1UL)))
+#define LEAF_FP(x) ((uintptr_t)(x) & ~LEAF_PTR_MASK)
+
+/**
+ * Node headers. A header is fresh when it was written for the depth
+ * the node is reached at, otherwise it was left stale by a crash.
+ * The wide header also carries the depth in its last byte, so a
+ * crash that persisted only one half of it is caught the same way.
+ */
+#ifdef ART_WIDE_HEADER
+#define HEADER_FRESH(h, d)	((h)->depth == (d) && (h)->check == (d))
+#define SET_DEPTH(h, d)		((h)->depth = (h)->check = (d))
+#else
+#define HEADER_FRESH(h, d)	((h)->depth == (d))
+#define SET_DEPTH(h, d)		((h)->depth = (d))
+#endif
+
+/**
+ * Replaces a node header with one atomic store
+ */
+static inline void header_store(void *dst, const void *src) {
+#ifdef ART_WIDE_HEADER
+	const uint64_t *s = src;
+	uint64_t lo = ((uint64_t *)dst)[0], hi = ((uint64_t *)dst)[1];
+	unsigned char ok;
+
+	do {
+		asm volatile("lock cmpxchg16b %1; setz %0"
+				: "=q" (ok), "+m" (*(volatile unsigned __int128 *)dst), "+a" (lo), "+d" (hi)
+				: "b" (s[0]), "c" (s[1])
+				: "memory", "cc");
+	} while (!ok);
+#else
+	*((uint64_t *)dst) = *((const uint64_t *)src);
+#endif
+}
 
 #define LATENCY			0
 #define CPU_FREQ_MHZ	2100
@@ -36,15 +100,19 @@ static inline unsigned long read_tsc(void)
 	return var;
 }
 
-void flush_buffer(void *buf, unsigned long len, bool fence)
+static void flush_buffer(void *buf, unsigned long len, bool fence)
 {
 	unsigned long i, etsc;
+	TRACE_ENTER(phase, ART_PHASE_FLUSH);
 	len = len + ((unsigned long)(buf) & (CACHE_LINE_SIZE - 1));
 	if (fence) {
 		mfence();
 		for (i = 0; i < len; i += CACHE_LINE_SIZE) {
 			etsc = read_tsc() + (unsigned long)(LATENCY * CPU_FREQ_MHZ / 1000);
 			asm volatile ("clflush %0\n" : "+m" (*(char *)(buf+i)));
+#ifdef ART_CRASH_TEST
+			art_crash_flush(buf + i);
+#endif
 			while (read_tsc() < etsc)
 				cpu_pause();
 		}
@@ -53,13 +121,17 @@ void flush_buffer(void *buf, unsigned long len, bool fence)
 		for (i = 0; i < len; i += CACHE_LINE_SIZE) {
 			etsc = read_tsc() + (unsigned long)(LATENCY * CPU_FREQ_MHZ / 1000);
 			asm volatile ("clflush %0\n" : "+m" (*(char *)(buf+i)));
+#ifdef ART_CRASH_TEST
+			art_crash_flush(buf + i);
+#endif
 			while (read_tsc() < etsc)
 				cpu_pause();
 		}
 	}
+	TRACE_LEAVE(phase);
 }
 
-static int get_index(unsigned long key, int depth)
+static int get_index(art_key key, int depth)
 {
 	int index;
 
@@ -70,7 +142,7 @@ static int get_index(unsigned long key, int depth)
 /*
  * Find the next set bit in a memory region.
  */
-unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
+static unsigned long find_next_bit(const unsigned long *addr, unsigned long size,
 			    unsigned long offset)
 {
 	const unsigned long *p = addr + BITOP_WORD(offset);
@@ -112,7 +184,7 @@ found_middle:
 /*
  * Find the next zero bit in a memory region
  */
-unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size,
+static unsigned long find_next_zero_bit(const unsigned long *addr, unsigned long size,
 		unsigned long offset)
 {
 	const unsigned long *p = addr + BITOP_WORD(offset);
@@ -151,34 +223,78 @@ found_middle:
 	return result + ffz(tmp);
 }
 
+static void* (*pm_alloc_fn)(unsigned long size);
+static void (*pm_free_fn)(void *ptr);
+
+/**
+ * Replaces the allocator of nodes and leaves, e.g. to place them
+ * in a persistent memory pool. The default is posix_memalign()
+ * with 64-byte alignment and free().
+ * @arg alloc Returns 64-byte aligned memory of the given size, or
+ * NULL. Leaves placed at or above 2^48 fail the insert.
+ * @arg release Frees memory returned by alloc
+ */
+void art_set_allocator(void* (*alloc)(unsigned long size), void (*release)(void *ptr)) {
+	pm_alloc_fn = alloc;
+	pm_free_fn = release;
+}
+
+/**
+ * Tells hook of every change to the tree before it is made
+ * @arg t The tree
+ * @arg hook The hook, NULL to remove it
+ * @arg data Opaque handle passed to the hook
+ */
+void art_set_op_hook(art_tree *t, art_op_hook hook, void *data) {
+	t->op_hook = hook;
+	t->op_data = data;
+}
+
+static void* pm_alloc(unsigned long size) {
+	void *ret;
+	TRACE_ENTER(phase, ART_PHASE_ALLOC);
+	if (pm_alloc_fn)
+		ret = pm_alloc_fn(size);
+	else if (posix_memalign(&ret, 64, size))
+		ret = NULL;
+	TRACE_LEAVE(phase);
+	return ret;
+}
+
+static void pm_free(void *ptr) {
+	if (pm_free_fn)
+		pm_free_fn(ptr);
+	else
+		free(ptr);
+}
+
 /**
  * Allocates a node of the given type,
  * initializes to zero and sets the type.
  */
 static art_node* alloc_node(uint8_t type) {
 	art_node* n;
-    void *ret;
 	int i;
 	switch (type) {
 		case NODE4:
-			posix_memalign(&ret, 64, sizeof(art_node4));
-            n = ret;
+			if (!(n = pm_alloc(sizeof(art_node4))))
+				return NULL;
 			for (i = 0; i < 4; i++)
 				((art_node4 *)n)->slot[i].i_ptr = -1;
 			break;
 		case NODE16:
-			posix_memalign(&ret, 64, sizeof(art_node16));
-            n = ret;
+			if (!(n = pm_alloc(sizeof(art_node16))))
+				return NULL;
 			((art_node16 *)n)->bitmap = 0;
 			break;
 		case NODE48:
-			posix_memalign(&ret, 64, sizeof(art_node48));
-            n = ret;
+			if (!(n = pm_alloc(sizeof(art_node48))))
+				return NULL;
 			memset(n, 0, sizeof(art_node48));
 			break;
 		case NODE256:
-			posix_memalign(&ret, 64, sizeof(art_node256));
-            n = ret;
+			if (!(n = pm_alloc(sizeof(art_node256))))
+				return NULL;
 			memset(n, 0, sizeof(art_node256));
 			break;
 		default:
@@ -195,9 +311,628 @@ static art_node* alloc_node(uint8_t type) {
 int art_tree_init(art_tree *t) {
 	t->root = NULL;
 	t->size = 0;
+	memset(&t->meta, 0, sizeof(art_meta));
+	t->meta.magic = ART_MAGIC;
+	t->meta.version = ART_FORMAT_VERSION;
+	t->meta.node_bits = NODE_BITS;
+	t->meta.max_depth = MAX_DEPTH;
+	t->meta.max_prefix_len = MAX_PREFIX_LEN;
+	memset(t->stripes, 0, sizeof(t->stripes));
+	memset(t->txn_logs, 0, sizeof(t->txn_logs));
+	t->size_adjust = 0;
+	memset(&t->prefix_log, 0, sizeof(art_prefix_log));
+	memset(t->reclaim, 0, sizeof(t->reclaim));
+	t->reclaimed = 0;
+	memset(t->reclaim_post, 0, sizeof(t->reclaim_post));
+	t->async = 0;
+	t->npending = 0;
+	t->nadded = 0;
+	t->nretired = 0;
+	t->issued = 0;
+	t->durable = 0;
+	t->dram = NULL;
+	t->hot = NULL;
+	t->counts = NULL;
+	t->arenas = NULL;
+	t->arena_map = NULL;
+	t->compact_next = 0;
+	t->reclaimer = NULL;
+	t->cow = NULL;
+	t->op_hook = NULL;
+	t->op_data = NULL;
+	flush_buffer(t, sizeof(art_tree), true);
+	return 0;
+}
+
+static __thread int stripe_id = -1;
+static int stripe_next;
+
+static art_size_stripe* size_stripe(art_tree *t) {
+	if (stripe_id < 0)
+		stripe_id = __sync_fetch_and_add(&stripe_next, 1) % ART_SIZE_STRIPES;
+	return &t->stripes[stripe_id];
+}
+
+/**
+ * Marks the key as being newly inserted. Flushed without a fence,
+ * every new-key path fences before its commit store anyway.
+ * Asynchronous inserts share one intent per group instead, with a
+ * zero key length; their commit stores are plain stores until
+ * art_sync(), so that intent is fenced right away.
+ */
+static void size_intent(art_tree *t, const art_key key, int key_len) {
+	art_size_stripe *s = size_stripe(t);
+	if (t->async) {
+		if (s->count & 1)
+			return;
+		s->key_len = 0;
+		barrier();
+		s->count |= 1;
+		flush_buffer(s, sizeof(art_size_stripe), true);
+		return;
+	}
+	s->key = key;
+	s->key_len = key_len;
+	barrier();
+	s->count |= 1;
+	flush_buffer(s, sizeof(art_size_stripe), false);
+}
+
+/**
+ * Counts the committed insert and clears the intent. This may be
+ * lost in a crash; recovery then finds the key and counts it.
+ * Asynchronous inserts are counted by art_sync().
+ */
+static void size_commit(art_tree *t) {
+	art_size_stripe *s = size_stripe(t);
+	t->size++;
+	if (t->async) {
+		t->nadded++;
+		return;
+	}
+	s->count = (s->count & ~1UL) + 2;
+	flush_buffer(&s->count, sizeof(uint64_t), false);
+}
+
+static inline unsigned long counts_home(const art_counts *c, const void *node) {
+	return (((uintptr_t)node >> 6) * 0x9e3779b97f4a7c15UL >> 20) & c->mask;
+}
+
+/**
+ * Finds the slot of an inner node in the subtree counts,
+ * or the empty slot where it belongs.
+ */
+static art_count_slot* counts_slot(art_counts *c, const void *node) {
+	unsigned long i = counts_home(c, node);
+	while (c->slots[i].node && c->slots[i].node != node)
+		i = (i + 1) & c->mask;
+	return &c->slots[i];
+}
+
+static art_counts* counts_alloc(unsigned long nslots) {
+	art_counts *c = calloc(1, sizeof(art_counts) + nslots * sizeof(art_count_slot));
+	if (c)
+		c->mask = nslots - 1;
+	return c;
+}
+
+/**
+ * Sets the count of a node, doubling the table once it is half
+ * full. If that fails the counts are dropped altogether and the
+ * queries fall back to walking subtrees.
+ */
+static void counts_put(art_tree *t, const void *node, uint64_t count) {
+	art_counts *c = t->counts, *g;
+	art_count_slot *s;
+	unsigned long i;
+
+	if (!c)
+		return;
+	s = counts_slot(c, node);
+	if (!s->node) {
+		if ((c->used + 1) * 2 > c->mask + 1) {
+			g = counts_alloc((c->mask + 1) * 2);
+			if (g) {
+				for (i = 0; i <= c->mask; i++)
+					if (c->slots[i].node)
+						*counts_slot(g, c->slots[i].node) = c->slots[i];
+				g->used = c->used;
+			}
+			free(c);
+			t->counts = c = g;
+			if (!c)
+				return;
+			s = counts_slot(c, node);
+		}
+		s->node = node;
+		c->used++;
+	}
+	s->count = count;
+}
+
+/**
+ * Forgets a node that is about to be freed, so that its address
+ * cannot inherit the count. Later entries of the probe run are
+ * shifted back into the hole.
+ */
+static void counts_drop(art_tree *t, const void *node) {
+	art_counts *c = t->counts;
+	art_count_slot *s;
+	unsigned long i, j, k;
+
+	if (!c || !(s = counts_slot(c, node))->node)
+		return;
+	i = j = s - c->slots;
+	for (;;) {
+		j = (j + 1) & c->mask;
+		if (!c->slots[j].node)
+			break;
+		k = counts_home(c, c->slots[j].node);
+		if (i <= j ? (k <= i || k > j) : (k <= i && k > j)) {
+			c->slots[i] = c->slots[j];
+			i = j;
+		}
+	}
+	c->slots[i].node = NULL;
+	c->used--;
+}
+
+static void persist_commit(art_tree *t, void *addr, unsigned long len) {
+	TRACE_ENTER(phase, ART_PHASE_PUBLISH);
+	if (!t->async) {
+		flush_buffer(addr, len, true);
+	} else {
+		if (t->npending == ART_GROUP_COMMIT)
+			art_sync(t);
+		t->pending[t->npending++] = addr;
+	}
+	TRACE_LEAVE(phase);
+}
+
+#define NODE_ALIGN(off)		(((off) + 63) & ~63UL)
+#define LEAF_ALIGN(off)		(((off) + __alignof__(art_leaf) - 1) & ~(__alignof__(art_leaf) - 1))
+
+static const unsigned long node_sizes[4] = {
+	sizeof(art_node4), sizeof(art_node16), sizeof(art_node48), sizeof(art_node256)
+};
+
+/**
+ * Collects the addresses of the used child pointers of a node
+ * @return the number of children.
+ */
+static int child_refs(art_node *n, art_node ***refs) {
+	unsigned long i;
+	int cnt = 0;
+
+	switch (n->type) {
+		case NODE4:
+			for (i = 0; i < 4 && ((art_node4 *)n)->slot[i].i_ptr != -1; i++)
+				refs[cnt++] = &((art_node4 *)n)->children[(unsigned char)((art_node4 *)n)->slot[i].i_ptr];
+			break;
+		case NODE16:
+			for (i = 0; i < 16; i++) {
+				i = find_next_bit(&((art_node16 *)n)->bitmap, 16, i);
+				if (i < 16)
+					refs[cnt++] = &((art_node16 *)n)->children[i];
+			}
+			break;
+		case NODE48:
+			for (i = 0; i < 256; i++)
+				if (((art_node48 *)n)->keys[i])
+					refs[cnt++] = &((art_node48 *)n)->children[((art_node48 *)n)->keys[i] - 1];
+			break;
+		case NODE256:
+			for (i = 0; i < 256; i++)
+				if (((art_node256 *)n)->children[i])
+					refs[cnt++] = &((art_node256 *)n)->children[i];
+			break;
+		default:
+			abort();
+	}
+	return cnt;
+}
+
+/**
+ * Finds the arena holding p
+ * @return NULL if p was allocated on its own.
+ */
+static art_arena_slot* arena_find(const art_tree *t, const void *p) {
+	art_arena_map *m = t->arena_map;
+	unsigned long lo = 0, hi, mid;
+
+	if (!m)
+		return NULL;
+	hi = m->n;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if ((uintptr_t)m->slots[mid].arena <= (uintptr_t)p)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (!lo || (uintptr_t)p >= m->slots[lo - 1].end)
+		return NULL;
+	return &m->slots[lo - 1];
+}
+
+/**
+ * Makes room for one more arena in the index
+ */
+static int arena_reserve(art_tree *t) {
+	art_arena_map *m = t->arena_map;
+	unsigned long max = m ? m->max * 2 : 16;
+
+	if (m && m->n < m->max)
+		return 0;
+	m = realloc(m, sizeof(art_arena_map) + max * sizeof(art_arena_slot));
+	if (!m)
+		return -1;
+	if (!t->arena_map)
+		m->n = 0;
+	m->max = max;
+	t->arena_map = m;
+	return 0;
+}
+
+static void arena_insert(art_tree *t, art_arena *a, uint64_t live) {
+	art_arena_map *m = t->arena_map;
+	unsigned long i = m->n;
+
+	while (i && (uintptr_t)m->slots[i - 1].arena > (uintptr_t)a) {
+		m->slots[i] = m->slots[i - 1];
+		i--;
+	}
+	m->slots[i].arena = a;
+	m->slots[i].end = (uintptr_t)a + a->size;
+	m->slots[i].live = live;
+	m->n++;
+}
+
+/**
+ * Unlinks an arena that holds nothing of the tree anymore and
+ * returns it to the allocator
+ */
+static void arena_release(art_tree *t, art_arena_slot *s) {
+	art_arena_map *m = t->arena_map;
+	art_arena **ref = &t->arenas;
+	art_arena *a = s->arena;
+
+	while (*ref != a)
+		ref = &(*ref)->next;
+	*ref = a->next;
+	flush_buffer(ref, sizeof(art_arena *), true);
+	pm_free(a);
+
+	memmove(s, s + 1, (m->slots + m->n - (s + 1)) * sizeof(art_arena_slot));
+	m->n--;
+}
+
+/**
+ * Frees a node or leaf that left the tree. Inside an arena it
+ * only drops the count of live contents.
+ */
+static void node_free(art_tree *t, void *p) {
+	art_arena_slot *s = arena_find(t, p);
+
+	if (!s)
+		pm_free(p);
+	else if (!--s->live)
+		arena_release(t, s);
+}
+
+static void arena_count(art_tree *t, art_node *n) {
+	art_node **refs[256];
+	art_arena_slot *s;
+	int i, cnt;
+
+	if ((s = arena_find(t, IS_LEAF(n) ? (void *)LEAF_RAW(n) : (void *)n)))
+		s->live++;
+	if (IS_LEAF(n))
+		return;
+	cnt = child_refs(n, refs);
+	for (i = 0; i < cnt; i++)
+		arena_count(t, *refs[i]);
+}
+
+/**
+ * Rebuilds the index of the arenas and frees the ones whose
+ * subtree was never published or was wholly replaced before a
+ * crash
+ */
+static int arena_open(art_tree *t) {
+	art_arena *a;
+	unsigned long i;
+
+	for (a = t->arenas; a; a = a->next) {
+		if (arena_reserve(t))
+			return -1;
+		arena_insert(t, a, 0);
+	}
+	if (t->root)
+		arena_count(t, t->root);
+	for (i = 0; i < ART_RECLAIM_SLOTS; i++)
+		if (t->reclaim[i])
+			arena_count(t, t->reclaim[i]);
+	for (i = t->arena_map->n; i > 0; i--)
+		if (!t->arena_map->slots[i - 1].live)
+			arena_release(t, &t->arena_map->slots[i - 1]);
+	return 0;
+}
+
+/**
+ * Frees a node replaced by a commit store. An asynchronous commit
+ * is not durable yet and PM may still point to the old node, so
+ * it is freed by art_sync(). Every retired node has its commit in
+ * the pending set, which bounds the retired set as well.
+ */
+static void retire_node(art_tree *t, void *n) {
+	counts_drop(t, n);
+	if (!t->async) {
+		node_free(t, n);
+		return;
+	}
+	t->retired[t->nretired++] = n;
+}
+
+/**
+ * Queues a node, a leaf or a posting chunk detached from a dropped
+ * subtree, to be freed by the writer. Called with the lock held.
+ * If the queue cannot grow the object is leaked.
+ */
+static void reclaim_push(art_reclaimer *r, void *p) {
+	void **freed;
+
+	if (r->nfree == r->max) {
+		freed = realloc(r->freed, (r->max ? r->max * 2 : 256) * sizeof(void *));
+		if (!freed)
+			return;
+		r->freed = freed;
+		r->max = r->max ? r->max * 2 : 256;
+	}
+	r->freed[r->nfree] = p;
+	__atomic_store_n(&r->nfree, r->nfree + 1, __ATOMIC_RELEASE);
+}
+
+static void reclaim_leaf(const art_tree *t, art_reclaimer *r, art_leaf *l) {
+	art_posting *p;
+
+	if (t->meta.flags & ART_FLAG_MULTI)
+		for (p = l->value; p; p = p->next)
+			reclaim_push(r, p);
+	reclaim_push(r, l);
+}
+
+/**
+ * Empties a node with one store per node type, like the commit
+ * of a new child
+ */
+static void node_clear(art_node *n) {
+	int i;
+
+	switch (n->type) {
+		case NODE4: {
+			slot_array temp_slot[4];
+			for (i = 0; i < 4; i++) {
+				temp_slot[i].key = 0;
+				temp_slot[i].i_ptr = -1;
+			}
+			*((uint64_t *)((art_node4 *)n)->slot) = *((uint64_t *)temp_slot);
+			break;
+		}
+		case NODE16:
+			((art_node16 *)n)->bitmap = 0;
+			break;
+		case NODE48:
+			memset(((art_node48 *)n)->keys, 0, sizeof(((art_node48 *)n)->keys));
+			break;
+		case NODE256:
+			memset(((art_node256 *)n)->children, 0, sizeof(((art_node256 *)n)->children));
+			break;
+		default:
+			abort();
+	}
+	flush_buffer(n, node_sizes[n->type - 1], true);
+}
+
+/**
+ * Counts the leaves of a dropped subtree, before any is detached
+ */
+static uint64_t reclaim_count(art_node *n) {
+	art_node **refs[256];
+	uint64_t sum = 0;
+	int i, cnt;
+
+	if (IS_LEAF(n))
+		return 1;
+	cnt = child_refs(n, refs);
+	for (i = 0; i < cnt; i++)
+		sum += reclaim_count(*refs[i]);
+	return sum;
+}
+
+/**
+ * Counts the keys of dropped subtrees that the reclaim thread has
+ * not counted yet
+ */
+static uint64_t reclaim_pending(const art_tree *t) {
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < ART_RECLAIM_SLOTS; i++)
+		if (t->reclaim[i] && !t->reclaim_post[i])
+			sum += reclaim_count(t->reclaim[i]);
+	return sum;
+}
+
+/**
+ * Detaches everything below n, deepest first. The children of a
+ * node are cleared and the clear is durable before they are
+ * queued, so a walk of the subtree after a crash never reaches a
+ * freed object; a crash in between leaks them at worst.
+ */
+static void reclaim_clear(const art_tree *t, art_reclaimer *r, art_node *n) {
+	art_node **refs[256], *child[256];
+	int i, cnt;
+
+	cnt = child_refs(n, refs);
+	for (i = 0; i < cnt; i++) {
+		child[i] = *refs[i];
+		if (!IS_LEAF(child[i]))
+			reclaim_clear(t, r, child[i]);
+	}
+	node_clear(n);
+
+	pthread_mutex_lock(&r->lock);
+	for (i = 0; i < cnt; i++) {
+		if (IS_LEAF(child[i]))
+			reclaim_leaf(t, r, LEAF_RAW(child[i]));
+		else
+			reclaim_push(r, child[i]);
+	}
+	pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Takes apart the subtree of a reclaim slot. Its keys are counted
+ * into reclaimed first, through reclaim_post so that recovery
+ * redoes a torn count and never counts twice. The slot is emptied
+ * only once the whole subtree is detached, so that art_tree_open()
+ * resumes an interrupted one. Called with the lock held.
+ */
+static void reclaim_one(art_tree *t, art_reclaimer *r, int i) {
+	art_node *n = t->reclaim[i];
+
+	pthread_mutex_unlock(&r->lock);
+	if (!t->reclaim_post[i]) {
+		t->reclaim_post[i] = t->reclaimed + reclaim_count(n);
+		flush_buffer(&t->reclaim_post[i], sizeof(uint64_t), true);
+		__atomic_store_n(&t->reclaimed, t->reclaim_post[i], __ATOMIC_RELEASE);
+		flush_buffer(&t->reclaimed, sizeof(uint64_t), true);
+	}
+	if (!IS_LEAF(n))
+		reclaim_clear(t, r, n);
+	pthread_mutex_lock(&r->lock);
+
+	// A writer takes the slot once it is empty, with a clear post
+	t->reclaim[i] = NULL;
+	flush_buffer(&t->reclaim[i], sizeof(art_node *), true);
+	t->reclaim_post[i] = 0;
+	flush_buffer(&t->reclaim_post[i], sizeof(uint64_t), true);
+
+	if (IS_LEAF(n))
+		reclaim_leaf(t, r, LEAF_RAW(n));
+	else
+		reclaim_push(r, n);
+	pthread_cond_broadcast(&r->idle);
+}
+
+#ifndef ART_CRASH_TEST
+static void* reclaim_thread(void *arg) {
+	art_tree *t = arg;
+	art_reclaimer *r = t->reclaimer;
+	int i;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		for (i = 0; i < ART_RECLAIM_SLOTS && !t->reclaim[i]; i++)
+			;
+		if (i < ART_RECLAIM_SLOTS) {
+			reclaim_one(t, r, i);
+			continue;
+		}
+		if (r->stop)
+			break;
+		pthread_cond_wait(&r->wake, &r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
+#endif
+
+static int reclaim_start(art_tree *t) {
+	art_reclaimer *r;
+
+	if (t->reclaimer)
+		return 0;
+	r = calloc(1, sizeof(art_reclaimer));
+	if (!r)
+		return -1;
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->wake, NULL);
+	pthread_cond_init(&r->idle, NULL);
+	t->reclaimer = r;
+#ifndef ART_CRASH_TEST
+	if (pthread_create(&r->thread, NULL, reclaim_thread, t)) {
+		t->reclaimer = NULL;
+		free(r);
+		return -1;
+	}
+#endif
 	return 0;
 }
 
+/**
+ * Hands the filled reclaim slots to the thread. The crash harness
+ * emulates PM for the calling thread only, so there they are
+ * taken apart right away.
+ */
+static void reclaim_wake(art_tree *t) {
+	art_reclaimer *r = t->reclaimer;
+
+	pthread_mutex_lock(&r->lock);
+#ifdef ART_CRASH_TEST
+	int i;
+	for (i = 0; i < ART_RECLAIM_SLOTS; i++)
+		if (t->reclaim[i])
+			reclaim_one(t, r, i);
+#endif
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/**
+ * Waits for a free reclaim slot
+ */
+static int reclaim_slot(art_tree *t) {
+	art_reclaimer *r = t->reclaimer;
+	int i;
+
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		for (i = 0; i < ART_RECLAIM_SLOTS && t->reclaim[i]; i++)
+			;
+		if (i < ART_RECLAIM_SLOTS)
+			break;
+		pthread_cond_wait(&r->idle, &r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return i;
+}
+
+/**
+ * Frees what the reclaim thread detached so far. Only the writer
+ * frees, so the allocator, the arenas and the subtree counts are
+ * never touched by two threads.
+ */
+static void reclaim_drain(art_tree *t) {
+	art_reclaimer *r = t->reclaimer;
+	unsigned long i, n;
+	void **freed;
+
+	pthread_mutex_lock(&r->lock);
+	freed = r->freed;
+	n = r->nfree;
+	r->freed = NULL;
+	r->nfree = r->max = 0;
+	pthread_mutex_unlock(&r->lock);
+
+	for (i = 0; i < n; i++) {
+		counts_drop(t, freed[i]);
+		node_free(t, freed[i]);
+	}
+	free(freed);
+}
+
 static art_node** find_child(art_node *n, unsigned char c) {
 	int i;
 	union {
@@ -248,7 +983,7 @@ static inline int min(int a, int b) {
  * Returns the number of prefix characters shared between
  * the key and node.
  */
-static int check_prefix(const art_node *n, const unsigned long key, int key_len, int depth) {
+static int check_prefix(const art_node *n, const art_key key, int key_len, int depth) {
 //	int max_cmp = min(min(n->partial_len, MAX_PREFIX_LEN), (key_len * INDEX_BITS) - depth);
 	int max_cmp = min(min(n->path.partial_len, MAX_PREFIX_LEN), MAX_HEIGHT - depth);
 	int idx;
@@ -263,51 +998,260 @@ static int check_prefix(const art_node *n, const unsigned long key, int key_len,
  * Checks if a leaf matches
  * @return 0 on success.
  */
-static int leaf_matches(const art_leaf *n, unsigned long key, int key_len, int depth) {
+static int leaf_matches(const art_leaf *n, art_key key, int key_len, int depth) {
+	int ret;
 	(void)depth;
-	// Fail if the key lengths are different
-	if (n->key_len != (uint32_t)key_len) return 1;
-
-	// Compare the keys starting at the depth
+	TRACE_ENTER(phase, ART_PHASE_LEAF);
+	// Fail if the key lengths are different, else compare the keys
 //	return memcmp(n->key, key, key_len);
-	return !(n->key == key);
+	ret = n->key_len != (uint32_t)key_len || !(n->key == key);
+	TRACE_LEAVE(phase);
+	return ret;
+}
+
+#define HOT_PTR_MASK	((1UL << 48) - 1)
+
+static inline unsigned long hot_hash(const art_key key) {
+#if ART_KEY_BITS > 64
+	return ((unsigned long)key ^ (unsigned long)(key >> 64)) * 0x9e3779b97f4a7c15UL;
+#else
+	return key * 0x9e3779b97f4a7c15UL;
+#endif
+}
+
+static inline uintptr_t key_fp(const art_key key) {
+	return hot_hash(key) & ~LEAF_PTR_MASK;
 }
 
 /**
- * Searches for a value in the ART tree
- * @arg t The tree
- * @arg key The key
- * @arg key_len The length of the key
- * @return NULL if the item was not found, otherwise
- * the value pointer is returned.
+ * Tags a leaf pointer. The fingerprint is published by the same
+ * store as the pointer, so it is always that of the leaf.
  */
-void* art_search(const art_tree *t, const unsigned long key, int key_len) {
-	art_node **child;
-	art_node *n = t->root;
-	int prefix_len, depth = 0;
+static inline void* leaf_tag(const art_leaf *l) {
+	return (void *)((uintptr_t)l | 1 | key_fp(l->key));
+}
 
-	while (n) {
-		// Might be a leaf
-		if (IS_LEAF(n)) {
-			n = (art_node*)LEAF_RAW(n);
-			// Check if the expanded path matches
-			if (!leaf_matches((art_leaf*)n, key, key_len, depth)) {
-				return ((art_leaf*)n)->value;
-			}
-			return NULL;
-		}
+/**
+ * Looks the key up in the hot cache. Entries are dropped before
+ * their leaf is freed, by hot_forget() when it is replaced and by
+ * hot_clear() when compaction or a prefix drop frees leaves, so a
+ * tag hit can be dereferenced and checked.
+ * @return NULL on a miss.
+ */
+static art_leaf* hot_lookup(art_hot_cache *c, const art_key key, int key_len) {
+	unsigned long h = hot_hash(key);
+	uint64_t *set = c->ways[(h >> 16) & c->mask];
+	uint64_t e;
+	art_leaf *l;
+	int i;
 
-		if (n->path.depth == depth) {
-			// Bail if the prefix does not match
-			if (n->path.partial_len) {
-				prefix_len = check_prefix(n, key, key_len, depth);
-				if (prefix_len != min(MAX_PREFIX_LEN, n->path.partial_len))
-					return NULL;
-				depth = depth + n->path.partial_len;
-			}
-		} else {
-			printf("Search: Crash occured\n");
-			exit(0);
+	for (i = 0; i < ART_HOT_WAYS; i++) {
+		e = __atomic_load_n(&set[i], __ATOMIC_RELAXED);
+		if ((e >> 48) != (h >> 48) || !e)
+			continue;
+		l = (art_leaf *)(e & HOT_PTR_MASK);
+		if (!leaf_matches(l, key, key_len, 0))
+			return l;
+	}
+	return NULL;
+}
+
+/**
+ * Caches a leaf found by a full search, taking an empty way
+ * or else one picked from the hash.
+ */
+static void hot_fill(art_hot_cache *c, const art_key key, art_leaf *l) {
+	unsigned long h = hot_hash(key);
+	uint64_t *set = c->ways[(h >> 16) & c->mask];
+	int i, way = (h >> 8) % ART_HOT_WAYS;
+
+	for (i = 0; i < ART_HOT_WAYS; i++) {
+		if (!__atomic_load_n(&set[i], __ATOMIC_RELAXED)) {
+			way = i;
+			break;
+		}
+	}
+	__atomic_store_n(&set[way], (h & ~HOT_PTR_MASK) | (uintptr_t)l, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drops a leaf that is being replaced from the hot cache
+ */
+static void hot_forget(art_hot_cache *c, const art_key key, art_leaf *l) {
+	uint64_t *set = c->ways[(hot_hash(key) >> 16) & c->mask];
+	int i;
+
+	for (i = 0; i < ART_HOT_WAYS; i++)
+		if ((__atomic_load_n(&set[i], __ATOMIC_RELAXED) & HOT_PTR_MASK) == (uintptr_t)l)
+			__atomic_store_n(&set[i], 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drops every entry, after leaves were unlinked and before they
+ * are freed
+ */
+static void hot_clear(art_hot_cache *c) {
+	memset(c->ways, 0, (c->mask + 1) * sizeof(c->ways[0]));
+}
+
+static art_leaf* minimum(const art_node *n);
+static uint64_t subtree_count(const art_tree *t, art_node *n);
+static int longest_common_prefix(art_leaf *l1, art_leaf *l2, int depth);
+static void first_two_leaves(art_node *n, art_leaf **leaf);
+
+/**
+ * Allocates a chunk of a posting list holding one value
+ */
+static art_posting* posting_alloc(void *value, art_posting *next) {
+	art_posting *p = pm_alloc(sizeof(art_posting));
+
+	if (!p)
+		return NULL;
+	p->next = next;
+	p->bitmap = 1;
+	p->values[0] = value;
+	flush_buffer(p, sizeof(art_posting), true);
+	return p;
+}
+
+/**
+ * Adds a value to the posting list of a leaf. Only the first
+ * chunk takes new values; once it is full a new chunk is put in
+ * front of it with the store of the leaf value.
+ * @return 0 on success, -1 if a chunk could not be allocated.
+ */
+static int posting_append(art_leaf *l, void *value) {
+	art_posting *p = l->value, *chunk;
+	int i;
+
+	if (!p || p->bitmap == (1UL << ART_POSTING_SLOTS) - 1) {
+		if (!(chunk = posting_alloc(value, p)))
+			return -1;
+		l->value = chunk;
+		flush_buffer(&l->value, sizeof(uintptr_t), true);
+		return 0;
+	}
+
+	i = __builtin_ctzl(~p->bitmap);
+	p->values[i] = value;
+	flush_buffer(&p->values[i], sizeof(uintptr_t), true);
+	p->bitmap |= 1UL << i;
+	flush_buffer(&p->bitmap, sizeof(uint64_t), true);
+	return 0;
+}
+
+/**
+ * Removes one occurrence of a value with the store of a bitmap.
+ * A chunk left empty is unlinked with the store of the pointer to
+ * it and freed.
+ * @return 0 on success, -1 if the value is not in the list.
+ */
+static int posting_remove(art_tree *t, art_leaf *l, void *value) {
+	art_posting **ref = (art_posting **)&l->value, *p;
+	uint64_t b;
+	int i;
+
+	for (p = *ref; p; ref = &p->next, p = *ref) {
+		for (b = p->bitmap; b; b &= b - 1) {
+			i = __builtin_ctzl(b);
+			if (p->values[i] != value)
+				continue;
+			p->bitmap &= ~(1UL << i);
+			flush_buffer(&p->bitmap, sizeof(uint64_t), true);
+			if (!p->bitmap) {
+				*ref = p->next;
+				flush_buffer(ref, sizeof(uintptr_t), true);
+				node_free(t, p);
+			}
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Calls cb for every value of a leaf, once in single-value mode
+ */
+static int leaf_iter(const art_tree *t, const art_leaf *l, art_callback cb, void *data) {
+	const art_posting *p;
+	uint64_t b;
+	int res;
+
+	if (!(t->meta.flags & ART_FLAG_MULTI))
+		return cb(data, (const unsigned char *)&l->key, l->key_len, l->value);
+	for (p = l->value; p; p = p->next) {
+		for (b = p->bitmap; b; b &= b - 1) {
+			res = cb(data, (const unsigned char *)&l->key, l->key_len,
+					p->values[__builtin_ctzl(b)]);
+			if (res)
+				return res;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Returns the value of a leaf, the first one in multi-value mode
+ */
+static void* leaf_value(const art_tree *t, const art_leaf *l) {
+	const art_posting *p;
+
+	if (!(t->meta.flags & ART_FLAG_MULTI))
+		return l->value;
+	for (p = l->value; p; p = p->next)
+		if (p->bitmap)
+			return p->values[__builtin_ctzl(p->bitmap)];
+	return NULL;
+}
+
+/**
+ * Finds the leaf holding the key below n, reached at depth
+ * @return NULL if the item was not found.
+ */
+static art_leaf* search_from(art_node *n, int depth, const art_key key, int key_len) {
+	art_node **child;
+	int prefix_len;
+
+	while (n) {
+		// Might be a leaf
+		if (IS_LEAF(n)) {
+			// Most misses end on the fingerprint, without reading the leaf
+			if (LEAF_FP(n) != key_fp(key))
+				return NULL;
+			n = (art_node*)LEAF_RAW(n);
+			// Check if the expanded path matches
+			if (!leaf_matches((art_leaf*)n, key, key_len, depth)) {
+				return (art_leaf*)n;
+			}
+			return NULL;
+		}
+
+		if (HEADER_FRESH(&n->path, depth)) {
+			// Bail if the prefix does not match
+			if (n->path.partial_len) {
+				prefix_len = check_prefix(n, key, key_len, depth);
+				if (prefix_len != min(MAX_PREFIX_LEN, n->path.partial_len))
+					return NULL;
+				depth = depth + n->path.partial_len;
+			}
+		} else {
+			// The header is stale after a crash, rebuild the prefix from leaves
+			art_leaf *leaf[2];
+			art_node old_path;
+			int i;
+
+			TRACE_ENTER(phase, ART_PHASE_PREFIX);
+			first_two_leaves(n, leaf);
+			int prefix_diff = longest_common_prefix(leaf[0], leaf[1], depth);
+			TRACE_LEAVE(phase);
+			old_path.path.partial_len = prefix_diff;
+			for (i = 0; i < min(MAX_PREFIX_LEN, prefix_diff); i++)
+				old_path.path.partial[i] = get_index(leaf[1]->key, depth + i);
+
+			prefix_len = check_prefix(&old_path, key, key_len, depth);
+			if (prefix_len != min(MAX_PREFIX_LEN, old_path.path.partial_len))
+				return NULL;
+			depth = depth + old_path.path.partial_len;
 		}
 
 		// Recursively search
@@ -318,6 +1262,258 @@ void* art_search(const art_tree *t, const unsigned long key, int key_len) {
 	return NULL;
 }
 
+/**
+ * Finds the leaf holding the key
+ * @return NULL if the item was not found.
+ */
+static art_leaf* search_leaf(const art_tree *t, const art_key key, int key_len) {
+	if (t->dram) {
+		art_dram_slot *slot = &t->dram->slots[key >> (MAX_HEIGHT - t->dram->levels) * NODE_BITS];
+		return search_from(slot->node, slot->depth, key, key_len);
+	}
+	return search_from(t->root, 0, key, key_len);
+}
+
+/**
+ * Searches for a value in the ART tree
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_search(const art_tree *t, const art_key key, int key_len) {
+	art_leaf *l;
+	void *value;
+
+	art_perf_begin();
+	art_trace_begin();
+	if (!t->hot || !(l = hot_lookup(t->hot, key, key_len))) {
+		l = search_leaf(t, key, key_len);
+		if (l && t->hot)
+			hot_fill(t->hot, key, l);
+	}
+	value = l ? leaf_value(t, l) : NULL;
+	art_trace_end(ART_TRACE_SEARCH);
+	art_perf_end(ART_PERF_SEARCH);
+	return value;
+}
+
+/**
+ * Iterates over the values of a key in multi-value mode, in no
+ * particular order, with the callback of art_iter()
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_values(const art_tree *t, const art_key key, int key_len, art_callback cb, void *data) {
+	art_leaf *l = search_leaf(t, key, key_len);
+	return l ? leaf_iter(t, l, cb, data) : 0;
+}
+
+/**
+ * Counts the values of a key in multi-value mode
+ * @return the number of values, 0 if the key is not found.
+ */
+uint64_t art_value_count(const art_tree *t, const art_key key, int key_len) {
+	art_leaf *l = search_leaf(t, key, key_len);
+	const art_posting *p;
+	uint64_t count = 0;
+
+	if (!l)
+		return 0;
+	if (!(t->meta.flags & ART_FLAG_MULTI))
+		return 1;
+	for (p = l->value; p; p = p->next)
+		count += __builtin_popcountl(p->bitmap);
+	return count;
+}
+
+/**
+ * Removes one occurrence of a value from a key in multi-value mode.
+ * The key stays in the tree, also without values.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value The value to remove
+ * @return 0 on success, -1 if the key does not hold the value.
+ */
+int art_remove_value(art_tree *t, const art_key key, int key_len, void *value) {
+	art_leaf *l;
+
+	if (!(t->meta.flags & ART_FLAG_MULTI))
+		return -1;
+	if (t->npending)
+		art_sync(t);
+	l = search_leaf(t, key, key_len);
+	if (!l)
+		return -1;
+	if (t->op_hook)
+		t->op_hook(t->op_data, ART_OP_REMOVE, key, key_len, value);
+	return posting_remove(t, l, value);
+}
+
+/**
+ * Applies a committed transaction as one group of asynchronous
+ * inserts and empties its log once they are durable. Replaying
+ * inserts that were applied already only stores the same values.
+ */
+static void txn_apply(art_tree *t, art_txn_log *log) {
+	uint64_t i;
+
+	for (i = 0; i < log->count; i++)
+		art_insert_async(t, log->entries[i].key, log->entries[i].key_len,
+				log->entries[i].value, NULL);
+	art_sync(t);
+	log->count = 0;
+	flush_buffer(&log->count, sizeof(uint64_t), true);
+}
+
+/**
+ * Completes a prefix drop or attach whose pointer store is durable:
+ * hands a dropped subtree to the reclaim thread, which counts its
+ * keys, or accounts for the keys an attach moved and empties its
+ * source, and clears the log. Redone by recovery until the log is
+ * clear.
+ * @return the node collapsed by a drop, to be freed by the caller;
+ * a crash before that leaks it.
+ */
+static art_node* prefix_finish(art_tree *t) {
+	art_prefix_log *log = &t->prefix_log;
+	art_tree *src = log->src;
+
+	if (log->op == ART_PREFIX_DROP) {
+		t->reclaim[log->slot] = log->subtree;
+		flush_buffer(&t->reclaim[log->slot], sizeof(art_node *), true);
+	} else {
+		t->size_adjust = log->adjust + log->count;
+		src->root = NULL;
+		src->size_adjust = 0;
+		src->reclaimed = 0;
+		memset(src->stripes, 0, sizeof(src->stripes));
+		flush_buffer(src, sizeof(art_tree), false);
+		flush_buffer(&t->size_adjust, sizeof(int64_t), true);
+	}
+
+	log->op = 0;
+	flush_buffer(&log->op, sizeof(uint64_t), true);
+	return log->parent;
+}
+
+/**
+ * Opens a tree that was initialized by a previous run,
+ * possibly one that crashed, and recomputes its size.
+ * @return 0 on success, -1 if the tree was built with a
+ * different format version or geometry.
+ */
+int art_tree_open(art_tree *t) {
+	art_size_stripe *group = NULL;
+	art_node *parent = NULL;
+	int i;
+
+	if (t->meta.magic != ART_MAGIC || t->meta.version != ART_FORMAT_VERSION ||
+			t->meta.node_bits != NODE_BITS || t->meta.max_depth != MAX_DEPTH ||
+			t->meta.max_prefix_len != MAX_PREFIX_LEN)
+		return -1;
+
+	t->async = 0;
+	t->npending = 0;
+	t->nadded = 0;
+	t->nretired = 0;
+	t->issued = 0;
+	t->durable = 0;
+	t->dram = NULL;
+	t->hot = NULL;
+	t->counts = NULL;
+	t->arena_map = NULL;
+	t->compact_next = 0;
+	t->reclaimer = NULL;
+	t->cow = NULL;
+	t->op_hook = NULL;
+	t->op_data = NULL;
+
+	if (t->prefix_log.op) {
+		// The store of a drop is durable iff the key is gone, of an attach iff it is there
+		art_prefix_log *log = &t->prefix_log;
+		if (!search_leaf(t, log->key, log->key_len) == (log->op == ART_PREFIX_DROP)) {
+			parent = prefix_finish(t);
+		} else {
+			log->op = 0;
+			flush_buffer(&log->op, sizeof(uint64_t), true);
+		}
+	}
+
+	// A count posted by the reclaim thread, see reclaim_one()
+	for (i = 0; i < ART_RECLAIM_SLOTS; i++) {
+		if (!t->reclaim_post[i])
+			continue;
+		t->reclaimed = t->reclaim_post[i];
+		flush_buffer(&t->reclaimed, sizeof(uint64_t), true);
+		if (!t->reclaim[i]) {
+			t->reclaim_post[i] = 0;
+			flush_buffer(&t->reclaim_post[i], sizeof(uint64_t), true);
+		}
+	}
+
+	t->size = t->size_adjust;
+	for (i = 0; i < ART_SIZE_STRIPES; i++) {
+		art_size_stripe *s = &t->stripes[i];
+		if ((s->count & 1) && !s->key_len) {
+			// An asynchronous group was pending, recounted below
+			group = group ? group : s;
+			continue;
+		}
+		if (s->count & 1) {
+			// The commit of the pending insert is durable iff the key is there
+			if (search_leaf(t, s->key, s->key_len))
+				s->count += 2;
+			s->count &= ~1UL;
+			flush_buffer(&s->count, sizeof(uint64_t), false);
+		}
+		t->size += s->count >> 1;
+	}
+	if (group) {
+		// The size holds the reclaimed keys and those still to be counted
+		uint64_t leaves = subtree_count(t, t->root) + t->reclaimed + reclaim_pending(t);
+		for (i = 0; i < ART_SIZE_STRIPES; i++) {
+			art_size_stripe *s = &t->stripes[i];
+			if ((s->count & 1) && !s->key_len) {
+				s->count = s == group ? (leaves - t->size) << 1 : 0;
+				flush_buffer(&s->count, sizeof(uint64_t), false);
+			}
+		}
+		t->size = leaves;
+	}
+	mfence();
+
+	if (t->arenas && arena_open(t))
+		return -1;
+	// Inside an arena it was not counted, so it is gone already
+	if (parent && !arena_find(t, parent))
+		pm_free(parent);
+	for (i = 0; i < ART_RECLAIM_SLOTS; i++) {
+		if (t->reclaim[i]) {
+			if (reclaim_start(t))
+				return -1;
+			reclaim_wake(t);
+			break;
+		}
+	}
+	if ((t->meta.flags & ART_FLAG_COUNTS) && art_set_counts(t, true))
+		return -1;
+	if (t->meta.dram_levels && art_set_dram_levels(t, t->meta.dram_levels))
+		return -1;
+
+	// Transactions committed to their log but not wholly applied
+	for (i = 0; i < ART_SIZE_STRIPES; i++)
+		if (t->txn_logs[i].count)
+			txn_apply(t, &t->txn_logs[i]);
+	return 0;
+}
+
 // Find the minimum leaf under a node
 static art_leaf* minimum(const art_node *n) {
 	// Handle base cases
@@ -354,12 +1550,17 @@ static art_leaf* minimum(const art_node *n) {
 	}
 }
 
-static art_leaf* make_leaf(const unsigned long key, int key_len, void *value, bool flush) {
+static art_leaf* make_leaf(const art_key key, int key_len, void *value, bool flush) {
 	//art_leaf *l = (art_leaf*)malloc(sizeof(art_leaf));
 	art_leaf *l;
-    void *ret;
-	posix_memalign(&ret, 64, sizeof(art_leaf));
-	l = static_cast<woart_leaf *>(ret);
+	l = pm_alloc(sizeof(art_leaf));
+	if (!l)
+		return NULL;
+	// The tag bits would overwrite the top of the address
+	if ((uintptr_t)l & ~LEAF_PTR_MASK) {
+		pm_free(l);
+		return NULL;
+	}
 	l->value = value;
 	l->key_len = key_len;
 	l->key = key;
@@ -384,10 +1585,68 @@ static void copy_header(art_node *dest, art_node *src) {
 	memcpy(&dest->path, &src->path, sizeof(path_comp));
 }
 
-static void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
+/**
+ * Finds the minimum leaves under two children of n. They
+ * diverge right after the prefix of n.
+ */
+static void first_two_leaves(art_node *n, art_leaf **leaf) {
+	art_node *child[2];
+	int i, cnt = 0;
+
+	switch (n->type) {
+		case NODE4:
+			child[0] = ((art_node4 *)n)->children[((art_node4 *)n)->slot[0].i_ptr];
+			child[1] = ((art_node4 *)n)->children[((art_node4 *)n)->slot[1].i_ptr];
+			break;
+		case NODE16:
+			for (i = 0; i < 16 && cnt < 2; i++) {
+				i = find_next_bit(&((art_node16 *)n)->bitmap, 16, i);
+				if (i < 16)
+					child[cnt++] = ((art_node16 *)n)->children[i];
+			}
+			break;
+		case NODE48:
+			for (i = 0; i < 256 && cnt < 2; i++)
+				if (((art_node48 *)n)->keys[i])
+					child[cnt++] = ((art_node48 *)n)->children[((art_node48 *)n)->keys[i] - 1];
+			break;
+		case NODE256:
+			for (i = 0; i < 256 && cnt < 2; i++)
+				if (((art_node256 *)n)->children[i])
+					child[cnt++] = ((art_node256 *)n)->children[i];
+			break;
+		default:
+			abort();
+	}
+	leaf[0] = minimum(child[0]);
+	leaf[1] = minimum(child[1]);
+}
+
+/**
+ * Rewrites a header left stale by a crash between the two
+ * stores of a prefix split.
+ */
+static void recovery_prefix(art_node *n, int depth) {
+	art_leaf *leaf[2];
+	path_comp new_path;
+	int i;
+	TRACE_ENTER(phase, ART_PHASE_PREFIX);
+
+	first_two_leaves(n, leaf);
+	int prefix_diff = longest_common_prefix(leaf[0], leaf[1], depth);
+	new_path.partial_len = prefix_diff;
+	for (i = 0; i < min(MAX_PREFIX_LEN, prefix_diff); i++)
+		new_path.partial[i] = get_index(leaf[1]->key, depth + i);
+	SET_DEPTH(&new_path, depth);
+	header_store(&n->path, &new_path);
+	flush_buffer(&n->path, sizeof(path_comp), true);
+	TRACE_LEAVE(phase);
+}
+
+static void add_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c, void *child) {
 	(void)ref;
 	n->children[c] = (art_node *)child;
-	flush_buffer(&n->children[c], 8, true);
+	persist_commit(t, &n->children[c], 8);
 }
 
 static void add_child256_noflush(art_node256 *n, art_node **ref, unsigned char c, void *child) {
@@ -395,7 +1654,8 @@ static void add_child256_noflush(art_node256 *n, art_node **ref, unsigned char c
 	n->children[c] = (art_node *)child;
 }
 
-static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c, void *child,
+		art_node *grown) {
 	unsigned long bitmap = 0;
 	int i, num = 0;
 
@@ -413,9 +1673,10 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
 		n->children[pos] = (art_node *)child;
 		flush_buffer(&n->children[pos], 8, true);
 		n->keys[c] = pos + 1;
-		flush_buffer(&n->keys[c], sizeof(unsigned char), true);
+		persist_commit(t, &n->keys[c], sizeof(unsigned char));
 	} else {
-		art_node256 *new_node = (art_node256 *)alloc_node(NODE256);
+		TRACE_ENTER(phase, ART_PHASE_GROW);
+		art_node256 *new_node = (art_node256 *)grown;
 		for (i = 0; i < 256; i++) {
 			if (n->keys[i]) {
 				new_node->children[i] = n->children[n->keys[i] - 1];
@@ -429,13 +1690,15 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
 		flush_buffer(new_node, sizeof(art_node256), true);
 
 		*ref = (art_node *)new_node;
-		flush_buffer(ref, 8, true);
+		persist_commit(t, ref, 8);
 
-		free(n);
+		retire_node(t, n);
+		TRACE_LEAVE(phase);
 	}
 }
 
-static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child16(art_tree *t, art_node16 *n, art_node **ref, unsigned char c, void *child,
+		art_node *grown) {
 	if (n->bitmap != ((0x1UL << 16) - 1)) {
 		int empty_idx;
 
@@ -453,10 +1716,11 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         mfence();
 
 		n->bitmap += (0x1UL << empty_idx);
-		flush_buffer(&n->bitmap, sizeof(unsigned long), true);
+		persist_commit(t, &n->bitmap, sizeof(unsigned long));
 	} else {
 		int idx;
-		art_node48 *new_node = (art_node48 *)alloc_node(NODE48);
+		TRACE_ENTER(phase, ART_PHASE_GROW);
+		art_node48 *new_node = (art_node48 *)grown;
 
 		memcpy(new_node->children, n->children,
 				sizeof(void *) * 16);
@@ -470,13 +1734,15 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
 		flush_buffer(new_node, sizeof(art_node48), true);
 
 		*ref = (art_node *)new_node;
-		flush_buffer(ref, sizeof(uintptr_t), true);
+		persist_commit(t, ref, sizeof(uintptr_t));
 
-		free(n);
+		retire_node(t, n);
+		TRACE_LEAVE(phase);
 	}
 }
 
-static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child4(art_tree *t, art_node4 *n, art_node **ref, unsigned char c, void *child,
+		art_node *grown) {
 	if (n->slot[3].i_ptr == -1) {
 		slot_array temp_slot[4];
 		int i, idx, mid = -1;
@@ -518,10 +1784,11 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
 		}
 
 		*((uint64_t *)n->slot) = *((uint64_t *)temp_slot);
-		flush_buffer(n->slot, sizeof(uintptr_t), true);
+		persist_commit(t, n->slot, sizeof(uintptr_t));
 	} else {
 		int idx;
-		art_node16 *new_node = (art_node16 *)alloc_node(NODE16);
+		TRACE_ENTER(phase, ART_PHASE_GROW);
+		art_node16 *new_node = (art_node16 *)grown;
 
 		for (idx = 0; idx < 4; idx++) {
 			new_node->keys[n->slot[idx].i_ptr] = n->slot[idx].key;
@@ -536,9 +1803,10 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
 		flush_buffer(new_node, sizeof(art_node16), true);
 
 		*ref = (art_node *)new_node;
-		flush_buffer(ref, 8, true);
+		persist_commit(t, ref, 8);
 
-		free(n);
+		retire_node(t, n);
+		TRACE_LEAVE(phase);
 	}
 }
 
@@ -585,16 +1853,52 @@ static void add_child4_noflush(art_node4 *n, art_node **ref, unsigned char c, vo
 	*((uint64_t *)n->slot) = *((uint64_t *)temp_slot);
 }
 
-static void add_child(art_node *n, art_node **ref, unsigned char c, void *child) {
+/**
+ * Allocates the node n grows into if its next child does not fit,
+ * before an insert changes anything
+ * @arg grown Receives the new node, or NULL if n has room
+ * @return 0 on success, -1 if the node could not be allocated.
+ */
+static int grow_reserve(const art_node *n, art_node **grown) {
+	uint8_t type = 0;
+	int i, num = 0;
+
+	switch (n->type) {
+		case NODE4:
+			if (((art_node4 *)n)->slot[3].i_ptr != -1)
+				type = NODE16;
+			break;
+		case NODE16:
+			if (((art_node16 *)n)->bitmap == ((0x1UL << 16) - 1))
+				type = NODE48;
+			break;
+		case NODE48:
+			for (i = 0; i < 256; i++)
+				if (((art_node48 *)n)->keys[i])
+					num++;
+			if (num == 48)
+				type = NODE256;
+			break;
+	}
+	*grown = type ? alloc_node(type) : NULL;
+	return type && !*grown ? -1 : 0;
+}
+
+/**
+ * Adds a child to n, growing it into grown, from grow_reserve(),
+ * if it is full
+ */
+static void add_child(art_tree *t, art_node *n, art_node **ref, unsigned char c, void *child,
+		art_node *grown) {
 	switch (n->type) {
 		case NODE4:
-			return add_child4((art_node4 *)n, ref, c, child);
+			return add_child4(t, (art_node4 *)n, ref, c, child, grown);
 		case NODE16:
-			return add_child16((art_node16 *)n, ref, c, child);
+			return add_child16(t, (art_node16 *)n, ref, c, child, grown);
 		case NODE48:
-			return add_child48((art_node48 *)n, ref, c, child);
+			return add_child48(t, (art_node48 *)n, ref, c, child, grown);
 		case NODE256:
-			return add_child256((art_node256 *)n, ref, c, child);
+			return add_child256(t, (art_node256 *)n, ref, c, child);
 		default:
 			abort();
 	}
@@ -603,13 +1907,14 @@ static void add_child(art_node *n, art_node **ref, unsigned char c, void *child)
 /**
  * Calculates the index at which the prefixes mismatch
  */
-static int prefix_mismatch(const art_node *n, const unsigned long key, int key_len, int depth, art_leaf **l) {
+static int prefix_mismatch(const art_node *n, const art_key key, int key_len, int depth, art_leaf **l) {
 //	int max_cmp = min(min(MAX_PREFIX_LEN, n->partial_len), (key_len * INDEX_BITS) - depth);
 	int max_cmp = min(min(MAX_PREFIX_LEN, n->path.partial_len), MAX_HEIGHT - depth);
 	int idx;
+	TRACE_ENTER(phase, ART_PHASE_PREFIX);
 	for (idx=0; idx < max_cmp; idx++) {
 		if (n->path.partial[idx] != get_index(key, depth + idx))
-			return idx;
+			goto out;
 	}
 
 	// If the prefix is short we can avoid finding a leaf
@@ -620,65 +1925,312 @@ static int prefix_mismatch(const art_node *n, const unsigned long key, int key_l
 		max_cmp = MAX_HEIGHT - depth;
 		for (; idx < max_cmp; idx++) {
 			if (get_index((*l)->key, idx + depth) != get_index(key, depth + idx))
-				return idx;
+				goto out;
 		}
 	}
+out:
+	TRACE_LEAVE(phase);
 	return idx;
 }
 
-static void* recursive_insert(art_node *n, art_node **ref, const unsigned long key,
-		int key_len, void *value, int depth, int *old)
-{
-	// If we are at a NULL node, inject a leaf
-	if (!n) {
-		*ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value, true));
-		flush_buffer(ref, sizeof(uintptr_t), true);
-		return NULL;
-	}
-
-	// If we are at a leaf, we need to replace it with a node
-	if (IS_LEAF(n)) {
-		art_leaf *l = LEAF_RAW(n);
+/**
+ * Points the mirror slots [lo, lo + span) at n, reached at the given
+ * depth, or at its children if n branches above the mirrored levels.
+ */
+static void dram_fill(art_dram *d, art_node *n, int depth, unsigned long lo) {
+	unsigned long i, count = 1UL << ((d->levels - depth) * NODE_BITS);
+	art_node **child;
+	int c, q;
 
-		// Check if we are updating an existing value
-		if (!leaf_matches(l, key, key_len, depth)) {
-			*old = 1;
-			void *old_val = l->value;
-			l->value = value;
-			flush_buffer(&l->value, sizeof(uintptr_t), true);
-			return old_val;
+	if (!n || IS_LEAF(n) || !HEADER_FRESH(&n->path, depth) ||
+			depth + n->path.partial_len >= d->levels) {
+		for (i = 0; i < count; i++) {
+			d->slots[lo + i].node = n;
+			d->slots[lo + i].depth = depth;
 		}
+		return;
+	}
 
-		// New value, we must split the leaf into a node4
-		art_node4 *new_node = (art_node4 *)alloc_node(NODE4);
-		new_node->n.path.depth = depth;
+	// Keys off the node prefix cannot be in the tree
+	for (i = 0; i < count; i++) {
+		d->slots[lo + i].node = NULL;
+		d->slots[lo + i].depth = depth;
+	}
 
-		// Create a new leaf
-		art_leaf *l2 = make_leaf(key, key_len, value, false);
+	// The prefix ends above the mirrored levels, so it is fully stored
+	q = depth + n->path.partial_len;
+	for (c = 0; c < n->path.partial_len; c++)
+		lo += (unsigned long)n->path.partial[c] << ((d->levels - depth - 1 - c) * NODE_BITS);
+	for (c = 0; c < (int)NUM_NODE_ENTRIES; c++) {
+		child = find_child(n, c);
+		if (child)
+			dram_fill(d, *child, q + 1,
+					lo + ((unsigned long)c << ((d->levels - q - 1) * NODE_BITS)));
+	}
+}
 
-		// Determine longest prefix
-		int i, longest_prefix = longest_common_prefix(l, l2, depth);
-		new_node->n.path.partial_len = longest_prefix;
-		for (i = 0; i < min(MAX_PREFIX_LEN, longest_prefix); i++)
-			new_node->n.path.partial[i] = get_index(key, depth + i);
+/**
+ * Records that the insert in progress changed the pointer
+ * reached at the given depth.
+ */
+static inline void dram_touch(art_tree *t, int depth) {
+	if (t->dram && depth < t->dram->dirty)
+		t->dram->dirty = depth;
+}
 
-		add_child4_noflush(new_node, ref, get_index(l->key, depth + longest_prefix), SET_LEAF(l));
-		add_child4_noflush(new_node, ref, get_index(l2->key, depth + longest_prefix), SET_LEAF(l2));
+/**
+ * Refills the mirror slots below the shallowest pointer changed by
+ * the insert of key. Everything above it is unchanged, so the walk
+ * down to it follows the insert path.
+ */
+static void dram_refresh(art_tree *t, const art_key key) {
+	art_dram *d = t->dram;
+	art_node *n = t->root;
+	unsigned long lo;
+	int depth = 0;
 
-        mfence();
-		flush_buffer(new_node, sizeof(art_node4), false);
-		flush_buffer(l2, sizeof(art_leaf), false);
-        mfence();
+	while (depth < d->dirty) {
+		depth += n->path.partial_len;
+		n = *find_child(n, get_index(key, depth));
+		depth++;
+	}
+
+	lo = key >> (MAX_HEIGHT - d->levels) * NODE_BITS;
+	lo &= ~((1UL << ((d->levels - depth) * NODE_BITS)) - 1);
+	dram_fill(d, n, depth, lo);
+	d->dirty = d->levels + 1;
+}
+
+static inline unsigned long cow_home(const art_cow *c, const void *p) {
+	return ((uintptr_t)p >> 3) * 0x9e3779b97f4a7c15UL >> 24 & c->mask;
+}
+
+/**
+ * Checks whether p was created since the newest view, so that no
+ * view reaches it
+ */
+static bool cow_fresh(const art_cow *c, const void *p) {
+	unsigned long i;
+
+	for (i = cow_home(c, p); c->fresh[i]; i = (i + 1) & c->mask)
+		if (c->fresh[i] == p)
+			return true;
+	return false;
+}
+
+/**
+ * Adds p to the fresh set, which grows at half load. If it cannot
+ * grow p stays shared and the next insert reaching it copies it.
+ */
+static void cow_mark(art_cow *c, const void *p) {
+	void **old = c->fresh;
+	unsigned long i, n = c->mask + 1;
+
+	if (2 * (c->nfresh + 1) > n) {
+		c->fresh = calloc(2 * n, sizeof(void *));
+		if (!c->fresh) {
+			c->fresh = old;
+			return;
+		}
+		c->mask = 2 * n - 1;
+		c->nfresh = 0;
+		for (i = 0; i < n; i++)
+			if (old[i])
+				cow_mark(c, old[i]);
+		free(old);
+	}
+	for (i = cow_home(c, p); c->fresh[i]; i = (i + 1) & c->mask)
+		if (c->fresh[i] == p)
+			return;
+	c->fresh[i] = (void *)p;
+	c->nfresh++;
+}
+
+/**
+ * Keeps a replaced node or leaf until the views that may reach it
+ * are closed. If the list cannot grow it is leaked.
+ */
+static void cow_retire(art_cow *c, void *p) {
+	art_retired *r;
+
+	if (c->nretired == c->max) {
+		r = realloc(c->retired, (c->max ? 2 * c->max : 256) * sizeof(art_retired));
+		if (!r)
+			return;
+		c->retired = r;
+		c->max = c->max ? 2 * c->max : 256;
+	}
+	c->retired[c->nretired].p = p;
+	c->retired[c->nretired++].seq = c->seq;
+}
+
+/**
+ * Frees the views closed since the last call and the versions
+ * retired before the oldest view still open
+ * @return true if a view is open.
+ */
+static bool cow_drain(art_tree *t) {
+	art_cow *c = t->cow;
+	art_view **pv = &c->views, *v;
+	uint64_t oldest = c->seq + 1;
+	unsigned long i;
+	void *p;
+
+	while ((v = *pv)) {
+		if (__atomic_load_n(&v->closed, __ATOMIC_ACQUIRE)) {
+			*pv = v->next;
+			free(v);
+			continue;
+		}
+		if (v->seq < oldest)
+			oldest = v->seq;
+		pv = &v->next;
+	}
+
+	// Versions are retired in order, so the freeable ones come first
+	for (i = 0; i < c->nretired && c->retired[i].seq < oldest; i++) {
+		p = c->retired[i].p;
+		if (IS_LEAF(p)) {
+			node_free(t, LEAF_RAW(p));
+		} else {
+			counts_drop(t, p);
+			node_free(t, p);
+		}
+	}
+	if (i < c->nretired)
+		memmove(c->retired, c->retired + i, (c->nretired - i) * sizeof(art_retired));
+	c->nretired -= i;
+	return c->views != NULL;
+}
+
+/**
+ * Copies the shared nodes on the path of key below n, down to the
+ * leaf holding key or the node the insert changes. The copies are
+ * flushed but not yet reachable from the tree.
+ * @return n if it is fresh, else its copy, or NULL if a copy could
+ * not be allocated. Nothing was retired then.
+ */
+static art_node* cow_path(art_tree *t, art_node *n, const art_key key, int key_len, int depth) {
+	art_cow *c = t->cow;
+	art_count_slot *s;
+	art_node *copy;
+	art_node **child;
+	art_leaf *l = NULL;
+
+	if (!n || cow_fresh(c, IS_LEAF(n) ? (void *)LEAF_RAW(n) : (void *)n))
+		return n;
+
+	if (IS_LEAF(n)) {
+		// A split leaves the leaf as it is, an update writes its value
+		if (LEAF_RAW(n)->key != key)
+			return n;
+		if (!(l = make_leaf(key, key_len, LEAF_RAW(n)->value, true)))
+			return NULL;
+		if (t->hot)
+			hot_forget(t->hot, key, LEAF_RAW(n));
+		cow_retire(c, n);
+		cow_mark(c, l);
+		return SET_LEAF(l);
+	}
+
+	if (!(copy = alloc_node(n->type)))
+		return NULL;
+	memcpy(copy, n, node_sizes[n->type - 1]);
+	if (!HEADER_FRESH(&copy->path, depth))
+		recovery_prefix(copy, depth);
+
+	// Below a mismatching prefix the insert splits the copy instead
+	if ((uint32_t)prefix_mismatch(copy, key, key_len, depth, &l) >= copy->path.partial_len) {
+		depth += copy->path.partial_len;
+		child = find_child(copy, get_index(key, depth));
+		if (child && !(*child = cow_path(t, *child, key, key_len, depth + 1))) {
+			pm_free(copy);
+			return NULL;
+		}
+	}
+	flush_buffer(copy, node_sizes[copy->type - 1], false);
+
+	if (t->counts && (s = counts_slot(t->counts, n))->node)
+		counts_put(t, copy, s->count);
+	cow_retire(c, n);
+	cow_mark(c, copy);
+	return copy;
+}
+
+/**
+ * Ends an insert that could not allocate a node or a leaf. Every
+ * path allocates before its size intent, so nothing was changed.
+ */
+static void* insert_failed(int *old, art_node *n, art_leaf *l) {
+	if (n)
+		pm_free(n);
+	if (l)
+		pm_free(l);
+	*old = -1;
+	return ART_INSERT_FAILED;
+}
+
+static void* recursive_insert(art_tree *t, art_node *n, art_node **ref, const art_key key,
+		int key_len, void *value, int depth, int *old)
+{
+	// If we are at a NULL node, inject a leaf
+	if (!n) {
+		art_leaf *l = make_leaf(key, key_len, value, false);
+		if (!l)
+			return insert_failed(old, NULL, NULL);
+		size_intent(t, key, key_len);
+		dram_touch(t, depth);
+		// The fence also orders the intent before the commit store
+		flush_buffer(l, sizeof(art_leaf), true);
+		*ref = (art_node*)SET_LEAF(l);
+		persist_commit(t, ref, sizeof(uintptr_t));
+		return NULL;
+	}
+
+	// If we are at a leaf, we need to replace it with a node
+	if (IS_LEAF(n)) {
+		art_leaf *l = LEAF_RAW(n);
+
+		// Check if we are updating an existing value
+		if (!leaf_matches(l, key, key_len, depth)) {
+			*old = 1;
+			void *old_val = l->value;
+			l->value = value;
+			persist_commit(t, &l->value, sizeof(uintptr_t));
+			return old_val;
+		}
+
+		// New value, we must split the leaf into a node4
+		art_node4 *new_node = (art_node4 *)alloc_node(NODE4);
+		art_leaf *l2 = make_leaf(key, key_len, value, false);
+		if (!new_node || !l2)
+			return insert_failed(old, (art_node *)new_node, l2);
+		size_intent(t, key, key_len);
+		dram_touch(t, depth);
+		SET_DEPTH(&new_node->n.path, depth);
+
+		// Determine longest prefix
+		int i, longest_prefix = longest_common_prefix(l, l2, depth);
+		new_node->n.path.partial_len = longest_prefix;
+		for (i = 0; i < min(MAX_PREFIX_LEN, longest_prefix); i++)
+			new_node->n.path.partial[i] = get_index(key, depth + i);
+
+		add_child4_noflush(new_node, ref, get_index(l->key, depth + longest_prefix), SET_LEAF(l));
+		add_child4_noflush(new_node, ref, get_index(l2->key, depth + longest_prefix), SET_LEAF(l2));
+
+        mfence();
+		flush_buffer(new_node, sizeof(art_node4), false);
+		flush_buffer(l2, sizeof(art_leaf), false);
+        mfence();
 
 		// Add the leafs to the new node4
 		*ref = (art_node*)new_node;
-		flush_buffer(ref, sizeof(uintptr_t), true);
+		persist_commit(t, ref, sizeof(uintptr_t));
 		return NULL;
 	}
 
-	if (n->path.depth != depth) {
-		printf("Insert: system is previously crashed!!\n");
-		exit(0);
+	if (!HEADER_FRESH(&n->path, depth)) {
+		recovery_prefix(n, depth);
 	}
 
 	// Check if given node has a prefix
@@ -691,9 +2243,14 @@ static void* recursive_insert(art_node *n, art_node **ref, const unsigned long k
 			goto RECURSE_SEARCH;
 		}
 
-		// Create a new node
+		// Create a new node and the new leaf
 		art_node4 *new_node = (art_node4*)alloc_node(NODE4);
-		new_node->n.path.depth = depth;
+		art_leaf *l2 = make_leaf(key, key_len, value, false);
+		if (!new_node || !l2)
+			return insert_failed(old, (art_node *)new_node, l2);
+		size_intent(t, key, key_len);
+		dram_touch(t, depth);
+		SET_DEPTH(&new_node->n.path, depth);
 		new_node->n.path.partial_len = prefix_diff;
 		memcpy(new_node->n.path.partial, n->path.partial, min(MAX_PREFIX_LEN, prefix_diff));
 
@@ -702,7 +2259,7 @@ static void* recursive_insert(art_node *n, art_node **ref, const unsigned long k
         if (n->path.partial_len <= MAX_PREFIX_LEN) {
 			add_child4_noflush(new_node, ref, n->path.partial[prefix_diff], n);
 			temp_path.partial_len = n->path.partial_len - (prefix_diff + 1);
-			temp_path.depth = (depth + prefix_diff + 1);
+			SET_DEPTH(&temp_path, depth + prefix_diff + 1);
 			memmove(temp_path.partial, n->path.partial + prefix_diff + 1,
 					min(MAX_PREFIX_LEN, temp_path.partial_len));
 		} else {
@@ -713,25 +2270,29 @@ static void* recursive_insert(art_node *n, art_node **ref, const unsigned long k
 			temp_path.partial_len = n->path.partial_len - (prefix_diff + 1);
 			for (i = 0; i < min(MAX_PREFIX_LEN, temp_path.partial_len); i++)
 				temp_path.partial[i] = get_index(l->key, depth + prefix_diff + 1 + i);
-			temp_path.depth = (depth + prefix_diff + 1);
+			SET_DEPTH(&temp_path, depth + prefix_diff + 1);
 		}
 
 		// Insert the new leaf
-		l = make_leaf(key, key_len, value, false);
-		add_child4_noflush(new_node, ref, get_index(key, depth + prefix_diff), SET_LEAF(l));
+		add_child4_noflush(new_node, ref, get_index(key, depth + prefix_diff), SET_LEAF(l2));
 
         mfence();
 		flush_buffer(new_node, sizeof(art_node4), false);
-		flush_buffer(l, sizeof(art_leaf), false);
+		flush_buffer(l2, sizeof(art_leaf), false);
         mfence();
 
 		*ref = (art_node*)new_node;
-        *((uint64_t *)&n->path) = *((uint64_t *)&temp_path);
+        header_store(&n->path, &temp_path);
 
-        mfence();
-		flush_buffer(&n->path, sizeof(path_comp), false);
-		flush_buffer(ref, sizeof(uintptr_t), false);
-        mfence();
+		if (t->async) {
+			persist_commit(t, &n->path, sizeof(path_comp));
+			persist_commit(t, ref, sizeof(uintptr_t));
+		} else {
+			mfence();
+			flush_buffer(&n->path, sizeof(path_comp), false);
+			flush_buffer(ref, sizeof(uintptr_t), false);
+			mfence();
+		}
 
 		return NULL;
 	}
@@ -741,17 +2302,76 @@ RECURSE_SEARCH:;
 	// Find a child to recurse to
 	art_node **child = find_child(n, get_index(key, depth));
 	if (child) {
-		return recursive_insert(*child, child, key, key_len, value, depth + 1, old);
+		return recursive_insert(t, *child, child, key, key_len, value, depth + 1, old);
 	}
 
 	// No child, node goes within us
-	art_leaf *l = make_leaf(key, key_len, value, true);
+	art_node *grown;
+	art_leaf *l = make_leaf(key, key_len, value, false);
+	if (!l || grow_reserve(n, &grown))
+		return insert_failed(old, NULL, l);
+	size_intent(t, key, key_len);
+	dram_touch(t, n->path.depth);
+	flush_buffer(l, sizeof(art_leaf), true);
 
-	add_child(n, ref, get_index(key, depth), SET_LEAF(l));
+	add_child(t, n, ref, get_index(key, depth), SET_LEAF(l), grown);
 
 	return NULL;
 }
 
+/**
+ * Inserts while views are open. Fresh nodes on the path of key are
+ * changed in place, the shared ones below them are copied and the
+ * insert changes the copies, which one store then publishes. A crash
+ * before that store leaks the copies.
+ */
+static void* cow_insert(art_tree *t, const art_key key, int key_len, void *value, int *old) {
+	art_node **ref = &t->root, **child, *n, *top;
+	art_leaf *l;
+	void *ret;
+	int depth = 0;
+
+	while ((n = *ref) && !IS_LEAF(n) && cow_fresh(t->cow, n)) {
+		if (!HEADER_FRESH(&n->path, depth))
+			recovery_prefix(n, depth);
+		l = NULL;
+		if ((uint32_t)prefix_mismatch(n, key, key_len, depth, &l) < n->path.partial_len)
+			break;
+		child = find_child(n, get_index(key, depth + n->path.partial_len));
+		if (!child)
+			break;
+		depth += n->path.partial_len + 1;
+		ref = child;
+	}
+
+	top = n ? cow_path(t, n, key, key_len, depth) : NULL;
+	if (n && !top)
+		return insert_failed(old, NULL, NULL);
+	if (top == n) {
+		ret = recursive_insert(t, n, ref, key, key_len, value, depth, old);
+	} else {
+		// A failed insert leaves the copies as they are, they replace n all the same
+		ret = recursive_insert(t, top, &top, key, key_len, value, depth, old);
+		mfence();
+		*ref = top;
+		flush_buffer(ref, sizeof(art_node *), true);
+		dram_touch(t, depth);
+	}
+
+	// Everything the insert created on the path is fresh as well
+	for (n = *ref; n && !IS_LEAF(n); n = child ? *child : NULL) {
+		cow_mark(t->cow, n);
+		depth += n->path.partial_len;
+		child = find_child(n, get_index(key, depth));
+		depth++;
+	}
+	if (n)
+		cow_mark(t->cow, LEAF_RAW(n));
+	return ret;
+}
+
+static void counts_add(art_tree *t, const art_key key);
+
 /**
  * Inserts a new value into the ART tree
  * @arg t The tree
@@ -759,11 +2379,2193 @@ RECURSE_SEARCH:;
  * @arg key_len The length of the key
  * @arg value Opaque value.
  * @return NULL if the item was newly inserted, otherwise
+ * the old value pointer is returned, or ART_INSERT_FAILED.
+ */
+void* art_insert(art_tree *t, const art_key key, int key_len, void *value) {
+	int old_val = 0, async = t->async;
+	bool cow = t->cow && cow_drain(t);
+	art_posting *posting = NULL;
+	void *old;
+
+	art_perf_begin();
+	art_trace_begin();
+	// Copies for open views are published synchronously
+	if (cow)
+		t->async = 0;
+	// A synchronous insert may not share the intent of a pending group
+	if (!t->async && t->npending)
+		art_sync(t);
+	if (t->reclaimer && __atomic_load_n(&t->reclaimer->nfree, __ATOMIC_RELAXED))
+		reclaim_drain(t);
+	if (t->op_hook)
+		t->op_hook(t->op_data, ART_OP_INSERT, key, key_len, value);
+	if (t->meta.flags & ART_FLAG_MULTI) {
+		art_leaf *l = search_leaf(t, key, key_len);
+		if (l) {
+			old = posting_append(l, value) ? ART_INSERT_FAILED : NULL;
+			goto done;
+		}
+		if (!(posting = posting_alloc(value, NULL))) {
+			old = ART_INSERT_FAILED;
+			goto done;
+		}
+		value = posting;
+	}
+	if (cow)
+		old = cow_insert(t, key, key_len, value, &old_val);
+	else
+		old = recursive_insert(t, t->root, &t->root, key, key_len, value, 0, &old_val);
+	if (old_val < 0) {
+		if (posting)
+			pm_free(posting);
+		goto done;
+	}
+	if (!old_val) size_commit(t);
+	if (!old_val && t->counts)
+		counts_add(t, key);
+	if (t->dram && t->dram->dirty <= t->dram->levels)
+		dram_refresh(t, key);
+done:
+	t->async = async;
+	art_trace_end(ART_TRACE_INSERT);
+	art_perf_end(ART_PERF_INSERT);
+	return old;
+}
+
+/**
+ * Collects the children of a NODE16 sorted by key,
+ * returns the number of children.
+ */
+static int sorted_child16(art_node16 *n, key_pos *pos) {
+	int i, j, cnt = 0;
+	key_pos tmp;
+
+	for (i = 0; i < 16; i++) {
+		i = find_next_bit(&n->bitmap, 16, i);
+		if (i < 16) {
+			pos[cnt].key = n->keys[i];
+			pos[cnt].child = n->children[i];
+			cnt++;
+		}
+	}
+
+	for (i = 1; i < cnt; i++) {
+		tmp = pos[i];
+		for (j = i - 1; j >= 0 && pos[j].key > tmp.key; j--)
+			pos[j + 1] = pos[j];
+		pos[j + 1] = tmp;
+	}
+	return cnt;
+}
+
+/**
+ * Collects the children of any node sorted by key,
+ * returns the number of children.
+ */
+static int ordered_children(art_node *n, key_pos *pos) {
+	int i, cnt = 0;
+
+	switch (n->type) {
+		case NODE4:
+			for (i = 0; i < 4 && ((art_node4 *)n)->slot[i].i_ptr != -1; i++) {
+				pos[cnt].key = ((art_node4 *)n)->slot[i].key;
+				pos[cnt].child = ((art_node4 *)n)->children[(unsigned char)((art_node4 *)n)->slot[i].i_ptr];
+				cnt++;
+			}
+			break;
+		case NODE16:
+			cnt = sorted_child16((art_node16 *)n, pos);
+			break;
+		case NODE48:
+			for (i = 0; i < 256; i++) {
+				if (!((art_node48 *)n)->keys[i]) continue;
+				pos[cnt].key = i;
+				pos[cnt].child = ((art_node48 *)n)->children[((art_node48 *)n)->keys[i] - 1];
+				cnt++;
+			}
+			break;
+		case NODE256:
+			for (i = 0; i < 256; i++) {
+				if (!((art_node256 *)n)->children[i]) continue;
+				pos[cnt].key = i;
+				pos[cnt].child = ((art_node256 *)n)->children[i];
+				cnt++;
+			}
+			break;
+		default:
+			abort();
+	}
+	return cnt;
+}
+
+/**
+ * Counts the leaves under n, from the table if n has a count
+ */
+static uint64_t subtree_count(const art_tree *t, art_node *n) {
+	art_count_slot *s;
+	key_pos pos[256];
+	uint64_t sum = 0;
+	int i, cnt;
+
+	if (!n)
+		return 0;
+	if (IS_LEAF(n))
+		return 1;
+	if (t->counts && (s = counts_slot(t->counts, n))->node)
+		return s->count;
+
+	cnt = ordered_children(n, pos);
+	for (i = 0; i < cnt; i++)
+		sum += subtree_count(t, pos[i].child);
+	return sum;
+}
+
+/**
+ * Counts the new key in every node on its path. A node without
+ * a count was created by this insert, all its children have one.
+ */
+static void counts_add(art_tree *t, const art_key key) {
+	art_count_slot *s;
+	art_node *n = t->root;
+	int depth = 0;
+
+	while (n && !IS_LEAF(n)) {
+		s = counts_slot(t->counts, n);
+		if (s->node)
+			s->count++;
+		else
+			counts_put(t, n, subtree_count(t, n));
+		if (!t->counts)
+			return;
+
+		depth += n->path.partial_len;
+		n = *find_child(n, get_index(key, depth));
+		depth++;
+	}
+}
+
+// Recursively iterates over the tree
+static int recursive_iter(const art_tree *t, art_node *n, art_callback cb, void *data) {
+	// Handle base cases
+	if (!n) return 0;
+	if (IS_LEAF(n)) {
+		art_leaf *l = LEAF_RAW(n);
+		return leaf_iter(t, l, cb, data);
+	}
+
+	int i, idx, cnt, res;
+	key_pos pos[16];
+	switch (n->type) {
+		case NODE4:
+			for (i = 0; i < 4 && ((art_node4 *)n)->slot[i].i_ptr != -1; i++) {
+				idx = ((art_node4 *)n)->slot[i].i_ptr;
+				res = recursive_iter(t, ((art_node4 *)n)->children[idx], cb, data);
+				if (res) return res;
+			}
+			break;
+
+		case NODE16:
+			cnt = sorted_child16((art_node16 *)n, pos);
+			for (i = 0; i < cnt; i++) {
+				res = recursive_iter(t, pos[i].child, cb, data);
+				if (res) return res;
+			}
+			break;
+
+		case NODE48:
+			for (i = 0; i < 256; i++) {
+				idx = ((art_node48 *)n)->keys[i];
+				if (!idx) continue;
+
+				res = recursive_iter(t, ((art_node48 *)n)->children[idx - 1], cb, data);
+				if (res) return res;
+			}
+			break;
+
+		case NODE256:
+			for (i = 0; i < 256; i++) {
+				if (!((art_node256 *)n)->children[i]) continue;
+				res = recursive_iter(t, ((art_node256 *)n)->children[i], cb, data);
+				if (res) return res;
+			}
+			break;
+
+		default:
+			abort();
+	}
+	return 0;
+}
+
+/**
+ * Iterates through the entries pairs in the map,
+ * invoking a callback for each. The call back gets a
+ * key, value for each and returns an integer stop value.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter(art_tree *t, art_callback cb, void *data) {
+	return recursive_iter(t, t->root, cb, data);
+}
+
+/**
+ * Opens a read-only view of the tree as it is now
+ * @arg t The tree, not in multi-value mode
+ * @return the view, or NULL on failure.
+ */
+art_view* art_view_open(art_tree *t) {
+	art_cow *c = t->cow;
+	art_view *v;
+
+	if (t->meta.flags & ART_FLAG_MULTI)
+		return NULL;
+	if (!c) {
+		c = calloc(1, sizeof(art_cow));
+		if (!c)
+			return NULL;
+		c->mask = 1023;
+		c->fresh = calloc(c->mask + 1, sizeof(void *));
+		if (!c->fresh) {
+			free(c);
+			return NULL;
+		}
+		t->cow = c;
+	}
+	v = malloc(sizeof(art_view));
+	if (!v)
+		return NULL;
+	cow_drain(t);
+
+	// The view reaches every node there is
+	memset(c->fresh, 0, (c->mask + 1) * sizeof(void *));
+	c->nfresh = 0;
+	v->t = t;
+	v->root = t->root;
+	v->size = art_size(t);
+	v->seq = ++c->seq;
+	v->closed = 0;
+	v->next = c->views;
+	c->views = v;
+	return v;
+}
+
+/**
+ * Searches for a value in a view
+ * @arg v The view
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the item was not found, otherwise
+ * the value pointer is returned.
+ */
+void* art_view_search(const art_view *v, const art_key key, int key_len) {
+	art_leaf *l = search_from(v->root, 0, key, key_len);
+	return l ? leaf_value(v->t, l) : NULL;
+}
+
+/**
+ * Iterates over the keys of a view in ascending order
+ * @arg v The view
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_view_iter(const art_view *v, art_callback cb, void *data) {
+	return recursive_iter(v->t, v->root, cb, data);
+}
+
+/**
+ * Closes a view, which the writer frees at its next insert
+ * @arg v The view
+ */
+void art_view_close(art_view *v) {
+	__atomic_store_n(&v->closed, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Inserts a new value without waiting for it to become durable.
+ * The tree is updated immediately, but the flush and fence of the
+ * commit store are deferred and shared by the whole group.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @arg ticket If not NULL, receives the ticket of this insert
+ * @return NULL if the item was newly inserted, otherwise
  * the old value pointer is returned.
  */
-void* art_insert(art_tree *t, const unsigned long key, int key_len, void *value) {
-	int old_val = 0;
-	void *old = recursive_insert(t->root, &t->root, key, key_len, value, 0, &old_val);
-	if (!old_val) t->size++;
+void* art_insert_async(art_tree *t, const art_key key, int key_len, void *value,
+		art_ticket *ticket) {
+	void *old;
+
+	t->async = 1;
+	old = art_insert(t, key, key_len, value);
+	t->async = 0;
+
+	t->issued++;
+	if (ticket)
+		*ticket = t->issued;
 	return old;
 }
+
+/**
+ * Makes every asynchronous insert issued so far durable with one
+ * fence. Every object a deferred commit publishes was already
+ * flushed and fenced before the commit store, so the commits may
+ * reach PM in any order.
+ * @arg t The tree
+ */
+void art_sync(art_tree *t) {
+	int i;
+
+	mfence();
+	for (i = 0; i < t->npending; i++)
+		flush_buffer(t->pending[i], sizeof(uintptr_t), false);
+	mfence();
+
+	if (t->nadded) {
+		// Still inside an insert when called from persist_commit()
+		art_size_stripe *s = size_stripe(t);
+		s->count = ((s->count & ~1UL) + (t->nadded << 1)) | (t->async ? 1 : 0);
+		flush_buffer(&s->count, sizeof(uint64_t), true);
+	}
+
+	for (i = 0; i < t->nretired; i++)
+		node_free(t, t->retired[i]);
+
+	t->npending = 0;
+	t->nadded = 0;
+	t->nretired = 0;
+	t->durable = t->issued;
+}
+
+/**
+ * Checks whether an asynchronous insert is durable
+ * @arg t The tree
+ * @arg ticket The ticket returned by art_insert_async()
+ * @return true once the insert survives a crash.
+ */
+bool art_durable(const art_tree *t, art_ticket ticket) {
+	return ticket <= t->durable;
+}
+
+/**
+ * Starts a transaction, a group of inserts that survive a crash
+ * all together or not at all. Nothing is written before
+ * art_txn_commit(); dropping the transaction aborts it.
+ * @arg t The tree
+ * @arg tx The transaction
+ * @return 0 on success, -1 in multi-value mode, where replaying
+ * an insert is not idempotent.
+ */
+int art_txn_begin(art_tree *t, art_txn *tx) {
+	if (t->meta.flags & ART_FLAG_MULTI)
+		return -1;
+	tx->t = t;
+	tx->n = 0;
+	return 0;
+}
+
+/**
+ * Adds an insert to a transaction
+ * @arg tx The transaction
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return 0 on success, -1 if the transaction holds ART_TXN_MAX
+ * inserts already.
+ */
+int art_txn_put(art_txn *tx, const art_key key, int key_len, void *value) {
+	if (tx->n == ART_TXN_MAX)
+		return -1;
+	tx->entries[tx->n].key = key;
+	tx->entries[tx->n].key_len = key_len;
+	tx->entries[tx->n].value = value;
+	tx->n++;
+	return 0;
+}
+
+/**
+ * Commits a transaction. Its inserts are written to the redo log
+ * of the thread and committed with one store of the log count,
+ * then applied to the tree as one group of asynchronous inserts
+ * and synced. art_tree_open() replays a log that was committed
+ * but not yet applied.
+ * @arg tx The transaction, empty again afterwards
+ * @return 0 on success.
+ */
+int art_txn_commit(art_txn *tx) {
+	art_tree *t = tx->t;
+	art_op_hook hook = t->op_hook;
+	art_txn_log *log;
+	int i;
+
+	if (!tx->n)
+		return 0;
+	log = &t->txn_logs[size_stripe(t) - t->stripes];
+	for (i = 0; hook && i < tx->n; i++)
+		hook(t->op_data, i < tx->n - 1 ? ART_OP_TXN : ART_OP_INSERT, tx->entries[i].key,
+				tx->entries[i].key_len, tx->entries[i].value);
+
+	memcpy(log->entries, tx->entries, tx->n * sizeof(art_txn_entry));
+	flush_buffer(log->entries, tx->n * sizeof(art_txn_entry), true);
+	log->count = tx->n;
+	flush_buffer(&log->count, sizeof(uint64_t), true);
+
+	// The hook was told of the inserts as one transaction
+	t->op_hook = NULL;
+	txn_apply(t, log);
+	t->op_hook = hook;
+	tx->n = 0;
+	return 0;
+}
+
+/**
+ * Mirrors the top levels of the tree in DRAM. Searches start at
+ * the mirrored slot of their top digits instead of walking those
+ * levels in PM. The setting is persistent: art_tree_open()
+ * rebuilds the mirror.
+ * @arg t The tree
+ * @arg levels Number of mirrored levels, 0 disables the mirror.
+ * levels * NODE_BITS may not exceed ART_DRAM_MAX_BITS.
+ * @return 0 on success.
+ */
+int art_set_dram_levels(art_tree *t, int levels) {
+	art_dram *d = NULL;
+
+	if (levels < 0 || levels * NODE_BITS > ART_DRAM_MAX_BITS)
+		return -1;
+
+	if (levels) {
+		d = malloc(sizeof(art_dram) + (sizeof(art_dram_slot) << (levels * NODE_BITS)));
+		if (!d)
+			return -1;
+		d->levels = levels;
+		d->dirty = levels + 1;
+		dram_fill(d, t->root, 0, 0);
+	}
+
+	free(t->dram);
+	t->dram = d;
+
+	if (t->meta.dram_levels != levels) {
+		t->meta.dram_levels = levels;
+		flush_buffer(&t->meta, sizeof(art_meta), true);
+	}
+	return 0;
+}
+
+/**
+ * Puts a cache of recently found leaves in front of art_search().
+ * Hits skip the whole walk from the root. The cache is volatile
+ * and starts empty, also after art_tree_open().
+ * @arg t The tree
+ * @arg sets Number of sets of ART_HOT_WAYS entries, a power of
+ * two. 0 removes the cache.
+ * @return 0 on success.
+ */
+int art_set_hot_cache(art_tree *t, unsigned long sets) {
+	art_hot_cache *c = NULL;
+	unsigned long size;
+	void *ret;
+
+	if (sets & (sets - 1))
+		return -1;
+
+	if (sets) {
+		size = sizeof(art_hot_cache) + sets * sizeof(c->ways[0]);
+		if (posix_memalign(&ret, 64, size))
+			return -1;
+		c = ret;
+		memset(c, 0, size);
+		c->mask = sets - 1;
+	}
+
+	free(t->hot);
+	t->hot = c;
+	return 0;
+}
+
+static uint64_t counts_build(art_tree *t, art_node *n) {
+	key_pos pos[256];
+	uint64_t sum = 0;
+	int i, cnt;
+
+	if (!n)
+		return 0;
+	if (IS_LEAF(n))
+		return 1;
+	cnt = ordered_children(n, pos);
+	for (i = 0; i < cnt; i++)
+		sum += counts_build(t, pos[i].child);
+	counts_put(t, n, sum);
+	return sum;
+}
+
+/**
+ * Keeps the number of leaves under every inner node, so that
+ * art_rank(), art_count_range() and art_select() take time
+ * proportional to the tree height instead of a scan. The counts
+ * live in DRAM; the setting is persistent and art_tree_open()
+ * rebuilds them.
+ * @arg t The tree
+ * @arg enable Whether to maintain the counts
+ * @return 0 on success.
+ */
+int art_set_counts(art_tree *t, bool enable) {
+	unsigned char flags;
+
+	free(t->counts);
+	t->counts = NULL;
+	if (enable) {
+		t->counts = counts_alloc(1024);
+		counts_build(t, t->root);
+		if (!t->counts)
+			return -1;
+	}
+
+	flags = enable ? t->meta.flags | ART_FLAG_COUNTS : t->meta.flags & ~ART_FLAG_COUNTS;
+	if (t->meta.flags != flags) {
+		t->meta.flags = flags;
+		flush_buffer(&t->meta, sizeof(art_meta), true);
+	}
+	return 0;
+}
+
+/**
+ * Lets a key hold several values. art_insert() then adds the value
+ * to the posting list of the key instead of replacing it, and
+ * art_search() returns one of the values. The setting is
+ * persistent and can only be changed while the tree is empty.
+ * @arg t The tree
+ * @arg enable Whether keys hold several values
+ * @return 0 on success, -1 if the tree is not empty.
+ */
+int art_set_multi_value(art_tree *t, bool enable) {
+	unsigned char flags;
+
+	flags = enable ? t->meta.flags | ART_FLAG_MULTI : t->meta.flags & ~ART_FLAG_MULTI;
+	if (t->meta.flags == flags)
+		return 0;
+	if (t->root || (t->cow && cow_drain(t)))
+		return -1;
+	if (t->op_hook)
+		t->op_hook(t->op_data, ART_OP_MULTI, 0, enable, NULL);
+	t->meta.flags = flags;
+	flush_buffer(&t->meta, sizeof(art_meta), true);
+	return 0;
+}
+
+/**
+ * Counts the keys below key, or up to and including it
+ */
+static uint64_t rank_walk(const art_tree *t, const art_key key, bool inclusive) {
+	art_node *n = t->root;
+	art_leaf *l, *leaf[2];
+	key_pos pos[256];
+	uint64_t rank = 0;
+	int i, k, p, len, cnt, depth = 0;
+
+	while (n) {
+		if (IS_LEAF(n)) {
+			l = LEAF_RAW(n);
+			if (l->key < key || (inclusive && l->key == key))
+				rank++;
+			return rank;
+		}
+
+		// A stale header after a crash, take the prefix from leaves
+		if (HEADER_FRESH(&n->path, depth)) {
+			len = n->path.partial_len;
+		} else {
+			first_two_leaves(n, leaf);
+			len = longest_common_prefix(leaf[0], leaf[1], depth);
+		}
+
+		// The subtree is wholly below or above a mismatching key
+		l = NULL;
+		for (i = 0; i < len; i++) {
+			if (i < MAX_PREFIX_LEN && HEADER_FRESH(&n->path, depth)) {
+				p = n->path.partial[i];
+			} else {
+				if (!l)
+					l = minimum(n);
+				p = get_index(l->key, depth + i);
+			}
+			k = get_index(key, depth + i);
+			if (k != p)
+				return k > p ? rank + subtree_count(t, n) : rank;
+		}
+		depth += len;
+
+		k = get_index(key, depth);
+		cnt = ordered_children(n, pos);
+		for (i = 0; i < cnt && pos[i].key < k; i++)
+			rank += subtree_count(t, pos[i].child);
+		n = i < cnt && pos[i].key == k ? pos[i].child : NULL;
+		depth++;
+	}
+	return rank;
+}
+
+/**
+ * Counts the keys smaller than the given key. Without
+ * art_set_counts() this walks the subtrees left of the key.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return the number of smaller keys.
+ */
+uint64_t art_rank(const art_tree *t, const art_key key, int key_len) {
+	(void)key_len;
+	return rank_walk(t, key, false);
+}
+
+/**
+ * Counts the keys in [lo, hi]
+ * @arg t The tree
+ * @arg lo The smallest key of the range
+ * @arg lo_len The length of lo
+ * @arg hi The largest key of the range
+ * @arg hi_len The length of hi
+ * @return the number of keys in the range, 0 if lo > hi.
+ */
+uint64_t art_count_range(const art_tree *t, const art_key lo, int lo_len,
+		const art_key hi, int hi_len) {
+	(void)lo_len;
+	(void)hi_len;
+	if (lo > hi)
+		return 0;
+	return rank_walk(t, hi, true) - rank_walk(t, lo, false);
+}
+
+/**
+ * Finds the leaf with the given rank, i.e. the one that has
+ * exactly rank smaller keys.
+ * @arg t The tree
+ * @arg rank The rank, from 0 to art_size() - 1
+ * @return the leaf, or NULL if rank is out of range.
+ */
+art_leaf* art_select(const art_tree *t, uint64_t rank) {
+	art_node *n = t->root;
+	key_pos pos[256];
+	uint64_t count;
+	int i, cnt;
+
+	while (n && !IS_LEAF(n)) {
+		cnt = ordered_children(n, pos);
+		for (i = 0; i < cnt; i++) {
+			count = subtree_count(t, pos[i].child);
+			if (rank < count)
+				break;
+			rank -= count;
+		}
+		if (i == cnt)
+			return NULL;
+		n = pos[i].child;
+	}
+	return n && !rank ? LEAF_RAW(n) : NULL;
+}
+
+/**
+ * Finds the child with the nearest key above c, or below c if
+ * up is false, reading the sorted NODE4 slots, the NODE48 index
+ * and the NODE256 array in key order
+ * @return NULL if there is none.
+ */
+static art_node* next_child(const art_node *n, int c, bool up) {
+	art_node4 *n4;
+	art_node16 *n16;
+	int i, idx = -1;
+
+	switch (n->type) {
+		case NODE4:
+			n4 = (art_node4 *)n;
+			for (i = 0; i < 4 && n4->slot[i].i_ptr != -1; i++) {
+				if (n4->slot[i].key > c) {
+					if (up)
+						return n4->children[(unsigned char)n4->slot[i].i_ptr];
+					break;
+				}
+				if (n4->slot[i].key < c)
+					idx = n4->slot[i].i_ptr;
+			}
+			return idx < 0 || up ? NULL : n4->children[idx];
+		case NODE16:
+			n16 = (art_node16 *)n;
+			for (i = 0; i < 16; i++) {
+				i = find_next_bit(&n16->bitmap, 16, i);
+				if (i < 16 && (up ? n16->keys[i] > c : n16->keys[i] < c) &&
+						(idx < 0 || (up ? n16->keys[i] < n16->keys[idx] :
+								  n16->keys[i] > n16->keys[idx])))
+					idx = i;
+			}
+			return idx < 0 ? NULL : n16->children[idx];
+		case NODE48:
+			for (i = up ? c + 1 : c - 1; i >= 0 && i < 256; i += up ? 1 : -1)
+				if (((art_node48 *)n)->keys[i])
+					return ((art_node48 *)n)->children[((art_node48 *)n)->keys[i] - 1];
+			return NULL;
+		case NODE256:
+			for (i = up ? c + 1 : c - 1; i >= 0 && i < 256; i += up ? 1 : -1)
+				if (((art_node256 *)n)->children[i])
+					return ((art_node256 *)n)->children[i];
+			return NULL;
+		default:
+			abort();
+	}
+}
+
+// Find the maximum leaf under a node
+static art_leaf* maximum(const art_node *n) {
+	while (n && !IS_LEAF(n))
+		n = next_child(n, 256, false);
+	return n ? LEAF_RAW(n) : NULL;
+}
+
+/**
+ * Descends once towards key and remembers the nearest subtree
+ * on the far side, which holds the answer if the path of the key
+ * does not
+ */
+static art_leaf* bound_walk(const art_tree *t, const art_key key, bool floor) {
+	art_node *n = t->root, **ref, *child, *next = NULL;
+	art_leaf *l, *leaf[2];
+	int i, k, p, len, depth = 0;
+
+	while (n) {
+		if (IS_LEAF(n)) {
+			l = LEAF_RAW(n);
+			if (l->key == key || (l->key < key) == floor)
+				return l;
+			break;
+		}
+
+		// A stale header after a crash, take the prefix from leaves
+		if (HEADER_FRESH(&n->path, depth)) {
+			len = n->path.partial_len;
+		} else {
+			first_two_leaves(n, leaf);
+			len = longest_common_prefix(leaf[0], leaf[1], depth);
+		}
+
+		l = NULL;
+		for (i = 0; i < len; i++) {
+			if (i < MAX_PREFIX_LEN && HEADER_FRESH(&n->path, depth)) {
+				p = n->path.partial[i];
+			} else {
+				if (!l)
+					l = minimum(n);
+				p = get_index(l->key, depth + i);
+			}
+			k = get_index(key, depth + i);
+			if (k != p)
+				break;
+		}
+		// The subtree is wholly below or above a mismatching key
+		if (i < len) {
+			if ((k > p) == floor)
+				return floor ? maximum(n) : minimum(n);
+			break;
+		}
+		depth += len;
+
+		k = get_index(key, depth);
+		if ((child = next_child(n, k, !floor)))
+			next = child;
+		ref = find_child(n, k);
+		n = ref ? *ref : NULL;
+		depth++;
+	}
+	return floor ? maximum(next) : minimum(next);
+}
+
+/**
+ * Finds the smallest key that is not below the given key
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return the leaf, or NULL if all keys are below key.
+ */
+art_leaf* art_lower_bound(const art_tree *t, const art_key key, int key_len) {
+	(void)key_len;
+	return bound_walk(t, key, false);
+}
+
+/**
+ * Finds the largest key that is not above the given key
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return the leaf, or NULL if all keys are above key.
+ */
+art_leaf* art_floor(const art_tree *t, const art_key key, int key_len) {
+	(void)key_len;
+	return bound_walk(t, key, true);
+}
+
+#define ALLOC_SIZE(size)	(((size) + 63) & ~63UL)
+
+/**
+ * Accounts for one inner node reached at the given depth and
+ * collects its children
+ * @return the length of its prefix.
+ */
+static int stats_node(art_node *n, int depth, art_tree_stats *s, key_pos *pos, int *cnt) {
+	art_leaf *leaf[2];
+	unsigned long size = node_sizes[n->type - 1];
+	int len;
+
+	*cnt = ordered_children(n, pos);
+	s->nodes[n->type - 1]++;
+	s->children[n->type - 1] += *cnt;
+	s->bytes += ALLOC_SIZE(size);
+	s->waste += ALLOC_SIZE(size) - size;
+
+	if (HEADER_FRESH(&n->path, depth)) {
+		len = n->path.partial_len;
+	} else {
+		s->stale++;
+		first_two_leaves(n, leaf);
+		len = longest_common_prefix(leaf[0], leaf[1], depth);
+	}
+	if (len > MAX_PREFIX_LEN)
+		s->long_prefix++;
+	return len;
+}
+
+static void stats_walk(art_node *n, int depth, int height, art_tree_stats *s) {
+	key_pos pos[256];
+	int i, cnt, len;
+
+	if (!n)
+		return;
+	if (IS_LEAF(n)) {
+		s->leaves++;
+		s->leaf_depth[height]++;
+		s->bytes += ALLOC_SIZE(sizeof(art_leaf));
+		s->waste += ALLOC_SIZE(sizeof(art_leaf)) - sizeof(art_leaf);
+		return;
+	}
+
+	len = stats_node(n, depth, s, pos, &cnt);
+	for (i = 0; i < cnt; i++)
+		stats_walk(pos[i].child, depth + len + 1, height + 1, s);
+}
+
+/**
+ * Children of the root shared by the threads of art_stats()
+ */
+typedef struct {
+	key_pos pos[256];
+	int cnt;
+	int depth;
+	int next;
+} stats_work;
+
+typedef struct {
+	stats_work *work;
+	art_tree_stats s;
+} stats_worker;
+
+static void* stats_thread(void *arg) {
+	stats_worker *w = arg;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&w->work->next, 1)) < w->work->cnt)
+		stats_walk(w->work->pos[i].child, w->work->depth, 1, &w->s);
+	return NULL;
+}
+
+/**
+ * Walks the whole tree and describes its shape: the nodes and
+ * their fill, the depth of the leaves, the prefixes longer than
+ * MAX_PREFIX_LEN, the headers left stale by a crash and the memory
+ * used. The tree must not be modified during the walk.
+ * @arg t The tree
+ * @arg stats Filled with the shape of the tree
+ * @arg threads Number of threads walking the children of the
+ * root, 1 to walk in the calling thread
+ * @return 0 on success.
+ */
+int art_stats(const art_tree *t, art_tree_stats *stats, int threads) {
+	stats_worker *w;
+	pthread_t *tid;
+	stats_work work;
+	unsigned long j;
+	int i, started;
+
+	memset(stats, 0, sizeof(art_tree_stats));
+	if (!t->root || IS_LEAF(t->root) || threads <= 1) {
+		stats_walk(t->root, 0, 0, stats);
+		return 0;
+	}
+
+	w = calloc(threads, sizeof(stats_worker));
+	tid = calloc(threads, sizeof(pthread_t));
+	if (!w || !tid) {
+		free(w);
+		free(tid);
+		return -1;
+	}
+
+	work.depth = stats_node(t->root, 0, stats, work.pos, &work.cnt) + 1;
+	work.next = 0;
+
+	// The calling thread is the first worker
+	for (i = 0; i < threads; i++)
+		w[i].work = &work;
+	for (started = 1; started < threads; started++)
+		if (pthread_create(&tid[started], NULL, stats_thread, &w[started]))
+			break;
+	stats_thread(&w[0]);
+
+	for (i = 0; i < started; i++) {
+		if (i)
+			pthread_join(tid[i], NULL);
+		for (j = 0; j < sizeof(art_tree_stats) / sizeof(uint64_t); j++)
+			((uint64_t *)stats)[j] += ((uint64_t *)&w[i].s)[j];
+	}
+	free(w);
+	free(tid);
+	return 0;
+}
+
+/**
+ * A subtree of art_parallel_scan(). inside is set if all its
+ * keys are in the range, else they are checked on the way down.
+ */
+typedef struct {
+	art_node *n;
+	int depth;
+	bool inside;
+} scan_task;
+
+/**
+ * Tasks of one worker. The owner pushes and takes at the tail,
+ * thieves take at the head, where the larger subtrees are.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	scan_task *tasks;
+	int head;
+	int tail;
+	int size;
+} scan_deque;
+
+typedef struct {
+	const art_tree *t;
+	art_key lo;
+	art_key hi;
+	art_callback cb;
+	scan_deque *deques;
+	int threads;
+	int idle;
+	long pending;
+	int res;
+} scan_pool;
+
+typedef struct {
+	scan_pool *pool;
+	int id;
+	void *data;
+} scan_worker;
+
+/**
+ * Queues tasks on the deque of the calling worker, the first one
+ * at the tail
+ * @return 0 on success, -1 if memory ran out.
+ */
+static int scan_push(scan_pool *p, int id, const scan_task *tasks, int cnt) {
+	scan_deque *q = &p->deques[id];
+	scan_task *grown;
+	int i;
+
+	pthread_mutex_lock(&q->lock);
+	// The first push finds no array, nor anything to compact
+	if (q->tail + cnt > q->size && q->tasks && q->head > 0) {
+		memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(scan_task));
+		q->tail -= q->head;
+		q->head = 0;
+	}
+	if (q->tail + cnt > q->size) {
+		grown = realloc(q->tasks, (q->size * 2 + cnt) * sizeof(scan_task));
+		if (!grown) {
+			pthread_mutex_unlock(&q->lock);
+			return -1;
+		}
+		q->tasks = grown;
+		q->size = q->size * 2 + cnt;
+	}
+	__sync_fetch_and_add(&p->pending, cnt);
+	for (i = cnt - 1; i >= 0; i--)
+		q->tasks[q->tail++] = tasks[i];
+	pthread_mutex_unlock(&q->lock);
+	return 0;
+}
+
+/**
+ * Takes a task from the tail of the own deque, or from the head
+ * of another one
+ */
+static bool scan_take(scan_deque *q, scan_task *task, bool own) {
+	bool found = false;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail) {
+		*task = own ? q->tasks[--q->tail] : q->tasks[q->head++];
+		found = true;
+	}
+	pthread_mutex_unlock(&q->lock);
+	return found;
+}
+
+static int scan_walk(scan_worker *w, art_node *n, int depth, bool inside) {
+	scan_pool *p = w->pool;
+	scan_task tasks[256];
+	key_pos pos[256];
+	art_leaf *l, *leaf[2];
+	art_key low, base;
+	int i, cnt, num, len, shift, res;
+
+	if (!n)
+		return 0;
+	if (IS_LEAF(n)) {
+		l = LEAF_RAW(n);
+		if (!inside && (l->key < p->lo || l->key > p->hi))
+			return 0;
+		return leaf_iter(p->t, l, p->cb, w->data);
+	}
+	// Another worker was stopped by the callback
+	if ((res = __atomic_load_n(&p->res, __ATOMIC_RELAXED)))
+		return res;
+
+	if (HEADER_FRESH(&n->path, depth)) {
+		len = n->path.partial_len;
+	} else {
+		first_two_leaves(n, leaf);
+		len = longest_common_prefix(leaf[0], leaf[1], depth);
+	}
+
+	// The keys of a child share the digits above it with any leaf of n
+	l = inside ? NULL : minimum(n);
+	shift = (MAX_DEPTH - depth - len) * NODE_BITS;
+	low = ((art_key)1 << shift) - 1;
+	num = ordered_children(n, pos);
+	for (i = cnt = 0; i < num; i++) {
+		tasks[cnt].n = pos[i].child;
+		tasks[cnt].depth = depth + len + 1;
+		tasks[cnt].inside = inside;
+		if (!inside) {
+			base = (l->key & ~(((art_key)LOW_BIT_MASK << shift) | low)) |
+				((art_key)pos[i].key << shift);
+			if (base + low < p->lo || base > p->hi)
+				continue;
+			tasks[cnt].inside = p->lo <= base && base + low <= p->hi;
+		}
+		cnt++;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		// Hand the later children to idle workers
+		if (i + 1 < cnt && __atomic_load_n(&p->idle, __ATOMIC_RELAXED) &&
+				!scan_push(p, w->id, tasks + i + 1, cnt - i - 1))
+			cnt = i + 1;
+		res = scan_walk(w, tasks[i].n, tasks[i].depth, tasks[i].inside);
+		if (res)
+			return res;
+	}
+	return 0;
+}
+
+static void* scan_thread(void *arg) {
+	scan_worker *w = arg;
+	scan_pool *p = w->pool;
+	scan_task task;
+	bool found, idle = true;
+	int i, res;
+
+	while (1) {
+		found = scan_take(&p->deques[w->id], &task, true);
+		for (i = 1; !found && i < p->threads; i++)
+			found = scan_take(&p->deques[(w->id + i) % p->threads], &task, false);
+		if (!found) {
+			if (!__atomic_load_n(&p->pending, __ATOMIC_ACQUIRE))
+				break;
+			if (!idle) {
+				idle = true;
+				__sync_fetch_and_add(&p->idle, 1);
+			}
+			sched_yield();
+			continue;
+		}
+		if (idle) {
+			idle = false;
+			__sync_fetch_and_sub(&p->idle, 1);
+		}
+
+		res = scan_walk(w, task.n, task.depth, task.inside);
+		if (res)
+			__sync_bool_compare_and_swap(&p->res, 0, res);
+		__sync_fetch_and_sub(&p->pending, 1);
+	}
+	if (idle)
+		__sync_fetch_and_sub(&p->idle, 1);
+	return NULL;
+}
+
+/**
+ * Visits the keys in [lo, hi] from several threads
+ * @arg data Per-thread handles, data[i] is passed to the callback
+ * in thread i, the calling thread is thread 0
+ * @return 0 on success, the return of a callback that stopped the
+ * scan, or -1 if memory ran out.
+ */
+int art_parallel_scan(const art_tree *t, const art_key lo, const art_key hi,
+		art_callback cb, void **data, int threads) {
+	scan_worker *w;
+	scan_pool p;
+	scan_task root;
+	pthread_t *tid;
+	int i, started;
+
+	if (lo > hi || !t->root)
+		return 0;
+	if (threads < 1)
+		threads = 1;
+
+	memset(&p, 0, sizeof(p));
+	p.t = t;
+	p.lo = lo;
+	p.hi = hi;
+	p.cb = cb;
+	p.threads = threads;
+	p.deques = calloc(threads, sizeof(scan_deque));
+	w = calloc(threads, sizeof(scan_worker));
+	tid = calloc(threads, sizeof(pthread_t));
+	if (!p.deques || !w || !tid) {
+		free(p.deques);
+		free(w);
+		free(tid);
+		return -1;
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_init(&p.deques[i].lock, NULL);
+		w[i].pool = &p;
+		w[i].id = i;
+		w[i].data = data ? data[i] : NULL;
+	}
+
+	// Threads count as idle until they find a task, so the root is split at once
+	root.n = t->root;
+	root.depth = 0;
+	root.inside = false;
+	p.idle = threads;
+	if (scan_push(&p, 0, &root, 1)) {
+		free(p.deques);
+		free(w);
+		free(tid);
+		return -1;
+	}
+
+	// The calling thread is the first worker
+	for (started = 1; started < threads; started++)
+		if (pthread_create(&tid[started], NULL, scan_thread, &w[started]))
+			break;
+	__sync_fetch_and_sub(&p.idle, threads - started);
+	scan_thread(&w[0]);
+
+	for (i = 1; i < started; i++)
+		pthread_join(tid[i], NULL);
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_destroy(&p.deques[i].lock);
+		free(p.deques[i].tasks);
+	}
+	free(p.deques);
+	free(w);
+	free(tid);
+	return p.res;
+}
+
+/**
+ * A subtree for art_check(), reached at depth. The top depth
+ * digits of ref are those on the path to it.
+ */
+typedef struct {
+	art_node *n;
+	int depth;
+	art_key ref;
+} check_task;
+
+typedef struct {
+	art_tree *t;
+	art_check_fn mark;
+	void *data;
+	bool repair;
+	check_task *tasks;
+	long ntasks;
+	long next;
+} check_work;
+
+typedef struct {
+	check_work *work;
+	art_check_report r;
+} check_worker;
+
+/**
+ * A valid child of a node, idx is its place in the node
+ */
+typedef struct {
+	art_node *child;
+	int key;
+	int idx;
+} check_slot;
+
+/**
+ * Returns whether the top digits of two keys match
+ */
+static inline bool top_digits_match(art_key a, art_key b, int digits) {
+	return !digits || !((a ^ b) >> ((MAX_HEIGHT - digits) * NODE_BITS));
+}
+
+static inline art_key set_digit(art_key key, int depth, int c) {
+	int shift = (MAX_DEPTH - depth) * NODE_BITS;
+	return (key & ~((art_key)LOW_BIT_MASK << shift)) | (art_key)c << shift;
+}
+
+static inline int check_mark(check_work *w, const void *p, art_check_report *r) {
+	if (!w->mark || !w->mark(w->data, p))
+		return 0;
+	r->bad_pointer++;
+	return -1;
+}
+
+/**
+ * Collects the valid children of n in key order. A child is valid
+ * if its entry is well formed, points to a child and holds a key
+ * no valid entry before it holds.
+ * @arg bad Set if the node holds other entries or NODE4 slots are
+ * out of order
+ * @return the number of children, -1 if the type is unknown.
+ */
+static int check_children(const art_node *n, check_slot *slots, bool *bad) {
+	check_slot tmp;
+	unsigned long used = 0;
+	int i, j, k, cnt = 0;
+	bool end = false;
+
+	*bad = false;
+	switch (n->type) {
+		case NODE4:
+			for (i = 0; i < 4; i++) {
+				k = ((art_node4 *)n)->slot[i].i_ptr;
+				if (k == -1) {
+					end = true;
+					continue;
+				}
+				if (end || k < 0 || k > 3 || (used >> k & 1) || !((art_node4 *)n)->children[k] ||
+						(cnt && ((art_node4 *)n)->slot[i].key <= slots[cnt - 1].key)) {
+					*bad = true;
+					if (end || k < 0 || k > 3 || (used >> k & 1) || !((art_node4 *)n)->children[k])
+						continue;
+				}
+				used |= 1UL << k;
+				slots[cnt].child = ((art_node4 *)n)->children[k];
+				slots[cnt].key = ((art_node4 *)n)->slot[i].key;
+				slots[cnt++].idx = k;
+			}
+			break;
+		case NODE16:
+			if (((art_node16 *)n)->bitmap >> 16)
+				*bad = true;
+			for (i = 0; i < 16; i++) {
+				if (!(((art_node16 *)n)->bitmap >> i & 1))
+					continue;
+				if (!((art_node16 *)n)->children[i]) {
+					*bad = true;
+					continue;
+				}
+				slots[cnt].child = ((art_node16 *)n)->children[i];
+				slots[cnt].key = ((art_node16 *)n)->keys[i];
+				slots[cnt++].idx = i;
+			}
+			break;
+		case NODE48:
+			for (i = 0; i < 256; i++) {
+				k = ((art_node48 *)n)->keys[i];
+				if (!k)
+					continue;
+				if (k > 48 || (used >> (k - 1) & 1) || !((art_node48 *)n)->children[k - 1]) {
+					*bad = true;
+					continue;
+				}
+				used |= 1UL << (k - 1);
+				slots[cnt].child = ((art_node48 *)n)->children[k - 1];
+				slots[cnt].key = i;
+				slots[cnt++].idx = k - 1;
+			}
+			return cnt;
+		case NODE256:
+			for (i = 0; i < 256; i++) {
+				if (!((art_node256 *)n)->children[i])
+					continue;
+				slots[cnt].child = ((art_node256 *)n)->children[i];
+				slots[cnt].key = i;
+				slots[cnt++].idx = i;
+			}
+			return cnt;
+		default:
+			return -1;
+	}
+
+	// Sort NODE4 and NODE16 entries and drop repeated keys
+	for (i = 1; i < cnt; i++) {
+		tmp = slots[i];
+		for (j = i - 1; j >= 0 && slots[j].key > tmp.key; j--)
+			slots[j + 1] = slots[j];
+		slots[j + 1] = tmp;
+	}
+	for (i = j = 0; i < cnt; i++) {
+		if (j && slots[i].key == slots[j - 1].key) {
+			*bad = true;
+			continue;
+		}
+		slots[j++] = slots[i];
+	}
+	return j;
+}
+
+/**
+ * Rewrites the layout of n to hold just the valid children, each
+ * part with one persistent store like an insert
+ */
+static void check_rebuild(art_node *n, const check_slot *slots, int cnt) {
+	slot_array tmp[4];
+	unsigned long bitmap = 0;
+	bool keep[256];
+	int i;
+
+	switch (n->type) {
+		case NODE4:
+			for (i = 0; i < 4; i++) {
+				tmp[i].key = i < cnt ? slots[i].key : 0;
+				tmp[i].i_ptr = i < cnt ? slots[i].idx : -1;
+			}
+			*((uint64_t *)((art_node4 *)n)->slot) = *((uint64_t *)tmp);
+			flush_buffer(((art_node4 *)n)->slot, sizeof(uint64_t), true);
+			break;
+		case NODE16:
+			for (i = 0; i < cnt; i++)
+				bitmap |= 1UL << slots[i].idx;
+			((art_node16 *)n)->bitmap = bitmap;
+			flush_buffer(&((art_node16 *)n)->bitmap, sizeof(unsigned long), true);
+			break;
+		case NODE48:
+			memset(keep, 0, sizeof(keep));
+			for (i = 0; i < cnt; i++)
+				keep[slots[i].key] = true;
+			for (i = 0; i < 256; i++)
+				if (!keep[i])
+					((art_node48 *)n)->keys[i] = 0;
+			flush_buffer(((art_node48 *)n)->keys, 256, true);
+			break;
+	}
+}
+
+/**
+ * Finds a leaf under n through valid entries only
+ * @return NULL if there is none or a pointer on the way was
+ * rejected.
+ */
+static art_leaf* check_any_leaf(check_work *w, art_node *n, art_check_report *r) {
+	check_slot slots[256];
+	bool bad;
+	int h;
+
+	for (h = 0; n && h <= MAX_HEIGHT; h++) {
+		if (IS_LEAF(n))
+			return check_mark(w, LEAF_RAW(n), r) ? NULL : LEAF_RAW(n);
+		if (check_mark(w, n, r) || check_children(n, slots, &bad) <= 0)
+			return NULL;
+		n = slots[0].child;
+	}
+	return NULL;
+}
+
+/**
+ * Marks a subtree that is no longer in the tree, e.g. one waiting
+ * to be reclaimed
+ */
+static void check_mark_all(check_work *w, art_node *n, int height, art_check_report *r) {
+	check_slot slots[256];
+	bool bad;
+	int i, cnt;
+
+	if (!n || height > MAX_HEIGHT)
+		return;
+	if (IS_LEAF(n)) {
+		check_mark(w, LEAF_RAW(n), r);
+		return;
+	}
+	if (check_mark(w, n, r))
+		return;
+	cnt = check_children(n, slots, &bad);
+	for (i = 0; i < cnt; i++)
+		check_mark_all(w, slots[i].child, height + 1, r);
+}
+
+/**
+ * Checks one node or leaf
+ * @return the number of children queued in out.
+ */
+static int check_node(check_work *w, const check_task *task, art_check_report *r, check_task *out) {
+	art_node *n = task->n;
+	check_slot slots[256];
+	art_leaf *l, *leaf[2];
+	art_posting *p;
+	art_key base;
+	int i, len, cnt, depth = task->depth;
+	bool bad, fix = false;
+
+	if (IS_LEAF(n)) {
+		l = LEAF_RAW(n);
+		if (check_mark(w, l, r))
+			return 0;
+		r->leaves++;
+		if (!top_digits_match(l->key, task->ref, depth))
+			r->bad_leaf++;
+		if (w->t->meta.flags & ART_FLAG_MULTI) {
+			for (p = l->value; p; p = p->next) {
+				if (check_mark(w, p, r))
+					break;
+				if (p->bitmap >> ART_POSTING_SLOTS)
+					r->bad_leaf++;
+			}
+		}
+		return 0;
+	}
+	if (check_mark(w, n, r))
+		return 0;
+	r->nodes++;
+	if (depth > MAX_DEPTH) {
+		r->bad_node++;
+		return 0;
+	}
+
+	cnt = check_children(n, slots, &bad);
+	if (cnt < 0) {
+		r->bad_node++;
+		return 0;
+	}
+	if (bad) {
+		r->bad_node++;
+		if (w->repair) {
+			check_rebuild(n, slots, cnt);
+			r->repaired++;
+		}
+	}
+	if (cnt < 2) {
+		// Without two children the prefix cannot be told, trust the header
+		r->bad_node++;
+		len = HEADER_FRESH(&n->path, depth) ? min(n->path.partial_len, MAX_DEPTH - depth) : 0;
+		l = check_any_leaf(w, n, r);
+		base = l ? l->key : task->ref;
+	} else {
+		leaf[0] = check_any_leaf(w, slots[0].child, r);
+		leaf[1] = check_any_leaf(w, slots[1].child, r);
+		if (!leaf[0] || !leaf[1])
+			return 0;
+		len = longest_common_prefix(leaf[0], leaf[1], depth);
+		if (depth + len > MAX_DEPTH) {
+			// Two leaves with the same key
+			r->bad_leaf++;
+			len = MAX_DEPTH - depth;
+		}
+
+		// The header must hold what recovery_prefix() would write
+		if (!HEADER_FRESH(&n->path, depth)) {
+			r->stale++;
+			fix = true;
+		} else {
+			fix = n->path.partial_len != len;
+			for (i = 0; !fix && i < min(MAX_PREFIX_LEN, len); i++)
+				fix = n->path.partial[i] != get_index(leaf[0]->key, depth + i);
+			if (fix)
+				r->bad_header++;
+		}
+		if (fix && w->repair) {
+			recovery_prefix(n, depth);
+			r->repaired++;
+		}
+		base = leaf[0]->key;
+	}
+
+	// Digits above the node come from the path, the prefix from its leaves
+	if (depth)
+		base = (task->ref & ~(((art_key)1 << ((MAX_HEIGHT - depth) * NODE_BITS)) - 1)) |
+			(base & (((art_key)1 << ((MAX_HEIGHT - depth) * NODE_BITS)) - 1));
+	for (i = 0; i < cnt; i++) {
+		out[i].n = slots[i].child;
+		out[i].depth = depth + len + 1;
+		out[i].ref = set_digit(base, depth + len, slots[i].key);
+	}
+	return cnt;
+}
+
+static void check_walk(check_work *w, const check_task *task, art_check_report *r) {
+	check_task kids[NUM_NODE_ENTRIES];
+	int i, cnt;
+
+	cnt = check_node(w, task, r, kids);
+	for (i = 0; i < cnt; i++)
+		check_walk(w, &kids[i], r);
+}
+
+static void* check_thread(void *arg) {
+	check_worker *w = arg;
+	long i;
+
+	while ((i = __sync_fetch_and_add(&w->work->next, 1)) < w->work->ntasks)
+		check_walk(w->work, &w->work->tasks[i], &w->r);
+	return NULL;
+}
+
+/**
+ * Checks every node and leaf of a tree that is not open for writing
+ * @return 0 on success, -1 if t is not a tree of this geometry or
+ * memory ran out.
+ */
+int art_check(art_tree *t, art_check_report *report, art_check_fn mark, void *data,
+		int threads, bool repair) {
+	check_task *next;
+	check_worker *w;
+	check_work work;
+	pthread_t *tid;
+	art_arena *a;
+	uint64_t size, leaves;
+	unsigned long j;
+	long i, cnt;
+	int started;
+	bool grown;
+
+	memset(report, 0, sizeof(art_check_report));
+	if (t->meta.magic != ART_MAGIC || t->meta.version != ART_FORMAT_VERSION ||
+			t->meta.node_bits != NODE_BITS || t->meta.max_depth != MAX_DEPTH ||
+			t->meta.max_prefix_len != MAX_PREFIX_LEN)
+		return -1;
+	if (threads < 1)
+		threads = 1;
+
+	work.t = t;
+	work.mark = mark;
+	work.data = data;
+	work.repair = repair;
+	work.next = 0;
+
+	// Recovery left for art_tree_open()
+	if (t->prefix_log.op)
+		report->pending++;
+	for (i = 0; i < ART_SIZE_STRIPES; i++) {
+		if (t->stripes[i].count & 1)
+			report->pending++;
+		if (t->txn_logs[i].count)
+			report->pending++;
+	}
+
+	// Memory the tree holds outside of its nodes
+	for (a = t->arenas; a && !check_mark(&work, a, report); a = a->next)
+		;
+	for (i = 0; i < ART_RECLAIM_SLOTS; i++)
+		check_mark_all(&work, t->reclaim[i], 0, report);
+	if (t->prefix_log.op) {
+		check_mark_all(&work, t->prefix_log.subtree, 0, report);
+		if (t->prefix_log.parent)
+			check_mark(&work, t->prefix_log.parent, report);
+	}
+
+	// Check the top levels here until there are tasks for every thread
+	work.tasks = malloc(sizeof(check_task));
+	if (!work.tasks)
+		return -1;
+	work.tasks[0].n = t->root;
+	work.tasks[0].depth = 0;
+	work.tasks[0].ref = 0;
+	work.ntasks = t->root ? 1 : 0;
+	while (threads > 1 && work.ntasks && work.ntasks < threads * 8) {
+		next = malloc(work.ntasks * NUM_NODE_ENTRIES * sizeof(check_task));
+		if (!next)
+			break;
+		for (i = cnt = 0, grown = false; i < work.ntasks; i++) {
+			if (IS_LEAF(work.tasks[i].n)) {
+				next[cnt++] = work.tasks[i];
+			} else {
+				cnt += check_node(&work, &work.tasks[i], report, next + cnt);
+				grown = true;
+			}
+		}
+		free(work.tasks);
+		work.tasks = next;
+		work.ntasks = cnt;
+		if (!grown)
+			break;
+	}
+
+	w = calloc(threads, sizeof(check_worker));
+	tid = calloc(threads, sizeof(pthread_t));
+	if (!w || !tid) {
+		free(work.tasks);
+		free(w);
+		free(tid);
+		return -1;
+	}
+
+	// The calling thread is the first worker
+	for (i = 0; i < threads; i++)
+		w[i].work = &work;
+	for (started = 1; started < threads; started++)
+		if (pthread_create(&tid[started], NULL, check_thread, &w[started]))
+			break;
+	check_thread(&w[0]);
+
+	for (i = 0; i < started; i++) {
+		if (i)
+			pthread_join(tid[i], NULL);
+		for (j = 0; j < sizeof(art_check_report) / sizeof(uint64_t); j++)
+			((uint64_t *)report)[j] += ((uint64_t *)&w[i].r)[j];
+	}
+	free(work.tasks);
+	free(w);
+	free(tid);
+
+	// art_tree_open() recounts the size while a log is pending
+	if (!report->pending) {
+		leaves = report->leaves + t->reclaimed + reclaim_pending(t);
+		size = t->size_adjust;
+		for (i = 0; i < ART_SIZE_STRIPES; i++)
+			size += t->stripes[i].count >> 1;
+		if (size != leaves) {
+			report->bad_size = 1;
+			if (repair) {
+				for (i = 0; i < ART_SIZE_STRIPES; i++) {
+					t->stripes[i].count = i ? 0 : (leaves - t->size_adjust) << 1;
+					flush_buffer(&t->stripes[i].count, sizeof(uint64_t), false);
+				}
+				mfence();
+				t->size = leaves;
+				report->repaired++;
+			}
+		}
+	}
+	return 0;
+}
+
+static unsigned long arena_bytes(art_node *n, unsigned long off) {
+	art_node **refs[256];
+	int i, cnt;
+
+	if (IS_LEAF(n))
+		return LEAF_ALIGN(off) + sizeof(art_leaf);
+	off = NODE_ALIGN(off) + node_sizes[n->type - 1];
+	cnt = child_refs(n, refs);
+	for (i = 0; i < cnt; i++)
+		off = arena_bytes(*refs[i], off);
+	return off;
+}
+
+/**
+ * Copies a subtree into an arena in depth first order, carrying
+ * the subtree counts over to the copies
+ * @return the copy of n.
+ */
+static art_node* arena_copy(art_tree *t, art_node *n, char *base, unsigned long *off,
+		uint64_t *live) {
+	art_node **refs[256];
+	art_count_slot *s;
+	art_node *c;
+	art_leaf *l;
+	int i, cnt;
+
+	(*live)++;
+	if (IS_LEAF(n)) {
+		*off = LEAF_ALIGN(*off);
+		l = (art_leaf *)(base + *off);
+		memcpy(l, LEAF_RAW(n), sizeof(art_leaf));
+		*off += sizeof(art_leaf);
+		return SET_LEAF(l);
+	}
+
+	*off = NODE_ALIGN(*off);
+	c = (art_node *)(base + *off);
+	memcpy(c, n, node_sizes[n->type - 1]);
+	*off += node_sizes[n->type - 1];
+	cnt = child_refs(c, refs);
+	for (i = 0; i < cnt; i++)
+		*refs[i] = arena_copy(t, *refs[i], base, off, live);
+
+	if (t->counts && (s = counts_slot(t->counts, n))->node)
+		counts_put(t, c, s->count);
+	return c;
+}
+
+static void subtree_free(art_tree *t, art_node *n) {
+	art_node **refs[256];
+	int i, cnt;
+
+	if (IS_LEAF(n)) {
+		node_free(t, LEAF_RAW(n));
+		return;
+	}
+	cnt = child_refs(n, refs);
+	for (i = 0; i < cnt; i++)
+		subtree_free(t, *refs[i]);
+	counts_drop(t, n);
+	node_free(t, n);
+}
+
+/**
+ * Relocates subtrees under the root, each into one arena in depth
+ * first order, so that a lookup touches neighbouring memory. Each
+ * copy is published with a single pointer store like an insert,
+ * then the old nodes and leaves are freed; an arena is returned
+ * to the allocator once all its contents were replaced. Pointers
+ * to leaves, e.g. from art_select(), are invalid afterwards.
+ * Successive calls continue where the last one stopped, so the
+ * work can be spread between inserts.
+ * @arg t The tree
+ * @arg subtrees Number of children of the root to relocate,
+ * 0 for all of them
+ * @return 0 on success, -1 if memory ran out.
+ */
+int art_compact(art_tree *t, int subtrees) {
+	art_node **ref, *old, *copy;
+	unsigned long size, off;
+	uint64_t live;
+	art_arena *a;
+	int i, done = 0, ret = 0;
+
+	// Views may still read the old subtrees
+	if (t->cow && cow_drain(t))
+		return -1;
+	if (!t->root || IS_LEAF(t->root))
+		return 0;
+	// Deferred commits may still point into the old subtrees
+	if (t->npending)
+		art_sync(t);
+	if (subtrees <= 0)
+		subtrees = 256;
+
+	for (i = 0; i < 256 && done < subtrees; i++) {
+		ref = find_child(t->root, t->compact_next);
+		t->compact_next = (t->compact_next + 1) % 256;
+		if (!ref || !*ref || IS_LEAF(*ref))
+			continue;
+
+		size = arena_bytes(*ref, sizeof(art_arena));
+		if (arena_reserve(t) || !(a = pm_alloc(size))) {
+			ret = -1;
+			break;
+		}
+		off = sizeof(art_arena);
+		live = 0;
+		old = *ref;
+		a->size = size;
+		a->next = t->arenas;
+		copy = arena_copy(t, old, (char *)a, &off, &live);
+		flush_buffer(a, size, true);
+		arena_insert(t, a, live);
+
+		// Linked first, so that recovery frees it if the swap is lost
+		t->arenas = a;
+		flush_buffer(&t->arenas, sizeof(art_arena *), true);
+		*ref = copy;
+		flush_buffer(ref, sizeof(art_node *), true);
+
+		if (t->hot)
+			hot_clear(t->hot);
+		subtree_free(t, old);
+		done++;
+	}
+
+	if (done && t->dram && art_set_dram_levels(t, t->dram->levels))
+		ret = -1;
+	return ret;
+}
+
+/**
+ * Returns the prefix length of n, from its leaves if the header
+ * is stale
+ */
+static int prefix_len(art_node *n, int depth) {
+	art_leaf *leaf[2];
+
+	if (HEADER_FRESH(&n->path, depth))
+		return n->path.partial_len;
+	first_two_leaves(n, leaf);
+	return longest_common_prefix(leaf[0], leaf[1], depth);
+}
+
+/**
+ * Finds the pointer to the subtree that holds exactly the keys
+ * starting with the top digits of prefix
+ * @arg path Receives the pointers to the inner nodes above it
+ * @arg depths Receives the depths of those nodes
+ * @arg npath Receives the number of those nodes
+ * @return NULL if no key starts with those digits.
+ */
+static art_node** prefix_find(art_tree *t, const art_key prefix, int digits,
+		art_node ***path, int *depths, int *npath) {
+	art_node **ref = &t->root, *n;
+	art_leaf *l;
+	int i, p, len, depth = 0;
+
+	*npath = 0;
+	while (ref && (n = *ref)) {
+		if (IS_LEAF(n)) {
+			for (i = depth; i < digits; i++)
+				if (get_index(LEAF_RAW(n)->key, i) != get_index(prefix, i))
+					return NULL;
+			return ref;
+		}
+
+		len = prefix_len(n, depth);
+		l = NULL;
+		for (i = 0; i < len && depth + i < digits; i++) {
+			if (i < MAX_PREFIX_LEN && HEADER_FRESH(&n->path, depth)) {
+				p = n->path.partial[i];
+			} else {
+				if (!l)
+					l = minimum(n);
+				p = get_index(l->key, depth + i);
+			}
+			if (p != get_index(prefix, depth + i))
+				return NULL;
+		}
+		if (depth + len >= digits)
+			return ref;
+
+		path[*npath] = ref;
+		depths[*npath] = depth;
+		(*npath)++;
+		depth += len;
+		ref = find_child(n, get_index(prefix, depth));
+		depth++;
+	}
+	return NULL;
+}
+
+/**
+ * Unlinks the child at ref from n with the one store that would
+ * have committed it
+ */
+static void remove_child(art_node *n, art_node **ref) {
+	art_node4 *p4;
+	art_node16 *p16;
+	art_node48 *p48;
+	slot_array temp_slot[4];
+	int i, j;
+
+	switch (n->type) {
+		case NODE4:
+			p4 = (art_node4 *)n;
+			for (i = 0, j = 0; i < 4 && p4->slot[i].i_ptr != -1; i++)
+				if (&p4->children[(unsigned char)p4->slot[i].i_ptr] != ref)
+					temp_slot[j++] = p4->slot[i];
+			for (; j < 4; j++) {
+				temp_slot[j].key = 0;
+				temp_slot[j].i_ptr = -1;
+			}
+			*((uint64_t *)p4->slot) = *((uint64_t *)temp_slot);
+			flush_buffer(p4->slot, sizeof(uintptr_t), true);
+			break;
+		case NODE16:
+			p16 = (art_node16 *)n;
+			p16->bitmap &= ~(0x1UL << (ref - p16->children));
+			flush_buffer(&p16->bitmap, sizeof(unsigned long), true);
+			break;
+		case NODE48:
+			p48 = (art_node48 *)n;
+			for (i = 0; i < 256; i++)
+				if (p48->keys[i] == ref - p48->children + 1)
+					break;
+			p48->keys[i] = 0;
+			flush_buffer(&p48->keys[i], sizeof(unsigned char), true);
+			break;
+		case NODE256:
+			*ref = NULL;
+			flush_buffer(ref, sizeof(art_node *), true);
+			break;
+		default:
+			abort();
+	}
+}
+
+/**
+ * Writes the log of a drop or attach before its pointer store.
+ * The op is set last, so a torn log is never acted upon.
+ */
+static void prefix_log(art_tree *t, uint64_t op, const art_leaf *l, uint64_t count,
+		art_node *subtree, art_node *parent, art_tree *src, int slot) {
+	art_prefix_log *log = &t->prefix_log;
+
+	log->key = l->key;
+	log->key_len = l->key_len;
+	log->count = count;
+	log->adjust = t->size_adjust;
+	log->subtree = subtree;
+	log->parent = parent;
+	log->src = src;
+	log->slot = slot;
+	flush_buffer(log, sizeof(art_prefix_log), true);
+	log->op = op;
+	flush_buffer(&log->op, sizeof(uint64_t), true);
+}
+
+/**
+ * Removes every key that starts with the given top bits. The
+ * subtree holding them is unlinked with one store to its parent,
+ * or its sibling takes the place of their common parent, and a
+ * background thread reclaims its nodes and leaves. The cost does
+ * not depend on the number of keys removed.
+ * art_size() keeps counting them until the reclaim thread has
+ * taken the subtree apart, see art_reclaim_wait().
+ * @arg t The tree
+ * @arg prefix A key whose top bits are the prefix
+ * @arg bits Length of the prefix, a multiple of NODE_BITS
+ * @return 0 on success, also if no key has the prefix, -1 if
+ * bits is invalid or the reclaim thread cannot be started.
+ */
+int art_drop_prefix(art_tree *t, const art_key prefix, int bits) {
+	art_node **path[MAX_HEIGHT + 1], **ref, **refs[256], *victim, *parent = NULL, *sibling = NULL;
+	int depths[MAX_HEIGHT + 1];
+	art_count_slot *s;
+	uint64_t count;
+	int i, np, cnt, slot;
+
+	if (bits < 0 || bits > MAX_HEIGHT * NODE_BITS || bits % NODE_BITS ||
+			(t->cow && cow_drain(t)))
+		return -1;
+	if (t->npending)
+		art_sync(t);
+	if (reclaim_start(t))
+		return -1;
+	reclaim_drain(t);
+
+	ref = prefix_find(t, prefix, bits / NODE_BITS, path, depths, &np);
+	if (!ref)
+		return 0;
+	victim = *ref;
+	// Only the subtree counts need the keys now, and have them at hand
+	count = t->counts ? subtree_count(t, victim) : 0;
+
+	// A node keeps at least two children, the last one replaces it
+	if (np && (cnt = child_refs(*path[np - 1], refs)) == 2) {
+		parent = *path[np - 1];
+		sibling = *refs[refs[0] == ref ? 1 : 0];
+		np--;
+	}
+
+	if (t->op_hook)
+		t->op_hook(t->op_data, ART_OP_DROP, prefix, bits, NULL);
+	slot = reclaim_slot(t);
+	prefix_log(t, ART_PREFIX_DROP, minimum(victim), 0, victim, parent, NULL, slot);
+	if (parent) {
+		*path[np] = sibling;
+		flush_buffer(path[np], sizeof(art_node *), true);
+	} else if (np) {
+		remove_child(*path[np - 1], ref);
+	} else {
+		t->root = NULL;
+		flush_buffer(&t->root, sizeof(art_node *), true);
+	}
+	prefix_finish(t);
+	if (t->hot)
+		hot_clear(t->hot);
+	reclaim_wake(t);
+
+	if (parent) {
+		counts_drop(t, parent);
+		node_free(t, parent);
+		// The sibling moved up, its header is stale until rewritten
+		if (!IS_LEAF(sibling))
+			recovery_prefix(sibling, depths[np]);
+	}
+	if (t->counts)
+		for (i = 0; i < np; i++)
+			if ((s = counts_slot(t->counts, *path[i]))->node)
+				s->count -= count;
+	if (t->dram && art_set_dram_levels(t, t->dram->levels))
+		return -1;
+	return 0;
+}
+
+/**
+ * Tells the hook of t of a key moved by an attach
+ */
+static int op_attach(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+	art_tree *t = data;
+	art_key k;
+
+	memcpy(&k, key, sizeof(art_key));
+	t->op_hook(t->op_data, ART_OP_INSERT, k, key_len, value);
+	return 0;
+}
+
+/**
+ * Moves every key of src into t with one persistent store, like
+ * an insert. All keys of src must start with the given top bits and
+ * no key of t may. src is empty afterwards.
+ * @arg t The tree
+ * @arg prefix A key whose top bits are the prefix
+ * @arg bits Length of the prefix, a multiple of NODE_BITS
+ * @arg src A tree built apart, in the same memory as t, that was
+ * not compacted and has the same multi-value setting
+ * @return 0 on success, -1 if a key of src lacks the prefix, t
+ * holds keys with the prefix, src cannot be moved or a node could
+ * not be allocated.
+ */
+int art_attach_prefix(art_tree *t, const art_key prefix, int bits, art_tree *src) {
+	art_node **path[MAX_HEIGHT + 1], **ref, **child = NULL, *graft = src->root, *n;
+	art_node *grown = NULL;
+	int depths[MAX_HEIGHT + 1];
+	art_node4 *node = NULL;
+	art_leaf *l, *m;
+	art_count_slot *s;
+	uint64_t count;
+	int i, np, add = 0, split = 0, depth = 0, digits = bits / NODE_BITS;
+
+	if (bits < 0 || bits > MAX_HEIGHT * NODE_BITS || bits % NODE_BITS || src == t ||
+			src->arenas || ((src->meta.flags ^ t->meta.flags) & ART_FLAG_MULTI) ||
+			(t->cow && cow_drain(t)) || (src->cow && cow_drain(src)))
+		return -1;
+	if (!graft)
+		return 0;
+	if (t->npending)
+		art_sync(t);
+	if (src->npending)
+		art_sync(src);
+
+	// Every key of src starts with the prefix iff its smallest does
+	l = minimum(graft);
+	if (!IS_LEAF(graft) && prefix_len(graft, 0) < digits)
+		return -1;
+	for (i = 0; i < digits; i++)
+		if (get_index(l->key, i) != get_index(prefix, i))
+			return -1;
+	if (prefix_find(t, prefix, digits, path, depths, &np))
+		return -1;
+	if (t->op_hook)
+		recursive_iter(src, graft, op_attach, t);
+
+	// Walk down like an insert of the smallest key, which stops above the prefix
+	ref = &t->root;
+	np = 0;
+	while ((n = *ref) && !IS_LEAF(n)) {
+		if (!HEADER_FRESH(&n->path, depth))
+			recovery_prefix(n, depth);
+		m = NULL;
+		split = prefix_mismatch(n, l->key, l->key_len, depth, &m);
+		if (split < n->path.partial_len)
+			break;
+		path[np++] = ref;
+		depth += n->path.partial_len;
+		if (!(child = find_child(n, get_index(l->key, depth)))) {
+			// The graft becomes a new child of n
+			add = 1;
+			break;
+		}
+		ref = child;
+		depth++;
+	}
+
+	if (n && !add) {
+		// Split the leaf or the prefix, the new node holds n and the graft
+		if (IS_LEAF(n))
+			split = longest_common_prefix(LEAF_RAW(n), l, depth);
+		else if (split >= MAX_PREFIX_LEN && !m)
+			m = minimum(n);
+		if (!(node = (art_node4 *)alloc_node(NODE4)))
+			return -1;
+		SET_DEPTH(&node->n.path, depth);
+		node->n.path.partial_len = split;
+		for (i = 0; i < min(MAX_PREFIX_LEN, split); i++)
+			node->n.path.partial[i] = get_index(l->key, depth + i);
+		add_child4_noflush(node, ref, IS_LEAF(n) ? get_index(LEAF_RAW(n)->key, depth + split) :
+				split < MAX_PREFIX_LEN ? n->path.partial[split] :
+				get_index(m->key, depth + split), n);
+		add_child4_noflush(node, ref, get_index(l->key, depth + split), graft);
+		flush_buffer(node, sizeof(art_node4), true);
+		depth += split;
+	}
+	if (add && grow_reserve(n, &grown))
+		return -1;
+
+	// Only the root of src was reached at another depth
+	if (!IS_LEAF(graft))
+		recovery_prefix(graft, depth + (node || add ? 1 : 0));
+
+	// The keys src dropped are counted before its size moves
+	art_reclaim_wait(src);
+	count = art_size(src);
+	prefix_log(t, ART_PREFIX_ATTACH, l, count, graft, NULL, src, 0);
+	if (add) {
+		add_child(t, n, ref, get_index(l->key, depth), graft, grown);
+	} else {
+		*ref = node ? (art_node *)node : graft;
+		flush_buffer(ref, sizeof(art_node *), true);
+	}
+	prefix_finish(t);
+	t->size += count;
+	if (node && !IS_LEAF(n))
+		recovery_prefix(n, depth + 1);
+
+	// A node grown by add_child() has no count yet
+	if (t->counts) {
+		counts_build(t, graft);
+		for (i = np - 1; i >= 0 && t->counts; i--) {
+			if ((s = counts_slot(t->counts, *path[i]))->node)
+				s->count += count;
+			else
+				counts_put(t, *path[i], subtree_count(t, *path[i]));
+		}
+		if (node)
+			counts_put(t, node, subtree_count(t, (art_node *)node));
+	}
+	if (t->dram && art_set_dram_levels(t, t->dram->levels))
+		return -1;
+
+	src->size = 0;
+	if (src->hot)
+		memset(src->hot->ways, 0, (src->hot->mask + 1) * sizeof(src->hot->ways[0]));
+	if (src->counts && art_set_counts(src, true))
+		return -1;
+	if (src->dram && art_set_dram_levels(src, src->dram->levels))
+		return -1;
+	return 0;
+}
+
+/**
+ * Waits until the subtrees dropped so far are reclaimed and stops
+ * the reclaim thread. Call it before the tree is unmapped.
+ * @arg t The tree
+ */
+void art_reclaim_wait(art_tree *t) {
+	art_reclaimer *r = t->reclaimer;
+
+	if (!r)
+		return;
+	pthread_mutex_lock(&r->lock);
+	r->stop = 1;
+	pthread_cond_signal(&r->wake);
+	pthread_mutex_unlock(&r->lock);
+#ifndef ART_CRASH_TEST
+	pthread_join(r->thread, NULL);
+#endif
+
+	reclaim_drain(t);
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->wake);
+	pthread_cond_destroy(&r->idle);
+	free(r);
+	t->reclaimer = NULL;
+}
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <byteswap.h>
+#include <pthread.h>
 #ifndef WORT_H
 #define WORT_H
 
@@ -8,16 +9,83 @@
 extern "C" {
 #endif
 
-/* If you want to change the number of entries, 
- * change the values of NODE_BITS & MAX_DEPTH */
+/* The geometry may be set before including this header, see
+ * src/geom/ for instances of several key widths in one binary.
+ * If you want to change the number of entries,
+ * change the value of NODE_BITS */
+#ifndef ART_KEY_BITS
+#define ART_KEY_BITS		64
+#endif
+#ifndef NODE_BITS
 #define NODE_BITS			4
-#define MAX_DEPTH			15
+#endif
+#define MAX_DEPTH			(ART_KEY_BITS / NODE_BITS - 1)
 #define NUM_NODE_ENTRIES 	(0x1UL << NODE_BITS)
 #define LOW_BIT_MASK		((0x1UL << NODE_BITS) - 1)
 
+/* ART_WIDE_HEADER doubles the node header to 16 bytes, which holds
+ * 13 prefix digits instead of 6 and is committed with cmpxchg16b.
+ * The last byte repeats the depth, so a header torn by a crash
+ * is caught like a stale one. */
+#ifdef ART_WIDE_HEADER
+#define ART_HEADER_ALIGN	16
+#else
+#define ART_HEADER_ALIGN	1
+#endif
+#ifndef MAX_PREFIX_LEN
+#ifdef ART_WIDE_HEADER
+#define MAX_PREFIX_LEN		13
+#else
 #define MAX_PREFIX_LEN		6
+#endif
+#endif
 #define MAX_HEIGHT			(MAX_DEPTH + 1)
 
+#if ART_KEY_BITS % NODE_BITS || NODE_BITS > 4
+#error "NODE_BITS must divide ART_KEY_BITS and leave room for the epoch of art_node16.occupied"
+#endif
+#if defined(ART_WIDE_HEADER) && MAX_PREFIX_LEN != 13
+#error "The wide node header holds 13 prefix digits"
+#elif MAX_PREFIX_LEN > 6 && !defined(ART_WIDE_HEADER)
+#error "The node header must fit one atomic 8-byte store"
+#endif
+
+#ifdef ART_NS
+#include "../geom/art_ns.h"
+#endif
+
+/* Persistent format of the tree. Bump ART_FORMAT_VERSION whenever
+ * the layout of art_tree or of any node changes. */
+#define ART_MAGIC			0x54524f57UL	/* "WORT" */
+#define ART_FORMAT_VERSION	8
+#define ART_SIZE_STRIPES	8
+#define ART_GROUP_COMMIT	64
+#define ART_DRAM_MAX_BITS	16
+#define ART_HOT_WAYS		8
+
+/* Bits of art_meta.flags */
+#define ART_FLAG_COUNTS		0x1
+#define ART_FLAG_MULTI		0x2
+
+#define ART_POSTING_SLOTS	14
+#define ART_TXN_MAX			16
+#define ART_RECLAIM_SLOTS	8
+
+/* Operations of art_prefix_log */
+#define ART_PREFIX_DROP		1
+#define ART_PREFIX_ATTACH	2
+
+/* Operations passed to an art_op_hook */
+#define ART_OP_INSERT		1
+#define ART_OP_TXN			2
+#define ART_OP_DROP			3
+#define ART_OP_REMOVE		4
+#define ART_OP_MULTI		5
+
+/* Returned by art_insert() when a node or leaf could not be
+ * allocated. The tree is left as it was. */
+#define ART_INSERT_FAILED	((void *)-1)
+
 #if defined(__GNUC__) && !defined(__clang__)
 # if __STDC_VERSION__ >= 199901L && 402 == (__GNUC__ * 100 + __GNUC_MINOR__)
 /*
@@ -29,8 +97,23 @@ extern "C" {
 # endif
 #endif
 
+#if ART_KEY_BITS == 32
+typedef uint32_t art_key;
+#elif ART_KEY_BITS == 64
+typedef unsigned long art_key;
+#elif ART_KEY_BITS == 128
+typedef unsigned __int128 art_key;
+#else
+#error "ART_KEY_BITS must be 32, 64 or 128"
+#endif
+
 typedef int(*art_callback)(void *data, const unsigned char *key, uint32_t key_len, void *value);
 
+/**
+ * Told of a change before it is made, see art_set_op_hook()
+ */
+typedef void(*art_op_hook)(void *data, int op, const art_key key, int key_len, void *value);
+
 /**
  * This struct is included as part
  * of all the various node sizes
@@ -39,13 +122,20 @@ typedef struct {
 	unsigned char depth;
 	unsigned char partial_len;
 	unsigned char partial[MAX_PREFIX_LEN];
-} art_node;
+#ifdef ART_WIDE_HEADER
+	unsigned char check;
+#endif
+} __attribute__((aligned(ART_HEADER_ALIGN))) art_node;
 
 /**
- * Full node with 16 children
+ * Full node with 16 children. occupied holds a bit per child that
+ * is set, under the epoch of the run that wrote it; it is never
+ * flushed in order, and one from an earlier run is ignored and
+ * rebuilt from the children.
  */
 typedef struct {
     art_node n;
+	uint64_t occupied;
 	art_node *children[NUM_NODE_ENTRIES];
 } art_node16;
 
@@ -56,33 +146,509 @@ typedef struct {
 typedef struct {
     void *value;
     uint32_t key_len;
-	unsigned long key;
+	art_key key;
 } art_leaf;
 
+/**
+ * Persistent tree metadata. Records the format version and the
+ * geometry the tree was built with, so that a binary compiled with
+ * different NODE_BITS/MAX_DEPTH/MAX_PREFIX_LEN refuses to open it.
+ */
+typedef struct {
+	uint64_t magic;
+	uint32_t version;
+	unsigned char node_bits;
+	unsigned char max_depth;
+	unsigned char max_prefix_len;
+	unsigned char flags;
+	unsigned char dram_levels;
+} art_meta;
+
+/**
+ * Where a search for keys with a given top digits starts:
+ * the child pointer found after those digits and its depth.
+ */
+typedef struct {
+	art_node *node;
+	int depth;
+} art_dram_slot;
+
+/**
+ * DRAM mirror of the top levels of the tree, one slot per
+ * combination of the top `levels` digits. dirty is the
+ * shallowest depth changed by the insert in progress.
+ */
+typedef struct {
+	int levels;
+	int dirty;
+	art_dram_slot slots[];
+} art_dram;
+
+/**
+ * Persistent leaf counter, one per writer thread.
+ * count holds (leaves << 1) | pending. The pending bit marks a
+ * new-key insert that may or may not have been committed, and
+ * key/key_len name it so that recovery resolves it with a single
+ * lookup instead of a full walk.
+ */
+typedef struct {
+	uint64_t count;
+	art_key key;
+	uint32_t key_len;
+} __attribute__((aligned(64))) art_size_stripe;
+
+/**
+ * Hot key cache, a set associative hash of leaf pointers in DRAM.
+ * Each way holds a 16-bit key tag in the top bits and the leaf
+ * pointer in the low 48 bits, so it is read and replaced with one
+ * atomic 8-byte access and no locks.
+ */
+typedef struct {
+	unsigned long mask;
+	uint64_t ways[][ART_HOT_WAYS];
+} art_hot_cache;
+
+/**
+ * Number of leaves under an inner node
+ */
+typedef struct {
+	const void *node;
+	uint64_t count;
+} art_count_slot;
+
+/**
+ * Subtree counts, an open addressing hash of inner nodes in DRAM.
+ * A node that is not in the table has no count yet.
+ */
+typedef struct {
+	unsigned long mask;
+	unsigned long used;
+	art_count_slot slots[];
+} art_counts;
+
+/**
+ * Header of a compaction arena, one allocation holding a subtree
+ * relocated by art_compact(). The arenas are linked from the tree
+ * so that art_tree_open() finds them again.
+ */
+typedef struct art_arena {
+	struct art_arena *next;
+	uint64_t size;
+} __attribute__((aligned(64))) art_arena;
+
+/**
+ * An arena and the number of its nodes and leaves still in the
+ * tree. The arena is freed once none is left.
+ */
+typedef struct {
+	art_arena *arena;
+	uintptr_t end;
+	uint64_t live;
+} art_arena_slot;
+
+/**
+ * Arenas of a tree in DRAM, sorted by address
+ */
+typedef struct {
+	unsigned long n;
+	unsigned long max;
+	art_arena_slot slots[];
+} art_arena_map;
+
+/**
+ * Chunk of the posting list of a key in multi-value mode, see
+ * art_set_multi_value(). The value of the leaf points to the first
+ * chunk. A value is added by writing a free slot and then setting
+ * its bit in bitmap with one atomic store, and removed by clearing
+ * the bit.
+ */
+typedef struct art_posting {
+	struct art_posting *next;
+	uint64_t bitmap;
+	void *values[ART_POSTING_SLOTS];
+} __attribute__((aligned(64))) art_posting;
+
+/**
+ * One put of a transaction
+ */
+typedef struct {
+	art_key key;
+	void *value;
+	uint32_t key_len;
+} art_txn_entry;
+
+/**
+ * Persistent redo log of a transaction, one per writer thread.
+ * count is the number of entries of a committed transaction that
+ * may not be applied yet, 0 when the log is empty.
+ */
+typedef struct {
+	uint64_t count;
+	art_txn_entry entries[ART_TXN_MAX];
+} __attribute__((aligned(64))) art_txn_log;
+
+/**
+ * Persistent record of a prefix drop or attach in progress, see
+ * art_drop_prefix(). key is a key of the moved subtree, so that
+ * recovery learns whether the publishing store survived with a
+ * single lookup, like for a pending insert.
+ */
+typedef struct {
+	uint64_t op;
+	art_key key;
+	uint32_t key_len;
+	uint64_t count;
+	int64_t adjust;
+	art_node *subtree;
+	art_node *parent;
+	void *src;
+	uint64_t slot;
+} __attribute__((aligned(64))) art_prefix_log;
+
+/**
+ * Background reclaim of dropped subtrees. The thread detaches
+ * nodes and leaves from the subtrees in art_tree.reclaim and
+ * queues them in freed, and the writer frees them.
+ */
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t idle;
+	int stop;
+	unsigned long nfree;
+	unsigned long max;
+	void **freed;
+} art_reclaimer;
+
+/**
+ * A node or leaf replaced while views were open, freed once the
+ * views up to seq are closed
+ */
+typedef struct {
+	void *p;
+	uint64_t seq;
+} art_retired;
+
+/**
+ * Volatile copy-on-write state, see art_view_open(). fresh holds
+ * the nodes and leaves created since the newest view, which no
+ * view reaches and writers change in place.
+ */
+typedef struct {
+	struct art_view *views;
+	uint64_t seq;
+	unsigned long mask;
+	unsigned long nfresh;
+	void **fresh;
+	unsigned long nretired;
+	unsigned long max;
+	art_retired *retired;
+} art_cow;
+
 /**
  * Main struct, points to root.
+ * The whole struct is persistent except size, which is the
+ * sum of the stripes and size_adjust and is recomputed by
+ * art_tree_open(). The keys of dropped subtrees stay in it;
+ * reclaimed counts them as the reclaim thread takes the subtrees
+ * apart, and reclaim_post[i] holds the new value of reclaimed
+ * while slot i is being counted, for recovery to redo.
  */
 typedef struct {
     art_node *root;
     uint64_t size;
+    art_meta meta;
+    art_size_stripe stripes[ART_SIZE_STRIPES];
+    art_arena *arenas;
+    art_txn_log txn_logs[ART_SIZE_STRIPES];
+    int64_t size_adjust;
+    art_prefix_log prefix_log;
+    art_node *reclaim[ART_RECLAIM_SLOTS];
+    uint64_t reclaimed;
+    uint64_t reclaim_post[ART_RECLAIM_SLOTS];
+    uint64_t epoch;
+
+    /* Volatile group commit state, see art_insert_async() */
+    int async;
+    int npending;
+    uint64_t nadded;
+    uint64_t issued;
+    uint64_t durable;
+    void *pending[ART_GROUP_COMMIT];
+
+    /* Volatile mirror of the top levels, see art_set_dram_levels() */
+    art_dram *dram;
+
+    /* Volatile hot key cache, see art_set_hot_cache() */
+    art_hot_cache *hot;
+
+    /* Volatile subtree counts, see art_set_counts() */
+    art_counts *counts;
+
+    /* Volatile arena index and cursor, see art_compact() */
+    art_arena_map *arena_map;
+    int compact_next;
+
+    /* Volatile reclaim of dropped subtrees, see art_drop_prefix() */
+    art_reclaimer *reclaimer;
+
+    /* Volatile copy-on-write for open views, see art_view_open() */
+    art_cow *cow;
+
+    /* Volatile hook told of every change, see art_set_op_hook() */
+    art_op_hook op_hook;
+    void *op_data;
 } art_tree;
 
+/**
+ * Identifies an asynchronous insert, see art_durable()
+ */
+typedef uint64_t art_ticket;
+
+/**
+ * A transaction being built, in DRAM until art_txn_commit()
+ */
+typedef struct {
+	art_tree *t;
+	int n;
+	art_txn_entry entries[ART_TXN_MAX];
+} art_txn;
+
+/**
+ * A read-only view of a tree at one point in time, see
+ * art_view_open()
+ */
+typedef struct art_view {
+	art_tree *t;
+	art_node *root;
+	uint64_t size;
+	uint64_t seq;
+	int closed;
+	struct art_view *next;
+} art_view;
+
+/**
+ * Shape of a tree, see art_stats(). The depth of a leaf is the
+ * number of inner nodes above it. The fill factor of the nodes is
+ * children / (nodes * NUM_NODE_ENTRIES). bytes counts nodes and
+ * leaves rounded up to their 64-byte allocation, of which waste
+ * bytes are padding.
+ */
+typedef struct {
+	uint64_t nodes;
+	uint64_t children;
+	uint64_t leaves;
+	uint64_t leaf_depth[MAX_HEIGHT + 1];
+	uint64_t long_prefix;
+	uint64_t stale;
+	uint64_t bytes;
+	uint64_t waste;
+} art_tree_stats;
+
+/**
+ * Marks memory reached by art_check(), see there
+ * @return 0 if ptr lies in allocated memory, else non-zero.
+ */
+typedef int(*art_check_fn)(void *data, const void *ptr);
+
+/**
+ * Findings of art_check(). Stale headers and pending recovery are
+ * what a crash leaves behind and the tree handles them itself; the
+ * bad_* counts are damage. bad_header counts fresh headers whose
+ * prefix disagrees with the leaves, bad_node nodes with fewer than
+ * two children or a broken layout, bad_leaf leaves off the path to
+ * them, duplicate keys and broken posting lists, bad_pointer
+ * pointers the mark function rejected. bad_size is 1 if the
+ * persistent size is not the number of leaves.
+ */
+typedef struct {
+	uint64_t nodes;
+	uint64_t leaves;
+	uint64_t stale;
+	uint64_t pending;
+	uint64_t bad_header;
+	uint64_t bad_node;
+	uint64_t bad_leaf;
+	uint64_t bad_pointer;
+	uint64_t bad_size;
+	uint64_t repaired;
+} art_check_report;
+
 /**
  * Initializes an ART tree
  * @return 0 on success.
  */
 int art_tree_init(art_tree *t);
 
+/**
+ * Opens a tree that was initialized by a previous run,
+ * possibly one that crashed, and recomputes its size.
+ * @return 0 on success, -1 if the tree was built with a
+ * different format version or geometry.
+ */
+int art_tree_open(art_tree *t);
+
+/**
+ * Replaces the allocator of nodes and leaves, e.g. to place them
+ * in a persistent memory pool. The default is posix_memalign()
+ * with 64-byte alignment and free().
+ * @arg alloc Returns 64-byte aligned memory of the given size, or
+ * NULL. Leaves placed at or above 2^48 fail the insert.
+ * @arg release Frees memory returned by alloc
+ */
+void art_set_allocator(void* (*alloc)(unsigned long size), void (*release)(void *ptr));
+
+/**
+ * Tells hook of every change to the tree before it is made, e.g.
+ * to append it to an operation log. An insert is passed as
+ * ART_OP_INSERT with its key and value. The inserts of a
+ * transaction are passed as ART_OP_TXN except the last one, which
+ * is ART_OP_INSERT. A prefix drop is passed as ART_OP_DROP with
+ * the prefix as key and its bits as key_len, an attach as the
+ * inserts of the keys it moves. art_remove_value() is passed as
+ * ART_OP_REMOVE with its key and value, art_set_multi_value() as
+ * ART_OP_MULTI with the setting as key_len. The hook is volatile.
+ * @arg t The tree
+ * @arg hook The hook, NULL to remove it
+ * @arg data Opaque handle passed to the hook
+ */
+void art_set_op_hook(art_tree *t, art_op_hook hook, void *data);
+
+/**
+ * Mirrors the top levels of the tree in DRAM. Searches start at
+ * the mirrored slot of their top digits instead of walking those
+ * levels in PM. The setting is persistent: art_tree_open()
+ * rebuilds the mirror.
+ * @arg t The tree
+ * @arg levels Number of mirrored levels, 0 disables the mirror.
+ * levels * NODE_BITS may not exceed ART_DRAM_MAX_BITS.
+ * @return 0 on success.
+ */
+int art_set_dram_levels(art_tree *t, int levels);
+
+/**
+ * Puts a cache of recently found leaves in front of art_search().
+ * Hits skip the whole walk from the root. The cache is volatile
+ * and starts empty, also after art_tree_open().
+ * @arg t The tree
+ * @arg sets Number of sets of ART_HOT_WAYS entries, a power of
+ * two. 0 removes the cache.
+ * @return 0 on success.
+ */
+int art_set_hot_cache(art_tree *t, unsigned long sets);
+
+/**
+ * Keeps the number of leaves under every inner node, so that
+ * art_rank(), art_count_range() and art_select() take time
+ * proportional to the tree height instead of a scan. The counts
+ * live in DRAM; the setting is persistent and art_tree_open()
+ * rebuilds them.
+ * @arg t The tree
+ * @arg enable Whether to maintain the counts
+ * @return 0 on success.
+ */
+int art_set_counts(art_tree *t, bool enable);
+
+/**
+ * Lets a key hold several values. art_insert() then adds the value
+ * to the posting list of the key instead of replacing it, and
+ * art_search() returns one of the values. The setting is
+ * persistent and can only be changed while the tree is empty.
+ * @arg t The tree
+ * @arg enable Whether keys hold several values
+ * @return 0 on success, -1 if the tree is not empty or a view
+ * is open.
+ */
+int art_set_multi_value(art_tree *t, bool enable);
+
+/**
+ * Returns the size of the ART tree. Keys of dropped subtrees
+ * count until the reclaim thread reaches them.
+ */
+#ifdef BROKEN_GCC_C99_INLINE
+# define art_size(t) ((t)->size - (t)->reclaimed)
+#else
+static inline uint64_t art_size(const art_tree *t) {
+    return t->size - __atomic_load_n(&t->reclaimed, __ATOMIC_ACQUIRE);
+}
+#endif
+
 /**
  * Inserts a new value into the ART tree
  * @arg t The tree
  * @arg key The key
  * @arg key_len The length of the key
  * @arg value Opaque value.
+ * @return NULL if the item was newly inserted or, in multi-value
+ * mode, added; otherwise the old value pointer is returned, or
+ * ART_INSERT_FAILED if memory ran out.
+ */
+void* art_insert(art_tree *t, const art_key key, int key_len, void *value);
+
+/**
+ * Inserts a new value without waiting for it to become durable.
+ * The tree is updated immediately, but the flush and fence of the
+ * commit store are deferred and shared by the whole group.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @arg ticket If not NULL, receives the ticket of this insert
  * @return NULL if the item was newly inserted, otherwise
- * the old value pointer is returned.
+ * the old value pointer is returned, or ART_INSERT_FAILED.
  */
-void* art_insert(art_tree *t, const unsigned long key, int key_len, void *value);
+void* art_insert_async(art_tree *t, const art_key key, int key_len, void *value,
+		art_ticket *ticket);
+
+/**
+ * Makes every asynchronous insert issued so far durable with one
+ * fence. A fence only drains the flushes of its own core, so this
+ * must be called by the thread that issued the inserts.
+ * @arg t The tree
+ */
+void art_sync(art_tree *t);
+
+/**
+ * Checks whether an asynchronous insert is durable
+ * @arg t The tree
+ * @arg ticket The ticket returned by art_insert_async()
+ * @return true once the insert survives a crash.
+ */
+bool art_durable(const art_tree *t, art_ticket ticket);
+
+/**
+ * Starts a transaction, a group of inserts that survive a crash
+ * all together or not at all. Nothing is written before
+ * art_txn_commit(); dropping the transaction aborts it.
+ * @arg t The tree
+ * @arg tx The transaction
+ * @return 0 on success, -1 in multi-value mode, where replaying
+ * an insert is not idempotent.
+ */
+int art_txn_begin(art_tree *t, art_txn *tx);
+
+/**
+ * Adds an insert to a transaction
+ * @arg tx The transaction
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value Opaque value.
+ * @return 0 on success, -1 if the transaction holds ART_TXN_MAX
+ * inserts already.
+ */
+int art_txn_put(art_txn *tx, const art_key key, int key_len, void *value);
+
+/**
+ * Commits a transaction. Its inserts are written to the redo log
+ * of the thread and committed with one store of the log count,
+ * then applied to the tree as one group of asynchronous inserts
+ * and synced. art_tree_open() replays a log that was committed
+ * but not yet applied.
+ * @arg tx The transaction, empty again afterwards
+ * @return 0 on success.
+ */
+int art_txn_commit(art_txn *tx);
 
 /**
  * Searches for a value in the ART tree
@@ -92,7 +658,260 @@ void* art_insert(art_tree *t, const unsigned long key, int key_len, void *value)
  * @return NULL if the item was not found, otherwise
  * the value pointer is returned.
  */
-void* art_search(const art_tree *t, const unsigned long key, int key_len);
+void* art_search(const art_tree *t, const art_key key, int key_len);
+
+/**
+ * Iterates over the values of a key in multi-value mode, in no
+ * particular order, with the callback of art_iter()
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_values(const art_tree *t, const art_key key, int key_len, art_callback cb, void *data);
+
+/**
+ * Counts the values of a key in multi-value mode
+ * @return the number of values, 0 if the key is not found.
+ */
+uint64_t art_value_count(const art_tree *t, const art_key key, int key_len);
+
+/**
+ * Removes one occurrence of a value from a key in multi-value mode.
+ * The key stays in the tree, also without values.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @arg value The value to remove
+ * @return 0 on success, -1 if the key does not hold the value.
+ */
+int art_remove_value(art_tree *t, const art_key key, int key_len, void *value);
+
+/**
+ * Counts the keys smaller than the given key. Without
+ * art_set_counts() this walks the subtrees left of the key.
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return the number of smaller keys.
+ */
+uint64_t art_rank(const art_tree *t, const art_key key, int key_len);
+
+/**
+ * Counts the keys in [lo, hi]
+ * @arg t The tree
+ * @arg lo The smallest key of the range
+ * @arg lo_len The length of lo
+ * @arg hi The largest key of the range
+ * @arg hi_len The length of hi
+ * @return the number of keys in the range, 0 if lo > hi.
+ */
+uint64_t art_count_range(const art_tree *t, const art_key lo, int lo_len,
+		const art_key hi, int hi_len);
+
+/**
+ * Finds the leaf with the given rank, i.e. the one that has
+ * exactly rank smaller keys.
+ * @arg t The tree
+ * @arg rank The rank, from 0 to art_size() - 1
+ * @return the leaf, or NULL if rank is out of range.
+ */
+art_leaf* art_select(const art_tree *t, uint64_t rank);
+
+/**
+ * Finds the smallest key that is not below the given key, with
+ * one descent
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return the leaf, or NULL if all keys are below key.
+ */
+art_leaf* art_lower_bound(const art_tree *t, const art_key key, int key_len);
+
+/**
+ * Finds the largest key that is not above the given key, with
+ * one descent
+ * @arg t The tree
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return the leaf, or NULL if all keys are above key.
+ */
+art_leaf* art_floor(const art_tree *t, const art_key key, int key_len);
+
+/**
+ * Walks the whole tree and describes its shape: the nodes and
+ * their fill, the depth of the leaves, the prefixes longer than
+ * MAX_PREFIX_LEN, the headers left stale by a crash and the memory
+ * used. The tree must not be modified during the walk.
+ * @arg t The tree
+ * @arg stats Filled with the shape of the tree
+ * @arg threads Number of threads walking the children of the
+ * root, 1 to walk in the calling thread
+ * @return 0 on success.
+ */
+int art_stats(const art_tree *t, art_tree_stats *stats, int threads);
+
+/**
+ * Visits the keys in [lo, hi] from several threads, for scans
+ * and aggregates over much of the tree. The subtrees below the
+ * root are tasks on a work-stealing pool: a thread that runs dry
+ * steals the largest queued subtree, and while threads are idle
+ * a busy one queues the rest of the children of the node it
+ * walks. Keys are visited in ascending order within a task only.
+ * The tree must not be modified during the scan.
+ * @arg t The tree
+ * @arg lo The smallest key of the range
+ * @arg hi The largest key of the range
+ * @arg cb The callback, called concurrently from the threads.
+ * If it returns non-zero, the scan stops.
+ * @arg data Per-thread handles for a reduction: data[i] is passed
+ * to the callback in thread i, the calling thread is thread 0.
+ * NULL passes NULL.
+ * @arg threads Number of threads, 1 to scan in the calling thread
+ * @return 0 on success, the return of a callback that stopped
+ * the scan, or -1 if memory ran out.
+ */
+int art_parallel_scan(const art_tree *t, const art_key lo, const art_key hi,
+		art_callback cb, void **data, int threads);
+
+/**
+ * Checks every node and leaf of a tree that is not open for
+ * writing, e.g. offline after a crash: that the header of a node
+ * holds the prefix its leaves share at the depth it is reached
+ * at, that every leaf lies on the path of its key, that the nodes
+ * are well formed and that the persistent size matches. The
+ * subtrees below the top levels are checked from several threads.
+ * Call it before art_tree_open() to see the image a crash left,
+ * or after it to check a recovered tree.
+ * @arg t The tree
+ * @arg report Filled with the findings
+ * @arg mark If not NULL, called concurrently for every node, leaf,
+ * posting chunk, compaction arena and dropped subtree the tree
+ * holds, so that the caller can find unreachable allocations.
+ * Pointers it rejects are counted and not followed.
+ * @arg data Opaque handle passed to mark
+ * @arg threads Number of threads, 1 to check in the calling thread
+ * @arg repair Whether to rewrite stale and wrong headers the way
+ * recovery does, rebuild broken node layouts from their valid
+ * entries and reset the size to the number of leaves
+ * @return 0 on success, -1 if t is not a tree of this geometry
+ * or memory ran out.
+ */
+int art_check(art_tree *t, art_check_report *report, art_check_fn mark, void *data,
+		int threads, bool repair);
+
+/**
+ * Relocates subtrees under the root, each into one arena in depth
+ * first order, so that a lookup touches neighbouring memory. Each
+ * copy is published with a single pointer store like an insert,
+ * then the old nodes and leaves are freed; an arena is returned
+ * to the allocator once all its contents were replaced. Pointers
+ * to leaves, e.g. from art_select(), are invalid afterwards.
+ * Successive calls continue where the last one stopped, so the
+ * work can be spread between inserts.
+ * @arg t The tree
+ * @arg subtrees Number of children of the root to relocate,
+ * 0 for all of them
+ * @return 0 on success, -1 if memory ran out or a view is open.
+ */
+int art_compact(art_tree *t, int subtrees);
+
+/**
+ * Removes every key that starts with the given top bits. The
+ * subtree holding them is unlinked with one persistent pointer
+ * store, or its sibling takes the place of their common parent,
+ * and a background thread reclaims its nodes and leaves. The
+ * cost does not depend on the number of keys removed.
+ * art_size() keeps counting them until the reclaim thread has
+ * taken the subtree apart, see art_reclaim_wait().
+ * @arg t The tree
+ * @arg prefix A key whose top bits are the prefix
+ * @arg bits Length of the prefix, a multiple of NODE_BITS
+ * @return 0 on success, also if no key has the prefix, -1 if
+ * bits is invalid, a view is open or the reclaim thread cannot
+ * be started.
+ */
+int art_drop_prefix(art_tree *t, const art_key prefix, int bits);
+
+/**
+ * Moves every key of src into t with one persistent pointer
+ * store. All keys of src must start with the given top bits and
+ * no key of t may. src is empty afterwards.
+ * @arg t The tree
+ * @arg prefix A key whose top bits are the prefix
+ * @arg bits Length of the prefix, a multiple of NODE_BITS
+ * @arg src A tree built apart, in the same memory as t, that was
+ * not compacted and has the same multi-value setting
+ * @return 0 on success, -1 if a key of src lacks the prefix, t
+ * holds keys with the prefix, a view of either tree is open or
+ * src cannot be moved.
+ */
+int art_attach_prefix(art_tree *t, const art_key prefix, int bits, art_tree *src);
+
+/**
+ * Waits until the subtrees dropped so far are reclaimed and stops
+ * the reclaim thread. Call it before the tree is unmapped.
+ * @arg t The tree
+ */
+void art_reclaim_wait(art_tree *t);
+
+/**
+ * Iterates through the entries pairs in the map,
+ * invoking a callback for each. The call back gets a
+ * key, value for each and returns an integer stop value.
+ * If the callback returns non-zero, then the iteration stops.
+ * Keys are visited in ascending order and passed as a
+ * pointer to the art_key key.
+ * In multi-value mode every value of a key is visited.
+ * @arg t The tree to iterate over
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter(art_tree *t, art_callback cb, void *data);
+
+/**
+ * Opens a read-only view of the tree as it is now. While views
+ * are open, an insert copies the nodes on its path that a view
+ * reaches instead of changing them, and publishes the copies with
+ * one persistent pointer store; the replaced versions are freed
+ * once the views that reach them are closed. Views are volatile
+ * and do not survive a crash. Call it from the writing thread;
+ * the view may be read and closed from any thread.
+ * @arg t The tree, not in multi-value mode
+ * @return the view, or NULL if t is in multi-value mode or
+ * memory ran out.
+ */
+art_view* art_view_open(art_tree *t);
+
+/**
+ * Searches for a value in a view
+ * @arg v The view
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return NULL if the view does not hold the key, otherwise
+ * the value pointer is returned.
+ */
+void* art_view_search(const art_view *v, const art_key key, int key_len);
+
+/**
+ * Iterates over the keys of a view in ascending order, with
+ * the callback of art_iter(), while writers go on
+ * @arg v The view
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_view_iter(const art_view *v, art_callback cb, void *data);
+
+/**
+ * Closes a view. v must not be used afterwards; the writer frees
+ * it and the versions only it reached at its next insert.
+ * @arg v The view
+ */
+void art_view_close(art_view *v);
 
 #ifdef __cplusplus
 }